@@ -0,0 +1,29 @@
+#!/bin/sh
+# Compare benchmark results against a baseline; both are "name value" lines
+# ('#' comments allowed). Metrics ending in _per_sec are better higher,
+# those ending in _ns, _us or _ms better lower. Exits 1 when any baseline
+# metric is missing or worse by more than BENCH_TOLERANCE percent (40).
+#
+# usage: bench/compare.sh baseline results
+set -eu
+
+awk -v tol="${BENCH_TOLERANCE:-40}" '
+    /^#/ || NF < 2 { next }
+    FNR == NR { base[$1] = $2; order[n++] = $1; next }
+    { cur[$1] = $2 }
+    END {
+        bad = 0
+        printf "%-28s %14s %14s %8s\n", "metric", "baseline", "current", "change"
+        for (i = 0; i < n; i++) {
+            m = order[i]
+            if (!(m in cur)) { printf "%-28s %14s %14s %8s  MISSING\n", m, base[m], "-", "-"; bad = 1; continue }
+            b = base[m] + 0; c = cur[m] + 0
+            change = b ? (c - b) / b * 100 : 0
+            higher = m ~ /_per_sec$/
+            worse = higher ? -change : change
+            flag = worse > tol ? "  REGRESSION" : ""
+            if (flag != "") bad = 1
+            printf "%-28s %14s %14s %+7.1f%%%s\n", m, base[m], cur[m], change, flag
+        }
+        exit bad
+    }' "$1" "$2"
@@ -0,0 +1,55 @@
+/* Pipeline stage for the fd hygiene check: appends the descriptors it was
+ * started with (from /proc/self/fd, in order) as one line to LOG, then
+ * copies stdin to stdout. A stage that inherited nothing it should not
+ * have writes "0 1 2".
+ *
+ * usage: bench/fdcount LOG
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) { fprintf(stderr, "usage: %s LOG\n", argv[0]); return 2; }
+
+    int fds[1024], n = 0;
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) { perror("/proc/self/fd"); return 1; }
+    struct dirent *e;
+    while ((e = readdir(d)) && n < 1024) {
+        if (e->d_name[0] == '.') continue;
+        int fd = atoi(e->d_name);
+        if (fd != dirfd(d)) fds[n++] = fd;
+    }
+    closedir(d);
+    qsort(fds, n, sizeof(int), cmp_int);
+
+    /* one write per line so concurrent stages never interleave */
+    char line[8192];
+    size_t len = 0;
+    for (int i = 0; i < n && len + 16 < sizeof(line); i++)
+        len += snprintf(line + len, sizeof(line) - len, "%s%d", i ? " " : "", fds[i]);
+    line[len++] = '\n';
+    int log = open(argv[1], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log < 0 || write(log, line, len) != (ssize_t)len) { perror(argv[1]); return 1; }
+    close(log);
+
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(0, buf, sizeof(buf))) > 0)
+        for (ssize_t off = 0; off < r; ) {
+            ssize_t w = write(1, buf + off, r - off);
+            if (w < 0) { perror("write"); return 1; }
+            off += w;
+        }
+    return r < 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+# File descriptor hygiene: runs a BENCH_FD_STAGES-stage (64) pipeline of
+# bench/fdcount under each launch path, then again with fastpipes between a
+# file source and a file sink, and with parlaunch, and checks every stage
+# saw only fds 0, 1 and 2. Exits 1 and prints the offending lines when a
+# stage inherited anything else (a pipe end, a redirection file, a
+# shell-internal fd).
+#
+# usage: bench/fds.sh [path/to/tsh]
+set -eu
+
+TSH=${1:-./tsh}
+STAGES=${BENCH_FD_STAGES:-64}
+here=$(cd "$(dirname "$0")" && pwd)
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT INT TERM
+seq 1 1000 > "$dir/in"
+
+# stages <log> [redirection of the first stage]
+stages() {
+    line="$here/fdcount $1${2:+ $2}"
+    i=1
+    while [ "$i" -lt "$STAGES" ]; do line="$line | $here/fdcount $1"; i=$((i + 1)); done
+    echo "$line"
+}
+
+bad=0
+# check <name> <launch path> <option line> <pipeline> [first-stage redirection]
+check() {
+    log=$dir/$1.log
+    : > "$log"
+    TSH_LAUNCH=$2 "$TSH" -c "$3
+$(printf "$4" "$(stages "$log" "${5:-}")")" > "$dir/out" < /dev/null
+    if ! cmp -s "$dir/in" "$dir/out"; then
+        echo "fds_$1 FAIL: output differs from input"; bad=1; return
+    fi
+    got=$(wc -l < "$log")
+    leaks=$(grep -cvx '0 1 2' "$log" || true)
+    if [ "$got" -ne "$STAGES" ] || [ "$leaks" -ne 0 ]; then
+        echo "fds_$1 FAIL: $got of $STAGES stages reported, $leaks with extra fds"
+        sort "$log" | uniq -c | sort -rn | head -5
+        bad=1
+    else
+        echo "fds_$1 ok"
+    fi
+}
+
+for m in spawn vfork fork; do
+    check "$m" "$m" "set +o fastpipes" "%s" "< $dir/in"
+done
+check fastpipes spawn "set -o fastpipes" "cat $dir/in | %s | cat > $dir/sink; cat $dir/sink"
+check parlaunch spawn "set -o parlaunch" "%s" "< $dir/in"
+exit $bad
@@ -0,0 +1,50 @@
+#!/bin/sh
+# find builtin against the path it replaced (system() -> /bin/sh ->
+# /usr/bin/find) on a generated tree of DIRS directories with
+# BENCH_FILES_PER_DIR files each. Point BENCH_TREE at an existing tree to
+# measure that instead. Best of BENCH_RUNS warm-cache runs.
+#
+# usage: bench/find.sh [path/to/tsh] [dirs]
+set -eu
+
+TSH=$(cd "$(dirname "${1:-./tsh}")" && pwd)/$(basename "${1:-./tsh}")
+DIRS=${2:-${BENCH_DIRS:-2000}}
+PER=${BENCH_FILES_PER_DIR:-100}
+RUNS=${BENCH_RUNS:-3}
+
+if [ -n "${BENCH_TREE:-}" ]; then
+    tree=$BENCH_TREE
+else
+    tree=$(mktemp -d)
+    trap 'rm -rf "$tree"' EXIT INT TERM
+    awk -v n="$DIRS" -v t="$tree" 'BEGIN { for (i = 0; i < n; i++) printf "%s/d%d/s%d\n", t, i % 40, i }' |
+        xargs mkdir -p
+    awk -v n="$DIRS" -v per="$PER" -v t="$tree" 'BEGIN {
+        for (i = 0; i < n; i++)
+            for (j = 0; j < per; j++)
+                printf "%s/d%d/s%d/f%d.%s\n", t, i % 40, i, j, (j % 10 ? "txt" : "c")
+    }' | xargs touch
+fi
+cd "$tree"
+
+now_ns() { date +%s%N; }
+
+# best_ms <command...>: fastest of RUNS runs, after one warm-up
+best_ms() {
+    "$@" > /dev/null
+    best=
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        t0=$(now_ns)
+        "$@" > /dev/null
+        t1=$(now_ns)
+        t=$((t1 - t0))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        i=$((i + 1))
+    done
+    awk -v ns="$best" 'BEGIN { printf "%.1f\n", ns / 1e6 }'
+}
+
+echo "find_tree_entries $(find . | wc -l)"
+echo "find_system_ms $(best_ms sh -c 'find . -name "*.c"')"
+echo "find_builtin_ms $(best_ms "$TSH" -c 'find *.c')"
@@ -0,0 +1,71 @@
+#!/bin/sh
+# History at scale: an interactive tsh (driven through a pty by
+# bench/ptydrive) on a generated history of BENCH_HIST entries, against one
+# with an empty history. Startup must not grow with the file; the first
+# search pays for building the trigram index, later ones walk it. Best of
+# BENCH_RUNS runs.
+#
+# usage: bench/history.sh [path/to/tsh] [entries]
+set -eu
+
+TSH=${1:-./tsh}
+N=${2:-${BENCH_HIST:-1000000}}
+RUNS=${BENCH_RUNS:-3}
+here=$(dirname "$0")
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+awk -v n="$N" 'BEGIN {
+    srand(1)
+    for (i = 0; i < n; i++)
+        printf "git commit -m \"change %d\" src/mod%d.c && make -j%d test%d\n", i, i % 701, i % 16, int(rand() * 50000)
+}' > "$tmp/full"
+: > "$tmp/empty"
+
+now_ns() { date +%s%N; }
+
+# run HISTFILE LINES...: ns from exec to exit, history restored afterwards
+# (the lines are appended to it)
+run() {
+    hist=$1
+    shift
+    cp "$tmp/$hist" "$tmp/h"
+    if [ -f "$tmp/$hist.idx" ]; then cp "$tmp/$hist.idx" "$tmp/h.idx"; else rm -f "$tmp/h.idx"; fi
+    for line in "$@"; do echo "$line"; done > "$tmp/lines"
+    t0=$(now_ns)
+    TSH_HISTFILE="$tmp/h" "$here/ptydrive" "$TSH" < "$tmp/lines" > /dev/null
+    t1=$(now_ns)
+    echo $((t1 - t0))
+}
+
+# best HISTFILE LINES...: fastest of RUNS runs
+best() {
+    b=
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        t=$(run "$@")
+        if [ -z "$b" ] || [ "$t" -lt "$b" ]; then b=$t; fi
+        i=$((i + 1))
+    done
+    echo "$b"
+}
+
+# the first open of an unindexed file builds FILE.idx with one scan
+rebuild=$(run full true)
+cp "$tmp/h.idx" "$tmp/full.idx"
+: > "$tmp/empty.idx"
+
+start_empty=$(best empty true)
+start_full=$(best full true)
+q='history -s test4242 > /dev/null'
+one=$(best full "$q")
+eleven=$(best full "$q" "$q" "$q" "$q" "$q" "$q" "$q" "$q" "$q" "$q" "$q")
+
+echo "history_entries $N"
+awk -v r="$rebuild" -v e="$start_empty" -v f="$start_full" -v one="$one" -v ten="$eleven" 'BEGIN {
+    printf "history_index_rebuild_ms %.1f\n", r / 1e6
+    printf "history_startup_empty_ms %.2f\n", e / 1e6
+    printf "history_startup_full_ms %.2f\n", f / 1e6
+    printf "history_first_search_ms %.1f\n", (one - f) / 1e6
+    printf "history_search_us %.0f\n", (ten - one) / 10 / 1e3
+}'
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Launch throughput: run N trivial external commands through tsh once per
+# launch path and report commands per second.
+#
+# usage: bench/launch.sh [path/to/tsh] [N]
+set -eu
+
+TSH=${1:-./tsh}
+N=${2:-${BENCH_N:-5000}}
+TRUE=$(command -v true)
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT INT TERM
+
+i=0
+while [ "$i" -lt "$N" ]; do
+    echo "$TRUE"
+    i=$((i + 1))
+done > "$script"
+
+now_ns() { date +%s%N; }
+
+for mode in spawn vfork fork; do
+    t0=$(now_ns)
+    TSH_LAUNCH=$mode "$TSH" < "$script" > /dev/null 2>&1
+    t1=$(now_ns)
+    awk -v m="$mode" -v n="$N" -v ns=$((t1 - t0)) \
+        'BEGIN { printf "launch_%s_cmds_per_sec %.0f\n", m, n / (ns / 1e9) }'
+done
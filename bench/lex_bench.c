@@ -0,0 +1,119 @@
+/* Lexer throughput: tokens/sec for the old space_operators + strtok_r
+ * tokenizer (kept here verbatim for comparison) against lex_line.
+ *
+ * usage: bench/lex_bench [line_bytes] [iterations]
+ */
+#define main tsh_main
+#include "../src/tiny_shell.c"
+#undef main
+
+#include <time.h>
+
+static void old_space_operators(const char *in, char *out, size_t outsz) {
+    size_t inlen = strlen(in);
+    size_t j = 0;
+    for (size_t i=0;i<inlen && j+1<outsz;i++) {
+        if (in[i] == '|' || in[i] == '<') {
+            if (j+3 >= outsz) break;
+            out[j++] = ' ';
+            out[j++] = in[i];
+            out[j++] = ' ';
+        } else if (in[i] == '>') {
+            if (i+1<inlen && in[i+1] == '>') {
+                if (j+4>=outsz) break;
+                out[j++]=' '; out[j++]='>'; out[j++]='>'; out[j++]=' ';
+                i++;
+            } else {
+                if (j+3>=outsz) break;
+                out[j++]=' '; out[j++]='>'; out[j++]=' ';
+            }
+        } else if (in[i]=='2' && i+1<inlen && in[i+1]=='>') {
+            if (j+4>=outsz) break;
+            out[j++]=' '; out[j++]='2'; out[j++]='>'; out[j++]=' ';
+            i++;
+        } else {
+            out[j++] = in[i];
+        }
+    }
+    out[j] = '\0';
+}
+
+static int old_tokenize(char *buf, char *tokens[], int max_tokens) {
+    int n=0;
+    char *saveptr=NULL;
+    char *t = strtok_r(buf, " \t", &saveptr);
+    while (t && n < max_tokens) {
+        tokens[n++] = t;
+        t = strtok_r(NULL, " \t", &saveptr);
+    }
+    return n;
+}
+
+/* the old parser's strcmp chain, so both sides classify every token */
+static int old_classify(char *tokens[], int n) {
+    int ops = 0;
+    for (int i=0;i<n;++i) {
+        if (strcmp(tokens[i],"|")==0 || strcmp(tokens[i],"<")==0 || strcmp(tokens[i],">")==0 ||
+            strcmp(tokens[i],">>")==0 || strcmp(tokens[i],"2>")==0) ops++;
+    }
+    return ops;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t len = argc > 1 ? strtoul(argv[1], NULL, 10) : 64 * 1024;
+    long iters = argc > 2 ? strtol(argv[2], NULL, 10) : 200;
+    static const char *pieces[] = {
+        "grep", "-v", "pattern", "|", "<input.txt", ">out.log", ">>append.log", "2>err",
+        "sort", "-k2,2n", "|", "uniq", "-c", "file2", "/usr/local/bin/tool", "--flag=value",
+    };
+    size_t np = sizeof(pieces) / sizeof(pieces[0]);
+
+    char *line = malloc(len + 1), *work = malloc(len + 1);
+    char *spaced = malloc(len * 2 + 1);
+    size_t maxtok = len + 1;
+    char **tokens = malloc(maxtok * sizeof(char *));
+    if (!line || !work || !spaced || !tokens) { perror("malloc"); return 1; }
+
+    size_t off = 0;
+    for (size_t i = 0; ; ++i) {
+        const char *p = pieces[i % np];
+        size_t n = strlen(p);
+        if (off + n + 1 > len) break;
+        memcpy(line + off, p, n);
+        off += n;
+        line[off++] = ' ';
+    }
+    line[off] = '\0';
+
+    long ntok = 0, sink = 0;
+    double t0 = now_sec();
+    for (long it = 0; it < iters; ++it) {
+        memcpy(work, line, off + 1);
+        old_space_operators(work, spaced, len * 2 + 1);
+        int n = old_tokenize(spaced, tokens, (int)maxtok);
+        sink += old_classify(tokens, n);
+        ntok += n;
+    }
+    double t1 = now_sec();
+    printf("lex_old_tokens_per_sec %.0f\n", ntok / (t1 - t0));
+
+    ntok = 0;
+    t0 = now_sec();
+    for (long it = 0; it < iters; ++it) {
+        Token *toks;
+        memcpy(work, line, off + 1);
+        int n = lex_line(work, &line_arena, &toks);
+        for (int i = 0; i < n; ++i) sink += toks[i].kind != TOK_WORD;
+        ntok += n;
+        arena_reset(&line_arena);
+    }
+    t1 = now_sec();
+    printf("lex_new_tokens_per_sec %.0f\n", ntok / (t1 - t0));
+    return sink == 42;
+}
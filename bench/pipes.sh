@@ -0,0 +1,46 @@
+#!/bin/sh
+# Pipeline throughput with and without `set -o fastpipes` on a BENCH_BYTES
+# input (1 GiB by default): a plain `cat FILE | wc -c`, and a filter between
+# a file source and a file sink. Reports bytes/sec, best of BENCH_RUNS; the
+# input is read once beforehand so every run starts from the page cache.
+#
+# usage: bench/pipes.sh [path/to/tsh] [bytes]
+set -eu
+
+TSH=${1:-./tsh}
+BYTES=${2:-${BENCH_BYTES:-1073741824}}
+RUNS=${BENCH_RUNS:-3}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT INT TERM
+in=$dir/in
+out=$dir/out
+
+# text-ish data so the filter has something to do; doubled up to size
+printf 'the quick brown fox jumps over the lazy dog %s\n' $(seq 1 2000) > "$in"
+while [ "$(wc -c < "$in")" -lt "$BYTES" ]; do cat "$in" "$in" > "$dir/tmp"; mv "$dir/tmp" "$in"; done
+truncate -s "$BYTES" "$in"
+cat "$in" > /dev/null
+
+now_ns() { date +%s%N; }
+
+# rate <name> <option line> <pipeline>
+rate() {
+    best=
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        t0=$(now_ns)
+        "$TSH" -c "$2
+$3" > /dev/null
+        t1=$(now_ns)
+        t=$((t1 - t0))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+        i=$((i + 1))
+    done
+    awk -v b="$BYTES" -v ns="$best" -v name="$1" 'BEGIN { printf "%s_bytes_per_sec %.0f\n", name, b / (ns / 1e9) }'
+}
+
+rate pipe_cat_default "set +o fastpipes" "cat $in | wc -c"
+rate pipe_cat_fast "set -o fastpipes" "cat $in | wc -c"
+rate pipe_filter_default "set +o fastpipes" "cat $in | tr a A | cat > $out"
+rate pipe_filter_fast "set -o fastpipes" "cat $in | tr a A | cat > $out"
@@ -0,0 +1,88 @@
+/* Drive an interactive tsh through a pseudo-terminal: start it, then send
+ * each line of stdin only after the previous prompt has come back, the
+ * way a user typing at a terminal would. Prints "<lines> <elapsed_ns>"
+ * for the span from the first line sent to the last prompt received.
+ *
+ * usage: bench/ptydrive path/to/tsh < lines
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pty.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROMPT "tsh> "
+
+static int master;
+static char tail[sizeof(PROMPT)];  /* end of the previous read, for prompts split across reads */
+
+/* Read until one more prompt has been printed. Returns -1 at EOF. */
+static int wait_prompt(void) {
+    char buf[4096 + sizeof(PROMPT)];
+    size_t keep = strlen(tail);
+    memcpy(buf, tail, keep);
+    for (;;) {
+        ssize_t n = read(master, buf + keep, sizeof(buf) - keep - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        size_t len = keep + (size_t)n;
+        buf[len] = '\0';
+        char *p = strstr(buf, PROMPT);
+        /* keep what follows the match (or the last few bytes) for next time */
+        const char *rest = p ? p + strlen(PROMPT) : buf + (len > strlen(PROMPT) ? len - strlen(PROMPT) + 1 : 0);
+        if (p) {
+            size_t r = strlen(rest);
+            if (r > sizeof(tail) - 1) { rest += r - (sizeof(tail) - 1); r = sizeof(tail) - 1; }
+            memcpy(tail, rest, r + 1);
+            return 0;
+        }
+        keep = strlen(rest);
+        memmove(buf, rest, keep);
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) { fprintf(stderr, "usage: %s path/to/tsh < lines\n", argv[0]); return 2; }
+
+    pid_t pid = forkpty(&master, NULL, NULL, NULL);
+    if (pid < 0) { perror("forkpty"); return 1; }
+    if (pid == 0) {
+        execl(argv[1], argv[1], (char *)NULL);
+        perror(argv[1]);
+        _exit(127);
+    }
+    if (wait_prompt() < 0) { fprintf(stderr, "ptydrive: no prompt from %s\n", argv[1]); return 1; }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long lines = 0;
+    uint64_t t0 = now_ns();
+    while ((len = getline(&line, &cap, stdin)) > 0) {
+        if (write(master, line, (size_t)len) != len) { perror("write"); return 1; }
+        if (line[len-1] != '\n' && write(master, "\n", 1) != 1) { perror("write"); return 1; }
+        if (wait_prompt() < 0) { fprintf(stderr, "ptydrive: tsh exited early\n"); return 1; }
+        lines++;
+    }
+    uint64_t t1 = now_ns();
+    printf("%ld %llu\n", lines, (unsigned long long)(t1 - t0));
+
+    if (write(master, "exit\n", 5) != 5) { /* already gone */ }
+    /* drain until the shell closes the pty, then reap it */
+    char buf[4096];
+    while (read(master, buf, sizeof(buf)) > 0) { }
+    waitpid(pid, NULL, 0);
+    free(line);
+    return 0;
+}
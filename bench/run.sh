@@ -0,0 +1,94 @@
+#!/bin/sh
+# Benchmark and regression suite. Runs every measurement below, writes
+# "name value" lines to BENCH_OUT (default bench-results.txt) and compares
+# them with bench/baseline.txt, failing when any metric regressed by more
+# than BENCH_TOLERANCE percent (see bench/compare.sh). BENCH_NO_COMPARE=1
+# only records. The suite runs BENCH_RUNS times (3) and each metric keeps
+# its best value, which is what makes a shared machine usable for gating.
+#
+#   launch_*        commands/sec for `true` in a loop, batch input, per launch path
+#   pty_*           the same loop typed at an interactive tsh through a pty
+#   script_*        script-mode startup and per-line cost
+#   pipeline_*      bytes/sec through an N-stage cat pipeline
+#   jobs_*          BENCH_JOBS concurrent background jobs: launch rate and
+#                   launch-to-reap latency beyond the job's own runtime
+#   lex_*           lexer tokens/sec on long generated lines
+#
+# usage: bench/run.sh [path/to/tsh]
+set -eu
+
+TSH=${1:-./tsh}
+OUT=${BENCH_OUT:-bench-results.txt}
+BASELINE=${BENCH_BASELINE:-bench/baseline.txt}
+N=${BENCH_N:-2000}
+STAGES=${BENCH_STAGES:-8}
+PIPE_BYTES=${BENCH_PIPE_BYTES:-268435456}
+JOBS=${BENCH_JOBS:-1000}
+RUNS=${BENCH_RUNS:-3}
+here=$(dirname "$0")
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+now_ns() { date +%s%N; }
+
+pty_loop() {
+    i=0
+    while [ "$i" -lt "$N" ]; do echo true; i=$((i + 1)); done > "$tmp/true.lines"
+    TSH_HISTFILE="$tmp/history" "$here/ptydrive" "$TSH" < "$tmp/true.lines" |
+        awk '{ printf "pty_true_cmds_per_sec %.0f\n", $1 / ($2 / 1e9) }'
+}
+
+pipeline() {
+    head -c "$PIPE_BYTES" /dev/zero > "$tmp/zero"
+    line="cat $tmp/zero"
+    i=1
+    while [ "$i" -lt "$STAGES" ]; do line="$line | cat"; i=$((i + 1)); done
+    t0=$(now_ns)
+    "$TSH" -c "$line | wc -c" > /dev/null
+    t1=$(now_ns)
+    awk -v b="$PIPE_BYTES" -v s="$STAGES" -v ns=$((t1 - t0)) \
+        'BEGIN { printf "pipeline_cat%d_bytes_per_sec %.0f\n", s, b / (ns / 1e9) }'
+}
+
+# Every job sleeps 100 ms, so child latency minus 100 ms is exec startup
+# plus how long the shell took to notice and reap it.
+job_churn() {
+    {
+        echo "set -o trace"
+        i=0
+        while [ "$i" -lt "$JOBS" ]; do echo "sleep 0.1 &"; i=$((i + 1)); done
+        echo "sleep 1"
+        echo "tsh-stats"
+    } > "$tmp/jobs.tsh"
+    "$TSH" "$tmp/jobs.tsh" | awk '
+        $1 == "launch" { launches = $2; launch_ms = $3 }
+        $1 == "child" && $2 > 1 { p50 = $4; p99 = $6 }
+        END {
+            printf "jobs_launch_per_sec %.0f\n", launches / (launch_ms / 1e3)
+            printf "jobs_reap_p50_us %.0f\n", p50 - 100000
+            printf "jobs_reap_p99_us %.0f\n", p99 - 100000
+        }'
+}
+
+suite() {
+    BENCH_N=$N sh "$here/launch.sh" "$TSH"
+    pty_loop
+    BENCH_LINES=${BENCH_LINES:-100000} sh "$here/script.sh" "$TSH"
+    pipeline
+    job_churn
+    "$here/lex_bench" | grep '^lex_new_'
+}
+
+r=0
+while [ "$r" -lt "$RUNS" ]; do
+    suite > "$tmp/run.$r"
+    r=$((r + 1))
+done
+cat "$tmp"/run.* | awk '
+    !($1 in best) { order[n++] = $1; best[$1] = $2; next }
+    $1 ~ /_per_sec$/ ? $2 + 0 > best[$1] + 0 : $2 + 0 < best[$1] + 0 { best[$1] = $2 }
+    END { for (i = 0; i < n; i++) print order[i], best[order[i]] }' | tee "$OUT"
+
+[ -n "${BENCH_NO_COMPARE:-}" ] && exit 0
+sh "$here/compare.sh" "$BASELINE" "$OUT"
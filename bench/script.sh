@@ -0,0 +1,36 @@
+#!/bin/sh
+# Script-mode overhead: shell startup time, and per-line cost of a large
+# script made of builtins (no fork/exec), run as a file and as piped stdin.
+#
+# usage: bench/script.sh [path/to/tsh] [lines]
+set -eu
+
+TSH=${1:-./tsh}
+N=${2:-${BENCH_LINES:-100000}}
+STARTS=${BENCH_STARTS:-200}
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT INT TERM
+
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "cd . > /dev/null" }' > "$script"
+
+now_ns() { date +%s%N; }
+
+t0=$(now_ns)
+i=0
+while [ "$i" -lt "$STARTS" ]; do
+    "$TSH" -c '' > /dev/null
+    i=$((i + 1))
+done
+t1=$(now_ns)
+awk -v n="$STARTS" -v ns=$((t1 - t0)) 'BEGIN { printf "script_startup_us %.1f\n", ns / n / 1e3 }'
+
+t0=$(now_ns)
+"$TSH" "$script" > /dev/null
+t1=$(now_ns)
+awk -v n="$N" -v ns=$((t1 - t0)) 'BEGIN { printf "script_file_line_ns %.0f\n", ns / n }'
+
+t0=$(now_ns)
+"$TSH" < "$script" > /dev/null
+t1=$(now_ns)
+awk -v n="$N" -v ns=$((t1 - t0)) 'BEGIN { printf "script_stdin_line_ns %.0f\n", ns / n }'
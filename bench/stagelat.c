@@ -0,0 +1,143 @@
+/* Pipeline launch latency: time from the moment a pipeline line is handed
+ * to tsh until the last of its stages is running. Each stage is this
+ * program in "stage" mode, which appends its CLOCK_MONOTONIC start time to
+ * a stamp file and exits; the driver writes the line to tsh's stdin, waits
+ * for the trailing "echo" to come back, and takes the latest stamp.
+ * Reports the best of RUNS for 2, 8 and 32 stages, with and without
+ * "set -o parlaunch".
+ *
+ * usage: bench/stagelat path/to/tsh [runs]
+ *        bench/stagelat stage STAMPFILE
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int stage(const char *path) {
+    uint64_t t = now_ns();
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0 || write(fd, &t, sizeof t) != (ssize_t)sizeof t) return 1;
+    return 0;
+}
+
+static int to_tsh, from_tsh;
+
+static int send_line(const char *s) {
+    size_t len = strlen(s);
+    return write(to_tsh, s, len) == (ssize_t)len ? 0 : -1;
+}
+
+/* read until a line equal to "ok" arrives */
+static int wait_ok(void) {
+    char buf[256];
+    size_t have = 0;
+    for (;;) {
+        ssize_t n = read(from_tsh, buf + have, sizeof(buf) - have - 1);
+        if (n <= 0) return -1;
+        have += (size_t)n;
+        buf[have] = '\0';
+        char *p = strstr(buf, "ok\n");
+        if (p && (p == buf || p[-1] == '\n')) return 0;
+        if (have > 8) { memmove(buf, buf + have - 8, 8); have = 8; }
+    }
+}
+
+/* one pipeline of n stages; returns launch latency in ns, 0 on error */
+static uint64_t run_once(const char *self, const char *stamps, int n) {
+    static char line[65536];
+    size_t off = 0;
+    for (int i = 0; i < n; ++i)
+        off += (size_t)snprintf(line + off, sizeof(line) - off, "%s%s stage %s", i ? " | " : "", self, stamps);
+    snprintf(line + off, sizeof(line) - off, "; echo ok\n");
+
+    int fd = open(stamps, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) return 0;
+    close(fd);
+
+    uint64_t t0 = now_ns();
+    if (send_line(line) < 0 || wait_ok() < 0) return 0;
+
+    uint64_t t[256], last = 0;
+    fd = open(stamps, O_RDONLY | O_CLOEXEC);
+    ssize_t got = fd < 0 ? -1 : read(fd, t, sizeof t);
+    if (fd >= 0) close(fd);
+    if (got != (ssize_t)(n * sizeof t[0])) return 0;
+    for (int i = 0; i < n; ++i) if (t[i] > last) last = t[i];
+    return last - t0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "stage") == 0) return stage(argv[2]);
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s path/to/tsh [runs]\n", argv[0]);
+        return 2;
+    }
+    int runs = argc == 3 ? atoi(argv[2]) : 50;
+    if (runs < 1) runs = 1;
+
+    char self[4096];
+    ssize_t sl = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (sl < 0) { perror("readlink"); return 1; }
+    self[sl] = '\0';
+
+    char stamps[] = "/tmp/stagelat.XXXXXX";
+    int sfd = mkstemp(stamps);
+    if (sfd < 0) { perror("mkstemp"); return 1; }
+    close(sfd);
+
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0) { perror("pipe2"); return 1; }
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return 1; }
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        execl(argv[1], argv[1], (char *)NULL);
+        perror(argv[1]);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    to_tsh = in[1];
+    from_tsh = out[0];
+    signal(SIGPIPE, SIG_IGN);
+
+    static const int sizes[] = { 2, 8, 32 };
+    static const char *const modes[][2] = {
+        { "serial", "set +o parlaunch; echo ok\n" },
+        { "parallel", "set -o parlaunch; echo ok\n" },
+    };
+    int rc = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        if (send_line(modes[m][1]) < 0 || wait_ok() < 0) { fprintf(stderr, "stagelat: tsh did not answer\n"); rc = 1; break; }
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            uint64_t best = 0;
+            for (int r = 0; r < runs; ++r) {
+                uint64_t ns = run_once(self, stamps, sizes[s]);
+                if (!ns) { fprintf(stderr, "stagelat: %d-stage run failed\n", sizes[s]); rc = 1; break; }
+                if (!best || ns < best) best = ns;
+            }
+            if (rc) break;
+            printf("stage_launch_%s_%d_us %.1f\n", modes[m][0], sizes[s], (double)best / 1000.0);
+        }
+        if (rc) break;
+    }
+
+    close(to_tsh);
+    waitpid(pid, NULL, 0);
+    unlink(stamps);
+    return rc;
+}
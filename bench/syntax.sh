@@ -0,0 +1,80 @@
+#!/bin/sh
+# Parser regressions: runs short scripts through tsh -c in a scratch
+# directory and compares what they print (stdout and stderr, then the
+# exit status) with the expected text. Prints one line per case; exits 1
+# when any case differs.
+#
+# usage: bench/syntax.sh [path/to/tsh]
+set -eu
+
+TSH=$(cd "$(dirname "${1:-./tsh}")" && pwd)/$(basename "${1:-./tsh}")
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT INT TERM
+cd "$dir"
+echo in > in
+
+bad=0
+# check <name> <script> <expected output>; $LAUNCH picks the launch path
+check() {
+    st=0
+    out=$(TSH_LAUNCH=${LAUNCH:-spawn} "$TSH" -c "$2" < /dev/null 2>&1) || st=$?
+    got="${out:+$out
+}status $st"
+    if [ "$got" = "$3" ]; then
+        echo "syntax_$1 ok"
+    else
+        echo "syntax_$1 FAIL"
+        printf '  expected: %s\n  got:      %s\n' "$3" "$got"
+        bad=1
+    fi
+}
+
+# a redirection may come before the command word
+check lead_in '< in cat' 'in
+status 0'
+check lead_out '> out echo two; cat out' 'two
+status 0'
+check lead_fd '2>err ls /nonexistent; echo $?; [ -s err ] && echo logged' '2
+logged
+status 0'
+# ... and a script containing one still runs from its first line
+check lead_script 'echo one
+> out2 echo two
+cat out2' 'one
+two
+status 0'
+# a command of redirections only still performs them
+check redir_only 'echo old > t; > t; > new; wc -c < t; [ -f new ] && echo made; < missing; echo $?' "0
+made
+failed to open 'missing' for input: No such file or directory
+1
+status 0"
+# a pipe needs a command on both sides
+for line in '| echo a' 'echo a |' 'echo a | | cat'; do
+    check "empty_stage" "$line" "syntax error near '|'
+tsh -c: line 1: parse error
+status 2"
+done
+check redir_stage 'echo a | > out; wc -c < out' '0
+status 0'
+# fg in a script continues its job's members one by one (no groups there)
+check fg_script 'sleep 0.2 & fg %1; echo $?' '0
+status 0'
+# ... but not from a pipeline stage, which is a forked copy of the shell
+check fg_stage 'sleep 0.2 & fg %1 | cat; echo done' 'fg: no job control in a pipeline
+done
+status 0'
+# a command that fails to start sets $? the same under every launch path
+for m in spawn fork; do
+    LAUNCH=$m check "launch_fail_$m" 'cat < nonexist; echo $?; echo x > /nonexistdir/f; echo $?; nosuch; echo $?; echo x | nosuch; echo $?' "failed to open 'nonexist' for input: No such file or directory
+1
+failed to open '/nonexistdir/f' for output: No such file or directory
+1
+nosuch: command not found
+127
+nosuch: command not found
+127
+status 0"
+done
+exit $bad
@@ -1,9 +1,11 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
@@ -11,549 +13,6299 @@
 #include <termios.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 
-#define MAX_INPUT 4096
-#define MAX_TOKENS 1024
-#define MAX_ARGS 128
-#define MAX_CMDS 64
-#define MAX_JOBS 128
-#define CMDLINE_LEN 1024
 
 typedef enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE } job_status_t;
 
 typedef struct {
-    int jid;                    
+    pid_t pid;
+    job_status_t status;
+    int wstatus;                /* raw wait status once done */
+    struct rusage ru;           /* from wait4 once done */
+    uint64_t launched_ns;       /* trace clock when added, 0 when not tracing */
+    int foreign;                /* adopted from another shell: no wait status */
+} Proc;
+
+typedef struct {
+    int jid;                    /* 0: slot is free */
     pid_t pgid;                 
-    char cmdline[CMDLINE_LEN]; 
+    size_t cmd_off;             /* command line, in the shared job string arena */
+    size_t cmd_len;
     job_status_t status;       
     int is_background;          
+    Proc *procs;                /* member processes */
+    int nprocs, procs_cap;
+    int nstages;                /* members that are pipeline stages, 0: all */
+    int nlive;                  /* members not yet reaped */
+    int next_free;              /* free-list link while the slot is unused */
+    int timed;                  /* `time` prefix: report usage when done */
+    struct timespec start, end; /* CLOCK_MONOTONIC; end is set once done */
+    char *cgroup;               /* `cgroup` prefix: the job's own cgroup directory */
 } Job;
 
-typedef struct {
-    char *argv[MAX_ARGS];
-    char *infile;
-    char *outfile;
-    int out_append;
-    char *errfile;
-} Command;
+/* Open-addressing map from a positive int key (pid, jid) to a 64-bit value. */
+typedef struct {
+    int32_t *keys;              /* 0: empty */
+    int64_t *vals;
+    unsigned bits;              /* capacity is 1 << bits */
+    size_t len;
+} IntMap;
+
+/* Redirections.
+ *
+ * A command keeps its redirections in the order written, any fd:
+ *
+ *   [N]<file  [N]>file  [N]>>file  [N]<>file  [N]<&M  [N]>&M  [N]<&-
+ *   [N]>&-  &>file  &>>file  [N]<<DELIM  [N]<<-DELIM  [N]<<<word
+ *
+ * The parser reduces the list to a plan (redir_plan): the fewest
+ * open/dup2/close steps that leave every fd as the list would, each file
+ * opened once and straight onto an fd it ends up on. Every step is a
+ * posix_spawn file action.
+ */
+typedef enum {
+    R_IN, R_OUT, R_APPEND, R_RW,    /* open path at fd */
+    R_DUP_IN, R_DUP_OUT,            /* fd becomes a copy of src, or closed */
+    R_ALL, R_ALL_APPEND,            /* &>, &>>: path on 1 and 2 */
+    R_HERE,                         /* the Command's here text on fd */
+} redir_op_t;
+
+typedef struct {
+    char *path;                 /* file word; R_HERE: set when the command runs */
+    int fd;
+    int src;                    /* R_DUP_*: fd copied, -1 to close */
+    int op;                     /* redir_op_t */
+} Redir;
+
+#define REDIR_TMP (-2)          /* a step's scratch fd (swapping fds) */
+
+typedef struct {
+    int op;                     /* STEP_* */
+    int fd;                     /* fd set (REDIR_TMP: the scratch one) */
+    int src;                    /* STEP_OPEN: index in redirs; STEP_DUP: fd copied */
+} RedirStep;
+
+enum { STEP_OPEN, STEP_DUP, STEP_CLOSE };
+
+typedef struct {
+    char **argv;                /* NULL-terminated, points into the line's token array */
+    Redir *redirs;              /* as written */
+    int nredirs;
+    RedirStep *plan;            /* what to do in the child, see redir_plan */
+    int nplan;
+    int plan_tmp;               /* the plan uses REDIR_TMP: posix_spawn cannot run it */
+    int fd_max;                 /* highest fd the plan names (at least 2) */
+    char *here;                 /* R_HERE data: <<< word, or << body */
+    size_t here_len;
+    const char *here_delim;     /* << delimiter */
+    int here_flags;             /* HERE_* */
+    int expand;                 /* EXPAND_*: words to expand when run */
+    struct HashEntry *exe;      /* command hash entry argv[0] resolved to */
+    unsigned exe_gen;           /* cmd_hash_gen when exe was looked up */
+} Command;
+
+/* The lexer stores an unquoted or double-quoted $? as this byte; it is
+ * replaced by the status when the command runs, since whole lines are
+ * parsed before they run. */
+#define CTL_STATUS '\001'
+
+/* A word that is a process substitution is this byte followed by the
+ * command text: CTL_PSUB_IN for <(cmd), CTL_PSUB_OUT for >(cmd). */
+#define CTL_PSUB_IN '\002'
+#define CTL_PSUB_OUT '\003'
+
+#define EXPAND_STATUS 1         /* a word holds CTL_STATUS */
+#define EXPAND_PSUB 2           /* a word is a process substitution */
+
+#define HERE_STRING 1           /* <<< word: the word and a newline */
+#define HERE_DOC 2              /* << DELIM: the lines up to DELIM */
+#define HERE_STRIP 4            /* <<- DELIM: leading tabs dropped */
+
+/* Resource controls for one pipeline, from the prefixes
+ *
+ *   nice [-n N]   affinity CPUS   ulimit -X N...   cgroup [KEY=VALUE...]
+ *
+ * in front of it (any order, with `time`). Every process of the job applies
+ * them itself before exec (child_limits); `cgroup` gives the job a cgroup v2
+ * directory of its own with the interface files KEY set to VALUE.
+ */
+#define LIMIT_MAX_RLIMITS 16
+
+typedef struct {
+    int has_nice, nice;         /* niceness increment */
+    const char *cpus;           /* affinity list as written; NULL: inherited */
+    cpu_set_t cpuset;
+    int nrlim;
+    struct { int opt; rlim_t val; } rlim[LIMIT_MAX_RLIMITS];   /* opt: index in ulimits[] */
+    int cgroup;
+    char **cg_kv;               /* KEY=VALUE settings, NULL-terminated */
+} Limits;
+
+/* Command list syntax tree. Pipelines are the leaves; `a && b || c` nests
+ * to the left, and `;` / `&` join and-or lists into NODE_SEQ. */
+typedef enum { NODE_PIPELINE, NODE_AND, NODE_OR, NODE_SEQ, NODE_BG } node_kind_t;
+
+typedef struct Node {
+    node_kind_t kind;
+    struct Node *left, *right;  /* operands; NODE_BG has only left */
+    Command *cmds;              /* NODE_PIPELINE */
+    int ncmds;
+    int timed;                  /* `time` prefix */
+    const char *text;           /* NODE_PIPELINE: job line, when precomputed */
+    Limits *lim;                /* resource prefixes, or NULL */
+} Node;
+
+/* Globals for shell */
+static Job *jobs;               /* slots; pointers stay valid until the next job_add */
+static int jobs_cap;
+static int jobs_free = -1;      /* head of the free slot list */
+static IntMap jobs_by_jid;      /* jid -> slot */
+static IntMap jobs_by_pid;      /* member pid -> slot << 32 | member index */
+static int next_jid = 1;
+static int njobs;               /* occupied slots */
+static char *jobstr;            /* arena holding every job's command line */
+static size_t jobstr_len, jobstr_cap, jobstr_dead;
+static pid_t shell_pgid;
+static pid_t shell_pid;
+static char **shell_argv;       /* as started, for restart */
+static int opt_fastpipes;       /* set -o fastpipes: big pipes, pumps for file copies */
+static int opt_parlaunch;       /* set -o parlaunch: start pipeline stages side by side */
+static int opt_trace;           /* set -o trace: record hot-path timings */
+static struct termios shell_tmodes;
+static int shell_interactive;   /* prompt and terminal control: tty input, no script */
+static int at_prompt;           /* waiting for input: notices must redraw the prompt */
+static int last_status;         /* $?: status of the last foreground pipeline */
+static int fg_interrupted;      /* that pipeline was killed by Ctrl-C: abandon the line */
+
+/* Helper declarations */
+static char *trim(char *s);
+static int execute_single(Command *c, int foreground, const Node *n);
+static int execute_pipeline(Command cmds[], int num_cmds, int background_flag, const Node *n);
+static int run_node(Node *n);
+static void reap_children(void);
+static void ed_hide(void);
+static void ed_show(void);
+static void state_save_on_exit(void);
+static int write_iov(int fd, struct iovec *iov, int n);
+static void spawners_forget(void);
+
+/* Tracing (set -o trace, or TSH_TRACE=1).
+ *
+ * Hot paths are bracketed with TRACE_BEGIN/TRACE_END. When tracing is off
+ * each bracket costs one well-predicted branch on opt_trace; when on, the
+ * span is timed with CLOCK_MONOTONIC_RAW (vDSO, no syscall) and appended to
+ * a fixed ring that keeps the most recent TRACE_RING events. Only the main
+ * thread records, so the ring needs no locks. tsh-stats summarizes the ring
+ * per phase or dumps it as Chrome trace-event JSON.
+ */
+typedef enum {
+    TR_PARSE,               /* lex + parse of one line */
+    TR_RESOLVE,             /* command name -> path */
+    TR_PIPES,               /* pipe setup for a pipeline */
+    TR_SPAWN,               /* posix_spawn / vfork / fork call in the parent */
+    TR_LAUNCH,              /* launch_command as a whole */
+    TR_BUILTIN,             /* builtin run in the shell */
+    TR_WAIT,                /* blocked in wait_for_job */
+    TR_CHILD,               /* child launched -> reaped by wait4 */
+    TR_NPHASES
+} trace_phase_t;
+
+static const char *const trace_names[TR_NPHASES] = {
+    "parse", "resolve", "pipes", "spawn", "launch", "builtin", "wait", "child",
+};
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int32_t arg;            /* pid for spawn/child, else 0 */
+    uint16_t phase;
+} TraceEvent;
+
+#define TRACE_RING 65536    /* power of two */
+
+static TraceEvent *trace_ring;
+static uint64_t trace_count;    /* events ever recorded; the ring keeps the last TRACE_RING */
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_record(trace_phase_t phase, uint64_t start_ns, int32_t arg) {
+    if (!start_ns) return;  /* tracing was switched on inside the span */
+    if (!trace_ring && !(trace_ring = calloc(TRACE_RING, sizeof(TraceEvent)))) { opt_trace = 0; return; }
+    TraceEvent *ev = &trace_ring[trace_count++ & (TRACE_RING - 1)];
+    ev->start_ns = start_ns;
+    ev->dur_ns = trace_now() - start_ns;
+    ev->arg = arg;
+    ev->phase = (uint16_t)phase;
+}
+
+#define TRACE_BEGIN(var) uint64_t var = __builtin_expect(opt_trace, 0) ? trace_now() : 0
+#define TRACE_END(phase, var, arg) \
+    do { if (__builtin_expect(opt_trace, 0)) trace_record((phase), (var), (arg)); } while (0)
+
+/* IntMap: linear probing with Fibonacci hashing and backward-shift deletion. */
+static size_t intmap_slot(const IntMap *m, int32_t key) {
+    return (size_t)(((uint32_t)key * 2654435769u) >> (32 - m->bits));
+}
+
+static int64_t intmap_get(const IntMap *m, int32_t key) {
+    if (!m->len) return -1;
+    size_t mask = ((size_t)1 << m->bits) - 1;
+    for (size_t i = intmap_slot(m, key); m->keys[i]; i = (i+1) & mask)
+        if (m->keys[i] == key) return m->vals[i];
+    return -1;
+}
+
+static void intmap_put(IntMap *m, int32_t key, int64_t val) {
+    if (!m->keys || (m->len + 1) * 10 > ((size_t)7 << m->bits)) {
+        IntMap old = *m;
+        size_t oldcap = old.keys ? (size_t)1 << old.bits : 0;
+        m->bits = old.keys ? old.bits + 1 : 6;
+        m->keys = calloc((size_t)1 << m->bits, sizeof(*m->keys));
+        m->vals = malloc(((size_t)1 << m->bits) * sizeof(*m->vals));
+        if (!m->keys || !m->vals) { perror("calloc"); exit(1); }
+        m->len = 0;
+        for (size_t i=0;i<oldcap;++i) if (old.keys[i]) intmap_put(m, old.keys[i], old.vals[i]);
+        free(old.keys); free(old.vals);
+    }
+    size_t mask = ((size_t)1 << m->bits) - 1;
+    size_t i = intmap_slot(m, key);
+    while (m->keys[i] && m->keys[i] != key) i = (i+1) & mask;
+    if (!m->keys[i]) m->len++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+static void intmap_del(IntMap *m, int32_t key) {
+    if (!m->len) return;
+    size_t mask = ((size_t)1 << m->bits) - 1;
+    size_t i = intmap_slot(m, key);
+    while (m->keys[i] != key) {
+        if (!m->keys[i]) return;
+        i = (i+1) & mask;
+    }
+    m->keys[i] = 0;
+    m->len--;
+    for (size_t j = (i+1) & mask; m->keys[j]; j = (j+1) & mask) {
+        size_t home = intmap_slot(m, m->keys[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->keys[i] = m->keys[j];
+            m->vals[i] = m->vals[j];
+            m->keys[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/* Resource prefixes (see Limits). ulimit options use bash's letters and
+ * units. */
+static const struct {
+    char opt;
+    int res;
+    rlim_t unit;
+    const char *name;
+} ulimits[] = {
+    { 'c', RLIMIT_CORE,    1024, "core file size (kbytes)" },
+    { 'd', RLIMIT_DATA,    1024, "data seg size (kbytes)" },
+    { 'f', RLIMIT_FSIZE,   1024, "file size (kbytes)" },
+    { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+    { 'n', RLIMIT_NOFILE,  1,    "open files" },
+    { 's', RLIMIT_STACK,   1024, "stack size (kbytes)" },
+    { 't', RLIMIT_CPU,     1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,   1,    "max user processes" },
+    { 'v', RLIMIT_AS,      1024, "virtual memory (kbytes)" },
+};
+#define NULIMITS ((int)(sizeof(ulimits) / sizeof(ulimits[0])))
+
+/* Index in ulimits[] of option word s ("-v"), or -1. */
+static int ulimit_find(const char *s) {
+    if (s[0] != '-' || !s[1] || s[2]) return -1;
+    for (int i=0;i<NULIMITS;++i) if (ulimits[i].opt == s[1]) return i;
+    return -1;
+}
+
+/* "unlimited" or a count in the option's unit. */
+static int ulimit_parse(int opt, const char *s, rlim_t *val) {
+    char *end;
+    if (strcmp(s, "unlimited") == 0) { *val = RLIM_INFINITY; return 0; }
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (!isdigit((unsigned char)*s) || *end || errno || n > RLIM_INFINITY / ulimits[opt].unit) return -1;
+    *val = (rlim_t)n * ulimits[opt].unit;
+    return 0;
+}
+
+static void ulimit_format(int opt, rlim_t val, char *buf, size_t size) {
+    if (val == RLIM_INFINITY) snprintf(buf, size, "unlimited");
+    else snprintf(buf, size, "%llu", (unsigned long long)(val / ulimits[opt].unit));
+}
+
+static int nice_parse(const char *s, int *inc) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (!*s || *end || n < -40 || n > 40) return -1;
+    *inc = (int)n;
+    return 0;
+}
+
+/* CPU list as taskset -c takes it: "0-3,8,10-11". */
+static int cpus_parse(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (;;) {
+        char *end;
+        if (!isdigit((unsigned char)*s)) return -1;
+        unsigned long lo = strtoul(s, &end, 10), hi = lo;
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1])) return -1;
+            hi = strtoul(end + 1, &end, 10);
+        }
+        if (lo > hi || hi >= CPU_SETSIZE) return -1;
+        for (unsigned long c = lo; c <= hi; ++c) CPU_SET(c, set);
+        if (!*end) return 0;
+        if (*end != ',') return -1;
+        s = end + 1;
+    }
+}
+
+static void cpus_format(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && len < size; ++c) {
+        if (!CPU_ISSET(c, set)) continue;
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) hi++;
+        len += (size_t)(hi > c ? snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", c, hi)
+                               : snprintf(buf + len, size - len, "%s%d", len ? "," : "", c));
+        c = hi;
+    }
+}
+
+/* A cgroup setting names an interface file of the job's directory. */
+static int cgroup_kv_ok(const char *s) {
+    const char *eq = strchr(s, '=');
+    return eq && eq > s && !memchr(s, '/', (size_t)(eq - s));
+}
+
+/* The cgroup v2 directory job cgroups are made in: $TSH_CGROUP, else the
+ * shell's own cgroup. */
+static int cgroup_root(char *buf, size_t size) {
+    const char *env = getenv("TSH_CGROUP");
+    char line[PATH_MAX + 256], mnt[PATH_MAX] = "";
+    if (env && *env) { snprintf(buf, size, "%s", env); return 0; }
+
+    FILE *f = fopen("/proc/self/mounts", "re");
+    if (!f) return -1;
+    while (!*mnt && fgets(line, sizeof(line), f)) {
+        char dir[PATH_MAX], type[32];
+        if (sscanf(line, "%*s %4095s %31s", dir, type) == 2 && strcmp(type, "cgroup2") == 0)
+            snprintf(mnt, sizeof(mnt), "%s", dir);
+    }
+    fclose(f);
+    if (!*mnt || !(f = fopen("/proc/self/cgroup", "re"))) return -1;
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        int n = snprintf(buf, size, "%s%s", mnt, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+        found = n >= 0 && (size_t)n < size;
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+static int write_file(const char *path, const char *s) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, s, strlen(s));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n < 0 ? -1 : 0;
+}
+
+/* Make a job's cgroup under cgroup_root and apply its settings. Returns the
+ * malloc'd directory and an fd on its cgroup.procs for the children to join
+ * through, or NULL once the error is reported. */
+static char *cgroup_create(const Limits *l, int *procs_fd) {
+    static unsigned seq;
+    char root[PATH_MAX], path[PATH_MAX], file[PATH_MAX + 64], ctl[64];
+    if (cgroup_root(root, sizeof(root)) < 0) { fprintf(stderr,"cgroup: no cgroup v2 hierarchy\n"); return NULL; }
+
+    /* a setting names its controller ("memory.max"): make sure the root
+     * hands that one down; this fails harmlessly when it already does */
+    snprintf(file, sizeof(file), "%s/cgroup.subtree_control", root);
+    for (char **kv = l->cg_kv; kv && *kv; ++kv) {
+        int n = (int)strcspn(*kv, ".=");
+        if (n == 6 && strncmp(*kv, "cgroup", 6) == 0) continue;
+        snprintf(ctl, sizeof(ctl), "+%.*s", n, *kv);
+        write_file(file, ctl);
+    }
+
+    int n = snprintf(path, sizeof(path), "%s/tsh-%d-%u", root, (int)getpid(), ++seq);
+    if (n < 0 || (size_t)n >= sizeof(path)) errno = ENAMETOOLONG;
+    else if (mkdir(path, 0755) == 0) n = 0;
+    if (n) { fprintf(stderr,"cgroup: %s: %s\n", path, strerror(errno)); return NULL; }
+    for (char **kv = l->cg_kv; kv && *kv; ++kv) {
+        const char *eq = strchr(*kv, '=');
+        snprintf(file, sizeof(file), "%s/%.*s", path, (int)(eq - *kv), *kv);
+        if (write_file(file, eq + 1) < 0) {
+            fprintf(stderr,"cgroup: %s: %s\n", *kv, strerror(errno));
+            rmdir(path);
+            return NULL;
+        }
+    }
+    snprintf(file, sizeof(file), "%s/cgroup.procs", path);
+    *procs_fd = open(file, O_WRONLY | O_CLOEXEC);
+    if (*procs_fd < 0) {
+        fprintf(stderr,"cgroup: %s: %s\n", file, strerror(errno));
+        rmdir(path);
+        return NULL;
+    }
+    char *dir = strdup(path);
+    if (!dir) { perror("strdup"); exit(1); }
+    return dir;
+}
+
+/* Drop a cgroup made for a job that did not start. */
+static void cgroup_discard(char *dir) {
+    if (!dir) return;
+    rmdir(dir);
+    free(dir);
+}
+
+/* Job string arena: command lines are appended to one buffer and jobs keep
+ * offsets into it. Space from removed jobs is reclaimed by compacting once it
+ * is the larger part, and the arena rewinds when the table empties. */
+static size_t jobstr_reserve(size_t n) {
+    if (jobstr_len + n > jobstr_cap) {
+        while (jobstr_len + n > jobstr_cap) jobstr_cap = jobstr_cap ? jobstr_cap * 2 : 4096;
+        jobstr = realloc(jobstr, jobstr_cap);
+        if (!jobstr) { perror("realloc"); exit(1); }
+    }
+    size_t off = jobstr_len;
+    jobstr_len += n;
+    return off;
+}
+
+static const char *job_cmdline(const Job *j) {
+    return jobstr + j->cmd_off;
+}
+
+static void jobstr_release(Job *j) {
+    jobstr_dead += j->cmd_len + 1;
+    if (njobs == 0) { jobstr_len = jobstr_dead = 0; return; }
+    if (jobstr_dead < 4096 || jobstr_dead * 2 < jobstr_len) return;
+
+    char *fresh = malloc(jobstr_cap);
+    if (!fresh) { perror("malloc"); exit(1); }
+    size_t len = 0;
+    for (int i=0;i<jobs_cap;++i) {
+        if (!jobs[i].jid) continue;
+        memcpy(fresh + len, jobstr + jobs[i].cmd_off, jobs[i].cmd_len + 1);
+        jobs[i].cmd_off = len;
+        len += jobs[i].cmd_len + 1;
+    }
+    free(jobstr);
+    jobstr = fresh;
+    jobstr_len = len;
+    jobstr_dead = 0;
+}
+
+/* Job table helpers */
+static Job *job_alloc(pid_t pgid, int bg) {
+    if (jobs_free < 0) {
+        int oldcap = jobs_cap;
+        jobs_cap = jobs_cap ? jobs_cap * 2 : 16;
+        jobs = realloc(jobs, (size_t)jobs_cap * sizeof(Job));
+        if (!jobs) { perror("realloc"); exit(1); }
+        memset(jobs + oldcap, 0, (size_t)(jobs_cap - oldcap) * sizeof(Job));
+        for (int i = jobs_cap - 1; i >= oldcap; --i) { jobs[i].next_free = jobs_free; jobs_free = i; }
+    }
+    int slot = jobs_free;
+    Job *j = &jobs[slot];
+    jobs_free = j->next_free;
+
+    j->jid = next_jid++;
+    njobs++;
+    j->pgid = pgid;
+    j->status = JOB_RUNNING;
+    j->is_background = bg;
+    j->nprocs = j->nlive = 0;
+    j->nstages = 0;
+    j->timed = 0;
+    j->cgroup = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    intmap_put(&jobs_by_jid, j->jid, slot);
+    return j;
+}
+
+/* Append to dst (may be NULL to only measure); returns the new end. */
+static char *job_text_putn(char *dst, size_t *len, const char *s, size_t n) {
+    if (dst) { memcpy(dst, s, n); dst += n; }
+    *len += n;
+    return dst;
+}
+
+static char *job_text_put(char *dst, size_t *len, const char *s) {
+    return job_text_putn(dst, len, s, strlen(s));
+}
+
+/* n bytes of a word, single-quoted when the lexer would otherwise split
+ * or interpret them. */
+static char *job_text_span(char *dst, size_t *len, const char *s, size_t n) {
+    size_t plain = 0;
+    while (plain < n && !strchr(" \t\n|&;<>'\"\\#$", s[plain])) plain++;
+    if (n && plain == n) return job_text_putn(dst, len, s, n);
+    dst = job_text_put(dst, len, "'");
+    for (const char *end = s + n, *q; s < end; s = q + 1) {
+        q = memchr(s, '\'', (size_t)(end - s));
+        if (!q) { dst = job_text_putn(dst, len, s, (size_t)(end - s)); break; }
+        dst = job_text_putn(dst, len, s, (size_t)(q - s));
+        dst = job_text_put(dst, len, "'\\''");
+    }
+    return job_text_put(dst, len, "'");
+}
+
+/* A word as it could be typed back; a pending $? stays unquoted and a
+ * process substitution shows its command. */
+static char *job_text_word(char *dst, size_t *len, const char *s) {
+    if (s[0] == CTL_PSUB_IN || s[0] == CTL_PSUB_OUT) {
+        dst = job_text_put(dst, len, s[0] == CTL_PSUB_IN ? "<(" : ">(");
+        dst = job_text_put(dst, len, s + 1);
+        return job_text_put(dst, len, ")");
+    }
+    const char *ctl = strchr(s, CTL_STATUS);
+    if (!ctl) return job_text_span(dst, len, s, strlen(s));
+    for (; ctl; s = ctl + 1, ctl = strchr(s, CTL_STATUS)) {
+        if (ctl > s) dst = job_text_span(dst, len, s, (size_t)(ctl - s));
+        dst = job_text_put(dst, len, "$?");
+    }
+    return *s ? job_text_span(dst, len, s, strlen(s)) : dst;
+}
+
+/* One redirection as written ("2>&1", "> out", "<<-EOF"); the fd only
+ * when it is not the operator's own. */
+static char *job_text_redir(char *dst, size_t *len, const Command *c, const Redir *r) {
+    static const char *const ops[] = {
+        [R_IN] = "<", [R_OUT] = ">", [R_APPEND] = ">>", [R_RW] = "<>",
+        [R_DUP_IN] = "<&", [R_DUP_OUT] = ">&", [R_ALL] = "&>", [R_ALL_APPEND] = "&>>",
+    };
+    char num[16];
+    int input = r->op == R_IN || r->op == R_RW || r->op == R_DUP_IN || r->op == R_HERE;
+    if (r->op != R_ALL && r->op != R_ALL_APPEND && r->fd != !input) {
+        snprintf(num, sizeof(num), "%d", r->fd);
+        dst = job_text_put(dst, len, num);
+    }
+    if (r->op == R_HERE && (c->here_flags & HERE_STRING)) {
+        dst = job_text_put(dst, len, "<<< ");
+        return job_text_word(dst, len, c->here);
+    }
+    if (r->op == R_HERE) {
+        dst = job_text_put(dst, len, c->here_flags & HERE_STRIP ? "<<-" : "<<");
+        return job_text_word(dst, len, c->here_delim);
+    }
+    dst = job_text_put(dst, len, ops[r->op]);
+    if (r->op == R_DUP_IN || r->op == R_DUP_OUT) {
+        snprintf(num, sizeof(num), "%d", r->src);
+        return job_text_put(dst, len, r->src < 0 ? "-" : num);
+    }
+    dst = job_text_put(dst, len, " ");
+    return job_text_word(dst, len, r->path);
+}
+
+/* Render a parsed pipeline as its job line ("cat < in | wc -l > out").
+ * With dst NULL only the length is computed. */
+static size_t job_text(const Command *cmds, int ncmds, char *dst) {
+    size_t len = 0;
+    for (int i=0;i<ncmds;++i) {
+        const Command *c = &cmds[i];
+        int first = 1;
+        if (i) dst = job_text_put(dst, &len, " | ");
+        for (int k=0;c->argv[k];++k) {
+            if (!first) dst = job_text_put(dst, &len, " ");
+            dst = job_text_word(dst, &len, c->argv[k]);
+            first = 0;
+        }
+        for (int k=0;k<c->nredirs;++k) {
+            dst = job_text_put(dst, &len, first ? "" : " ");
+            dst = job_text_redir(dst, &len, c, &c->redirs[k]);
+            first = 0;
+        }
+    }
+    if (dst) *dst = '\0';
+    return len;
+}
+
+/* The resource prefixes of a pipeline ("nice -n 5 affinity 0-3 "). */
+static char *job_text_limits(char *dst, size_t *len, const Limits *l) {
+    char num[32];
+    if (l->has_nice) {
+        snprintf(num, sizeof(num), "nice -n %d ", l->nice);
+        dst = job_text_put(dst, len, num);
+    }
+    if (l->cpus) {
+        dst = job_text_put(dst, len, "affinity ");
+        dst = job_text_word(dst, len, l->cpus);
+        dst = job_text_put(dst, len, " ");
+    }
+    if (l->nrlim) dst = job_text_put(dst, len, "ulimit ");
+    for (int i=0;i<l->nrlim;++i) {
+        snprintf(num, sizeof(num), "-%c ", ulimits[l->rlim[i].opt].opt);
+        dst = job_text_put(dst, len, num);
+        ulimit_format(l->rlim[i].opt, l->rlim[i].val, num, sizeof(num));
+        dst = job_text_put(dst, len, num);
+        dst = job_text_put(dst, len, " ");
+    }
+    if (l->cgroup) dst = job_text_put(dst, len, "cgroup ");
+    for (char **kv = l->cg_kv; kv && *kv; ++kv) {
+        dst = job_text_word(dst, len, *kv);
+        dst = job_text_put(dst, len, " ");
+    }
+    return dst;
+}
+
+/* A pipeline node's job line, with its resource prefixes. It shows the
+ * line as typed: $? and process substitutions unexpanded. */
+static size_t job_text_pipeline(const Node *n, char *dst) {
+    size_t len = 0;
+    if (n->lim) dst = job_text_limits(dst, &len, n->lim);
+    return len + job_text(n->cmds, n->ncmds, dst);
+}
+
+/* Add a job for a pipeline node; its line is copied from n->text when that
+ * was rendered in advance (a cached line), else rendered straight into the
+ * arena. */
+static int job_add(pid_t pgid, const Node *n, int bg) {
+    Job *j = job_alloc(pgid, bg);
+    if (n->text) {
+        j->cmd_len = strlen(n->text);
+        j->cmd_off = jobstr_reserve(j->cmd_len + 1);
+        memcpy(jobstr + j->cmd_off, n->text, j->cmd_len + 1);
+        return j->jid;
+    }
+    j->cmd_len = job_text_pipeline(n, NULL);
+    j->cmd_off = jobstr_reserve(j->cmd_len + 1);
+    job_text_pipeline(n, jobstr + j->cmd_off);
+    return j->jid;
+}
+
+/* Render a command list ("make && ./run; echo done"). */
+static size_t job_text_list(const Node *n, char *dst) {
+    static const char *const ops[] = { [NODE_AND] = " && ", [NODE_OR] = " || ", [NODE_SEQ] = "; " };
+    size_t len = 0;
+    if (n->kind == NODE_PIPELINE) {
+        if (n->timed) dst = job_text_put(dst, &len, "time ");
+        return len + job_text_pipeline(n, dst);
+    }
+    size_t l = job_text_list(n->left, dst);
+    len += l;
+    if (dst) dst += l;
+    if (n->kind == NODE_BG) {
+        /* "a & b" is SEQ(BG(a), b): the separator is the & */
+        dst = job_text_put(dst, &len, " &");
+        if (dst) *dst = '\0';
+        return len;
+    }
+    if (n->kind == NODE_SEQ && n->left->kind == NODE_BG) dst = job_text_put(dst, &len, " ");
+    else dst = job_text_put(dst, &len, ops[n->kind]);
+    return len + job_text_list(n->right, dst);
+}
+
+/* Add a job for a command list run in a subshell. */
+static int job_add_list(pid_t pgid, const Node *n, int bg) {
+    Job *j = job_alloc(pgid, bg);
+    j->cmd_len = job_text_list(n, NULL);
+    j->cmd_off = jobstr_reserve(j->cmd_len + 1);
+    job_text_list(n, jobstr + j->cmd_off);
+    return j->jid;
+}
+
+static Job* job_by_jid(int jid) {
+    int64_t slot = intmap_get(&jobs_by_jid, jid);
+    return slot < 0 ? NULL : &jobs[slot];
+}
+
+/* Add a member process (pid 0: a pump thread, see pump_start); returns its index. */
+static int job_add_pid(Job *j, pid_t pid) {
+    if (j->nprocs == j->procs_cap) {
+        j->procs_cap = j->procs_cap ? j->procs_cap * 2 : 4;
+        j->procs = realloc(j->procs, (size_t)j->procs_cap * sizeof(Proc));
+        if (!j->procs) { perror("realloc"); exit(1); }
+    }
+    Proc *p = &j->procs[j->nprocs];
+    p->pid = pid;
+    p->status = JOB_RUNNING;
+    p->wstatus = 0;
+    p->foreign = 0;
+    memset(&p->ru, 0, sizeof(p->ru));
+    p->launched_ns = pid > 0 && opt_trace ? trace_now() : 0;
+    if (pid > 0) intmap_put(&jobs_by_pid, pid, (int64_t)(j - jobs) << 32 | j->nprocs);
+    j->nlive++;
+    return j->nprocs++;
+}
+
+/* Find the job and member record of a child pid. */
+static Job* job_by_pid(pid_t pid, Proc **proc) {
+    int64_t v = intmap_get(&jobs_by_pid, pid);
+    if (v < 0) return NULL;
+    Job *j = &jobs[v >> 32];
+    *proc = &j->procs[v & 0xffffffff];
+    return j;
+}
+
+static void job_remove_jid(int jid) {
+    Job *j = job_by_jid(jid);
+    if (!j) return;
+    for (int i=0;i<j->nprocs;++i) if (j->procs[i].pid > 0) intmap_del(&jobs_by_pid, j->procs[i].pid);
+    intmap_del(&jobs_by_jid, jid);
+    njobs--;
+    jobstr_release(j);
+    if (j->cgroup) {
+        rmdir(j->cgroup);
+        free(j->cgroup);
+        j->cgroup = NULL;
+    }
+    j->jid = 0;
+    j->pgid = 0;
+    j->status = JOB_DONE;
+    j->is_background = 0;
+    j->nprocs = j->nlive = 0;
+    j->next_free = jobs_free;
+    jobs_free = (int)(j - jobs);
+}
+
+/* Recompute a job's state from its members: done when none are left,
+ * stopped when every live process is stopped. Pumps (pid 0) cannot stop;
+ * they only keep a job running once its processes have exited. */
+static void job_update_status(Job *j) {
+    int stopped = 0;
+    if (j->nlive == 0) {
+        if (j->status != JOB_DONE) clock_gettime(CLOCK_MONOTONIC, &j->end);
+        j->status = JOB_DONE;
+        return;
+    }
+    for (int i=0;i<j->nprocs;++i) {
+        if (j->procs[i].pid > 0 && j->procs[i].status == JOB_RUNNING) { j->status = JOB_RUNNING; return; }
+        if (j->procs[i].status == JOB_STOPPED) stopped = 1;
+    }
+    j->status = stopped ? JOB_STOPPED : JOB_RUNNING;
+}
+
+static void print_job_status(Job *j) {
+    if (!j) return;
+    const char *stat = (j->status == JOB_RUNNING) ? "Running" : (j->status == JOB_STOPPED) ? "Stopped" : "Done";
+    printf("[%d] %d %s\t%s\n", j->jid, j->pgid, stat, job_cmdline(j));
+}
+
+static double tv_sec(struct timeval tv) {
+    return (double)tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double ts_elapsed(struct timespec from, struct timespec to) {
+    return (double)(to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+/* Sum of the members' usage (peak RSS is the largest member's). */
+static void job_rusage(const Job *j, struct rusage *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (int i=0;i<j->nprocs;++i) {
+        const struct rusage *ru = &j->procs[i].ru;
+        timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+        timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+        if (ru->ru_maxrss > sum->ru_maxrss) sum->ru_maxrss = ru->ru_maxrss;
+        sum->ru_nvcsw += ru->ru_nvcsw;
+        sum->ru_nivcsw += ru->ru_nivcsw;
+    }
+}
+
+/* The `time` report, on stderr like bash's. */
+static void print_times(double real, double user, double sys) {
+    fprintf(stderr,"\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+            (int)(real / 60), real - 60 * (int)(real / 60),
+            (int)(user / 60), user - 60 * (int)(user / 60),
+            (int)(sys / 60), sys - 60 * (int)(sys / 60));
+}
+
+static void job_report_time(const Job *j) {
+    struct rusage sum;
+    job_rusage(j, &sum);
+    print_times(ts_elapsed(j->start, j->end), tv_sec(sum.ru_utime), tv_sec(sum.ru_stime));
+}
+
+/* Per-member lines for jobs -l/-v: pid, state, CPU time and peak RSS. */
+static void print_job_members(const Job *j, int verbose) {
+    struct timespec now;
+    for (int i=0;i<j->nprocs;++i) {
+        const Proc *p = &j->procs[i];
+        char pid[16], stat[24];
+        if (p->pid > 0) snprintf(pid, sizeof(pid), "%d", (int)p->pid);
+        else snprintf(pid, sizeof(pid), "pump");
+        if (p->status == JOB_RUNNING) snprintf(stat, sizeof(stat), "Running");
+        else if (p->status == JOB_STOPPED) snprintf(stat, sizeof(stat), "Stopped");
+        else if (p->foreign) snprintf(stat, sizeof(stat), "Gone");
+        else if (WIFSIGNALED(p->wstatus)) snprintf(stat, sizeof(stat), "Signal %d", WTERMSIG(p->wstatus));
+        else if (WEXITSTATUS(p->wstatus)) snprintf(stat, sizeof(stat), "Exit %d", WEXITSTATUS(p->wstatus));
+        else snprintf(stat, sizeof(stat), "Done");
+
+        if (p->status != JOB_DONE || p->pid <= 0 || p->foreign) { printf("    %8s %s\n", pid, stat); continue; }
+        printf("    %8s %-10s user %.3fs  sys %.3fs  rss %ldK", pid, stat,
+               tv_sec(p->ru.ru_utime), tv_sec(p->ru.ru_stime), p->ru.ru_maxrss);
+        if (verbose) printf("  csw %ld/%ld", p->ru.ru_nvcsw, p->ru.ru_nivcsw);
+        printf("\n");
+    }
+    if (j->cgroup) printf("    cgroup %s\n", j->cgroup);
+    if (!verbose) return;
+
+    struct rusage sum;
+    job_rusage(j, &sum);
+    if (j->status == JOB_DONE) now = j->end; else clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("    total: real %.3fs  user %.3fs  sys %.3fs  rss %ldK  csw %ld/%ld\n",
+           ts_elapsed(j->start, now), tv_sec(sum.ru_utime), tv_sec(sum.ru_stime),
+           sum.ru_maxrss, sum.ru_nvcsw, sum.ru_nivcsw);
+}
+
+static int job_cmp_jid(const void *a, const void *b) {
+    return (*(Job *const *)a)->jid - (*(Job *const *)b)->jid;
+}
+
+/* Event loop.
+ *
+ * SIGCHLD stays blocked and is read from a signalfd; one epoll set watches it
+ * together with stdin (while the shell wants input) and any fd a subsystem
+ * registers with ev_add. Children are reaped as soon as the kernel reports
+ * them, and every wait in the shell is a loop around ev_dispatch.
+ */
+typedef struct EvSource {
+    int fd;
+    void (*fn)(struct EvSource *src, uint32_t events);
+    void *arg;
+} EvSource;
+
+static int ev_epfd = -1;
+static EvSource ev_sigchld = { -1, NULL, NULL };
+static EvSource ev_input = { -1, NULL, NULL };
+static int input_ready;
+
+static int ev_add(EvSource *src, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(ev_epfd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+/* Wait up to timeout_ms (-1: forever) and run the handlers of ready sources. */
+static int ev_dispatch(int timeout_ms) {
+    struct epoll_event evs[16];
+    int n = epoll_wait(ev_epfd, evs, 16, timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) perror("epoll_wait");
+        return 0;
+    }
+    for (int i=0;i<n;++i) {
+        EvSource *src = evs[i].data.ptr;
+        src->fn(src, evs[i].events);
+    }
+    return n;
+}
+
+/* SIGCHLD, and SIGHUP/SIGTERM while the session is kept (state_init):
+ * those save it and then take their default action. */
+static void ev_sigchld_fn(EvSource *src, uint32_t events) {
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int fatal = 0;
+    (void)events;
+    /* drain; the kernel coalesces SIGCHLD, so reap everything below anyway */
+    while ((n = read(src->fd, si, sizeof(si))) > 0)
+        for (size_t i=0;i<(size_t)n/sizeof(si[0]);++i)
+            if (si[i].ssi_signo != SIGCHLD) fatal = (int)si[i].ssi_signo;
+    reap_children();
+    if (!fatal) return;
+    state_save_on_exit();
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, fatal);
+    signal(fatal, SIG_DFL);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    raise(fatal);
+}
+
+static void ev_input_fn(EvSource *src, uint32_t events) {
+    (void)src; (void)events;
+    input_ready = 1;
+}
+
+static void ev_init(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) perror("sigprocmask");
+
+    ev_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev_epfd < 0) { perror("epoll_create1"); exit(1); }
+    ev_sigchld.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (ev_sigchld.fd < 0) { perror("signalfd"); exit(1); }
+    ev_sigchld.fn = ev_sigchld_fn;
+    if (ev_add(&ev_sigchld, EPOLLIN) < 0) { perror("epoll_ctl"); exit(1); }
+}
+
+/* Watch fd for input (one-shot, re-armed per wait). Returns -1 when fd
+ * cannot be polled (a regular file), in which case reads never block long. */
+static int ev_watch_input(int fd) {
+    ev_input.fd = fd;
+    ev_input.fn = ev_input_fn;
+    if (ev_add(&ev_input, EPOLLIN | EPOLLONESHOT) < 0) { ev_input.fd = -1; return -1; }
+    return 0;
+}
+
+/* Run the event loop until the input fd is readable. */
+static void wait_for_input(void) {
+    struct epoll_event ev;
+    if (ev_input.fd < 0) return;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &ev_input;
+    epoll_ctl(ev_epfd, EPOLL_CTL_MOD, ev_input.fd, &ev);
+    input_ready = 0;
+    at_prompt = shell_interactive;
+    while (!input_ready) ev_dispatch(-1);
+    at_prompt = 0;
+}
+
+/* Shell status of a wait status: the exit code, or 128 + signal. */
+static int wait_status_code(int wstatus) {
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+}
+
+/* A finished job's status: its last pipeline stage's. */
+static int job_exit_status(const Job *j) {
+    return wait_status_code(j->procs[(j->nstages ? j->nstages : j->nprocs)-1].wstatus);
+}
+
+/* Background jobs that finished, kept until `wait` reports them: one
+ * record per member, oldest overwritten once DONE_MAX are kept. jids are
+ * never reused; pids can be, so lookups go newest first. */
+#define DONE_MAX 1024
+
+typedef struct {
+    int jid;                    /* 0: reported */
+    pid_t pid;                  /* 0: a pump */
+    int status;                 /* this member's shell status */
+    int last;                   /* the job's last stage: its status is the job's */
+} DoneRec;
+
+static DoneRec done_ring[DONE_MAX];
+static unsigned done_count;     /* records ever written */
+
+static void done_record(const Job *j) {
+    int last = (j->nstages ? j->nstages : j->nprocs) - 1;
+    for (int i=0;i<j->nprocs;++i) {
+        if (j->procs[i].pid <= 0 && i != last) continue;
+        DoneRec *r = &done_ring[done_count++ % DONE_MAX];
+        r->jid = j->jid;
+        r->pid = j->procs[i].pid;
+        r->status = wait_status_code(j->procs[i].wstatus);
+        r->last = i == last;
+    }
+}
+
+/* Report job jid (jid 0: member pid) from the records: its status, or -1
+ * when it is not there. A job is reported once, with all its members. */
+static int done_take(int jid, pid_t pid) {
+    unsigned n = done_count < DONE_MAX ? done_count : DONE_MAX;
+    for (unsigned k=1;k<=n;++k) {
+        DoneRec *r = &done_ring[(done_count - k) % DONE_MAX];
+        if (!r->jid || (jid ? r->jid != jid || !r->last : r->pid != pid)) continue;
+        int status = r->status;
+        if (!jid) { r->jid = 0; return status; }
+        for (unsigned m=1;m<=n;++m)
+            if (done_ring[(done_count - m) % DONE_MAX].jid == jid) done_ring[(done_count - m) % DONE_MAX].jid = 0;
+        return status;
+    }
+    return -1;
+}
+
+/* The oldest job not yet reported, or 0. */
+static int done_oldest(void) {
+    unsigned n = done_count < DONE_MAX ? done_count : DONE_MAX;
+    for (unsigned k=n;k>=1;--k) {
+        const DoneRec *r = &done_ring[(done_count - k) % DONE_MAX];
+        if (r->jid && r->last) return r->jid;
+    }
+    return 0;
+}
+
+/* Report a background job's state change. At the prompt the line being
+ * edited is taken down first and redrawn after (see job_changed). */
+static void job_notify(Job *j, const char *what) {
+    if (!shell_interactive) return;
+    printf("%s[%d]+ %s\t%s\n", at_prompt ? "" : "\n", j->jid, what, job_cmdline(j));
+    fflush(stdout);
+}
+
+/* A member of j changed state: recompute the job, and report a background
+ * job that changed; the foreground job is reported by wait_for_job. */
+static void job_changed(Job *j, job_status_t before) {
+    job_update_status(j);
+    if (j->status == before || !j->is_background) return;
+    int redraw = at_prompt && shell_interactive;
+    if (redraw) ed_hide();
+    if (j->status == JOB_DONE) {
+        job_notify(j, "Done");
+        if (j->timed) job_report_time(j);
+        done_record(j);
+        job_remove_jid(j->jid);
+    } else if (j->status == JOB_STOPPED) {
+        job_notify(j, "Stopped");
+    }
+    if (redraw) ed_show();
+}
+
+static void reap_children(void) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        Proc *p;
+        Job *j = job_by_pid(pid, &p);
+        if (!j) continue;
+        job_status_t before = j->status;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (p->status == JOB_DONE) continue;
+            p->status = JOB_DONE;
+            p->wstatus = status;
+            p->ru = ru;
+            p->foreign = 0;
+            j->nlive--;
+            TRACE_END(TR_CHILD, p->launched_ns, pid);
+        } else if (WIFSTOPPED(status)) {
+            p->status = JOB_STOPPED;
+        } else if (WIFCONTINUED(status)) {
+            p->status = JOB_RUNNING;
+        }
+        job_changed(j, before);
+    }
+}
+
+/* Block until the foreground job j stops or finishes, then report and clean
+ * up. The terminal is handed over for the duration when interactive.
+ * Returns the status of the last member (the last pipeline stage), or
+ * 128 + SIGTSTP when the job stopped. */
+static int wait_for_job(Job *j) {
+    int status;
+    if (shell_interactive && tcsetpgrp(STDIN_FILENO, j->pgid) < 0) perror("tcsetpgrp");
+
+    TRACE_BEGIN(t);
+    while (j->status == JOB_RUNNING) ev_dispatch(-1);
+    TRACE_END(TR_WAIT, t, j->pgid);
+
+    if (j->status == JOB_STOPPED) {
+        j->is_background = 1;
+        printf("\n[%d]+ Stopped\t%s\n", j->jid, job_cmdline(j));
+        status = 128 + SIGTSTP;
+    } else {
+        status = job_exit_status(j);
+        for (int i=0;i<j->nprocs;++i)
+            if (WIFSIGNALED(j->procs[i].wstatus) && WTERMSIG(j->procs[i].wstatus) == SIGINT) fg_interrupted = 1;
+        if (j->timed) job_report_time(j);
+        job_remove_jid(j->jid);
+    }
+
+    /* restore terminal to shell */
+    if (shell_interactive && tcsetpgrp(STDIN_FILENO, shell_pgid) < 0) perror("tcsetpgrp restore");
+    return status;
+}
+
+static char *trim(char *s) {
+    if (!s) return s;
+    while (*s && isspace((unsigned char)*s)) s++;
+    if (*s == '\0') return s;
+    char *end = s + strlen(s) - 1;
+    while (end > s && isspace((unsigned char)*end)) end--;
+    end[1] = '\0';
+    return s;
+}
+
+/* Per-line bump arena.
+ *
+ * Everything needed to parse and run one line (tokens, argv vectors,
+ * Commands, pipe tables) is carved out of line_arena and dropped in one go
+ * once the line has run, so there is no per-token malloc and no fixed cap on
+ * tokens, arguments or pipeline stages. Chunks are kept across lines; after
+ * a line that needed several, they are replaced by one chunk big enough for
+ * the next line of that size (up to ARENA_KEEP).
+ */
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_KEEP (1024 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t cap, used;
+    _Alignas(ARENA_ALIGN) char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head, *cur;     /* chunks after cur are empty */
+    void *last;                 /* most recent allocation: can grow in place */
+} Arena;
+
+typedef struct { ArenaChunk *chunk; size_t used; } ArenaMark;
+
+static Arena line_arena;
+static Arena lex_arena;         /* tokens: only needed while a line is parsed */
+
+static size_t arena_round(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static void *arena_alloc(Arena *a, size_t n) {
+    n = arena_round(n ? n : 1);
+    ArenaChunk *c = a->cur;
+    if (!c || c->cap - c->used < n) {
+        ArenaChunk *next = c ? c->next : a->head;
+        if (!next || next->cap < n) {
+            size_t cap = c ? c->cap * 2 : ARENA_CHUNK;
+            if (cap < n) cap = n;
+            ArenaChunk *fresh = malloc(sizeof(ArenaChunk) + cap);
+            if (!fresh) { perror("malloc"); exit(1); }
+            fresh->cap = cap;
+            fresh->used = 0;
+            fresh->next = next;
+            if (c) c->next = fresh; else a->head = fresh;
+            next = fresh;
+        }
+        c = a->cur = next;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    a->last = p;
+    return p;
+}
+
+/* Resize p (old bytes) to n bytes, in place when it is the latest allocation. */
+static void *arena_grow(Arena *a, void *p, size_t old, size_t n) {
+    ArenaChunk *c = a->cur;
+    if (p && p == a->last && (size_t)((char *)p - c->data) + arena_round(n) <= c->cap) {
+        c->used = (size_t)((char *)p - c->data) + arena_round(n);
+        return p;
+    }
+    void *q = arena_alloc(a, n);
+    if (old) memcpy(q, p, old);
+    return q;
+}
+
+static ArenaMark arena_mark(const Arena *a) {
+    ArenaMark m = { a->cur, a->cur ? a->cur->used : 0 };
+    return m;
+}
+
+/* Drop everything allocated since m. */
+static void arena_release(Arena *a, ArenaMark m) {
+    for (ArenaChunk *c = m.chunk ? m.chunk->next : a->head; c; c = c->next) c->used = 0;
+    if (m.chunk) m.chunk->used = m.used;
+    a->cur = m.chunk;
+    a->last = NULL;
+}
+
+static void arena_reset(Arena *a) {
+    ArenaMark none = { NULL, 0 };
+    if (a->head && a->head->next) {
+        size_t total = 0;
+        for (ArenaChunk *c = a->head, *next; c; c = next) {
+            next = c->next;
+            total += c->cap;
+            free(c);
+        }
+        a->head = NULL;
+        a->cur = NULL;
+        arena_alloc(a, total < ARENA_KEEP ? total : ARENA_KEEP);
+    }
+    arena_release(a, none);
+}
+
+/* Lexer.
+ *
+ * A single pass over the line, driven by a character-class table, that
+ * produces spans pointing straight into the input buffer. Quotes and
+ * backslashes are removed by compacting each word in place, and words are
+ * NUL-terminated in place, so the line is never copied.
+ */
+typedef enum {
+    TOK_WORD, TOK_PIPE,
+    TOK_AMP, TOK_SEMI, TOK_AND, TOK_OR,     /* list operators */
+    TOK_LESS, TOK_GREAT, TOK_DGREAT,        /* redirections */
+    TOK_DLESS, TOK_DLESSDASH, TOK_TLESS,    /* <<, <<-, <<< */
+    TOK_LESSAND, TOK_GREATAND, TOK_LESSGREAT,   /* <&, >&, <> */
+    TOK_ANDGREAT, TOK_ANDDGREAT,            /* &>, &>> */
+} tok_kind_t;
+
+typedef struct {
+    char *s;                    /* word text, NUL-terminated (words only) */
+    uint32_t len;
+    uint8_t kind;
+    int8_t io;                  /* redirection: fd written before it ("2>"), or -1 */
+    uint8_t expand;             /* EXPAND_* */
+} Token;
+
+enum { CC_WORD, CC_SPACE, CC_OP, CC_QUOTE, CC_ESC, CC_DOLLAR, CC_END };
+
+static const unsigned char lex_class[256] = {
+    ['\0'] = CC_END,
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['|'] = CC_OP, ['&'] = CC_OP, [';'] = CC_OP, ['<'] = CC_OP, ['>'] = CC_OP,
+    ['\''] = CC_QUOTE, ['"'] = CC_QUOTE,
+    ['\\'] = CC_ESC,
+    ['$'] = CC_DOLLAR,
+};
+
+/* Tokenize buf in place into a token array grown in arena a (*out).
+ * Returns the token count, or -1 on a syntax error. */
+static int lex_line(char *buf, Arena *a, Token **out) {
+    char *r = buf;
+    char *pending = NULL;       /* word end to NUL once the operator there is read */
+    int io_word = -1;           /* index of a digits-only word glued to what follows */
+    int n = 0, cap = 64;
+    Token *toks = arena_alloc(a, (size_t)cap * sizeof(Token));
+    *out = toks;
+
+    for (;;) {
+        unsigned char cls = lex_class[(unsigned char)*r];
+        if (cls == CC_SPACE) { r++; continue; }
+        if (cls == CC_END || *r == '#') break;
+        if (n == cap) {
+            toks = arena_grow(a, toks, (size_t)cap * sizeof(Token), (size_t)cap * 2 * sizeof(Token));
+            cap *= 2;
+            *out = toks;
+        }
+        Token *t = &toks[n];
+
+        if (cls == CC_OP && (*r == '<' || *r == '>') && r[1] == '(') {
+            /* <(cmd) / >(cmd): one word, the marker over '(' and the
+             * command text up to the matching ')', NUL-terminated there */
+            char *q = r + 2;
+            int depth = 1;
+            for (; *q; ++q) {
+                if (*q == '\\' && q[1]) { q++; continue; }
+                if (*q == '\'' || *q == '"') {
+                    char *close = strchr(q + 1, *q);
+                    if (!close) break;
+                    q = close;
+                    continue;
+                }
+                if (*q == '(') depth++;
+                else if (*q == ')' && --depth == 0) break;
+            }
+            if (*q != ')') { fprintf(stderr,"syntax error: unterminated process substitution\n"); return -1; }
+            if (pending) { *pending = '\0'; pending = NULL; }
+            r[1] = *r == '<' ? CTL_PSUB_IN : CTL_PSUB_OUT;
+            *q = '\0';
+            t->kind = TOK_WORD;
+            t->s = r + 1;
+            t->len = (uint32_t)(q - r - 1);
+            t->io = -1;
+            t->expand = EXPAND_PSUB;
+            r = q + 1;
+            io_word = -1;
+            n++;
+            continue;
+        }
+
+        if (cls == CC_OP) {
+            char c = *r;
+            t->s = NULL;
+            t->len = 0;
+            t->io = -1;
+            t->expand = 0;
+            if (c == '|') { t->kind = r[1] == '|' ? TOK_OR : TOK_PIPE; r += 1 + (r[1] == '|'); }
+            else if (c == '&' && r[1] == '>') { t->kind = r[2] == '>' ? TOK_ANDDGREAT : TOK_ANDGREAT; r += 2 + (r[2] == '>'); }
+            else if (c == '&') { t->kind = r[1] == '&' ? TOK_AND : TOK_AMP; r += 1 + (r[1] == '&'); }
+            else if (c == ';') { t->kind = TOK_SEMI; r++; }
+            else if (c == '<' && r[1] == '<') {
+                if (r[2] == '<') { t->kind = TOK_TLESS; r += 3; }
+                else if (r[2] == '-') { t->kind = TOK_DLESSDASH; r += 3; }
+                else { t->kind = TOK_DLESS; r += 2; }
+            }
+            else if (c == '<' && r[1] == '&') { t->kind = TOK_LESSAND; r += 2; }
+            else if (c == '<' && r[1] == '>') { t->kind = TOK_LESSGREAT; r += 2; }
+            else if (c == '<') { t->kind = TOK_LESS; r++; }
+            else if (r[1] == '>') { t->kind = TOK_DGREAT; r += 2; }
+            else if (r[1] == '&') { t->kind = TOK_GREATAND; r += 2; }
+            else { t->kind = TOK_GREAT; r += 1 + (r[1] == '|'); }  /* >| is > (no noclobber) */
+            if (pending) { *pending = '\0'; pending = NULL; }
+
+            /* "2>": a digits-only word touching a redirection names its fd */
+            if (io_word >= 0 && io_word == n-1 && t->kind >= TOK_LESS) {
+                int fd = atoi(toks[n-1].s);
+                toks[n-1] = *t;
+                toks[n-1].io = (int8_t)fd;
+                io_word = -1;
+                continue;
+            }
+            io_word = -1;
+            n++;
+            continue;
+        }
+
+        /* word: the common unquoted run needs no compaction */
+        char *start = r, *w;
+        int digits = 1, expand = 0;
+        while (lex_class[(unsigned char)*r] == CC_WORD) {
+            if (*r < '0' || *r > '9') digits = 0;
+            r++;
+        }
+        w = r;
+        for (;;) {
+            cls = lex_class[(unsigned char)*r];
+            if (cls == CC_WORD) { *w++ = *r++; continue; }
+            if (cls == CC_QUOTE) {
+                char q = *r++;
+                digits = 0;
+                while (*r && *r != q) {
+                    if (q == '"' && *r == '$' && r[1] == '?') { *w++ = CTL_STATUS; r += 2; expand = EXPAND_STATUS; continue; }
+                    if (q == '"' && *r == '\\') {
+                        if (r[1] == '\n') { r += 2; continue; }
+                        if (r[1] == '"' || r[1] == '\\' || r[1] == '$' || r[1] == '`') r++;
+                    }
+                    *w++ = *r++;
+                }
+                if (!*r) { fprintf(stderr,"syntax error: unterminated quote\n"); return -1; }
+                r++;
+                continue;
+            }
+            if (cls == CC_DOLLAR) {
+                digits = 0;
+                if (r[1] == '?') { *w++ = CTL_STATUS; r += 2; expand = EXPAND_STATUS; }
+                else *w++ = *r++;
+                continue;
+            }
+            if (cls == CC_ESC) {
+                digits = 0;
+                r++;
+                if (*r == '\n') { r++; continue; }  /* line continuation */
+                if (*r) *w++ = *r++;
+                continue;
+            }
+            break;
+        }
+
+        t->kind = TOK_WORD;
+        t->s = start;
+        t->len = (uint32_t)(w - start);
+        t->io = -1;
+        t->expand = (uint8_t)expand;
+        if (w < r) *w = '\0';                       /* quotes freed a byte */
+        else if (cls == CC_SPACE) *r++ = '\0';
+        else if (cls == CC_OP) pending = w;         /* NUL it after the operator */
+        io_word = (digits && cls == CC_OP && (*r == '<' || *r == '>') && t->len <= 2) ? n : -1;
+        n++;
+    }
+    return n;
+}
+
+/* A plan under construction: what the redirections leave in each fd they
+ * touch. A value v >= 0 is the fd v as it was before, -1 closed, and
+ * v <= -2 the file of redirs[-2 - v]. */
+typedef struct {
+    struct { int fd, val; } *fin;
+    int nfin;
+    RedirStep *steps;
+    int nsteps;
+} RedirPlan;
+
+static int redir_get(const RedirPlan *rp, int fd) {
+    for (int i=0;i<rp->nfin;++i) if (rp->fin[i].fd == fd) return rp->fin[i].val;
+    return fd;
+}
+
+static void redir_set(RedirPlan *rp, int fd, int val) {
+    int i = 0;
+    while (i < rp->nfin && rp->fin[i].fd != fd) i++;
+    if (i == rp->nfin) rp->fin[rp->nfin++].fd = fd;
+    rp->fin[i].val = val;
+}
+
+static void redir_step(RedirPlan *rp, int op, int fd, int src) {
+    RedirStep *st = &rp->steps[rp->nsteps++];
+    st->op = op;
+    st->fd = fd;
+    st->src = src;
+}
+
+/* Reduce c's redirections to c->plan (see Redirections). The list is run on
+ * paper first, which gives each fd it touches a final value. Then come, in
+ * this order:
+ *
+ *   - copies of fds as they were, each before its source is overwritten; a
+ *     cycle (3>&1 1>&2 2>&3) goes through the scratch fd
+ *   - every file, in the order written, opened onto the first fd it ends
+ *     on and copied to the others; one that ends on no fd is still opened
+ *     (>a >b creates a), onto an fd that a later step sets anyway
+ *   - closes
+ *
+ * Returns -1 (reported) when an fd is copied after the list closed it. */
+static int redir_plan(Command *c) {
+    int n = c->nredirs;
+    RedirPlan rp;
+    rp.fin = arena_alloc(&line_arena, (size_t)(2 * n) * sizeof(*rp.fin));
+    rp.nfin = 0;
+    for (int i=0;i<n;++i) {
+        const Redir *r = &c->redirs[i];
+        if (r->op == R_DUP_IN || r->op == R_DUP_OUT) {
+            int v = r->src < 0 ? -1 : redir_get(&rp, r->src);
+            if (r->src >= 0 && v == -1) {
+                fprintf(stderr,"syntax error: %d%s&%d: %d is closed by then\n", r->fd,
+                        r->op == R_DUP_IN ? "<" : ">", r->src, r->src);
+                return -1;
+            }
+            redir_set(&rp, r->fd, v);
+        } else if (r->op == R_ALL || r->op == R_ALL_APPEND) {
+            redir_set(&rp, 1, -2 - i);
+            redir_set(&rp, 2, -2 - i);
+        } else {
+            redir_set(&rp, r->fd, -2 - i);
+        }
+    }
+
+    /* each fd gets at most one copy or open and one close; a file that
+     * ends on no fd takes an open and a close; a cycle a copy and a close */
+    rp.steps = arena_alloc(&line_arena, (size_t)(4 * rp.nfin + 2 * n + 1) * sizeof(RedirStep));
+    rp.nsteps = 0;
+    int *mt = arena_alloc(&line_arena, (size_t)(2 * rp.nfin + 1) * sizeof(int)), *ms = mt + rp.nfin;
+    int m = 0, fd_max = 2;
+    for (int i=0;i<rp.nfin;++i) {
+        int fd = rp.fin[i].fd, v = rp.fin[i].val;
+        if (fd > fd_max) fd_max = fd;
+        if (v > fd_max) fd_max = v;
+        if (v >= 0 && v != fd) { mt[m] = fd; ms[m] = v; m++; }
+    }
+    while (m > 0) {
+        int k = 0, j = 0;
+        for (; k < m; ++k) {
+            for (j = 0; j < m && ms[j] != mt[k]; ++j) {}
+            if (j == m) break;      /* nothing still reads mt[k] */
+        }
+        if (k == m) {
+            /* only cycles left: keep one fd of one of them aside */
+            int save = mt[0];
+            redir_step(&rp, STEP_DUP, REDIR_TMP, save);
+            for (j = 0; j < m; ++j) if (ms[j] == save) ms[j] = REDIR_TMP;
+            continue;
+        }
+        int src = ms[k];
+        redir_step(&rp, STEP_DUP, mt[k], src);
+        mt[k] = mt[m-1];
+        ms[k] = ms[m-1];
+        m--;
+        for (j = 0; src == REDIR_TMP && j < m && ms[j] != REDIR_TMP; ++j) {}
+        if (src == REDIR_TMP && j == m) redir_step(&rp, STEP_CLOSE, REDIR_TMP, 0);
+    }
+
+    for (int i=0;i<n;++i) {
+        const Redir *r = &c->redirs[i];
+        if (r->op == R_DUP_IN || r->op == R_DUP_OUT) continue;
+        int first = -1;
+        for (int k=0;k<rp.nfin;++k) {
+            if (rp.fin[k].val != -2 - i) continue;
+            if (first < 0) redir_step(&rp, STEP_OPEN, first = rp.fin[k].fd, i);
+            else redir_step(&rp, STEP_DUP, rp.fin[k].fd, first);
+        }
+        if (first >= 0) continue;
+        /* overwritten later: the fd it was written for, if a later file or
+         * a close takes that fd; else the scratch fd */
+        int w = r->op == R_ALL || r->op == R_ALL_APPEND ? 1 : r->fd;
+        int v = redir_get(&rp, w);
+        if (v == -1 || (v <= -2 && -2 - v > i)) redir_step(&rp, STEP_OPEN, w, i);
+        else {
+            redir_step(&rp, STEP_OPEN, REDIR_TMP, i);
+            redir_step(&rp, STEP_CLOSE, REDIR_TMP, 0);
+        }
+    }
+
+    for (int i=0;i<rp.nfin;++i)
+        if (rp.fin[i].val == -1) redir_step(&rp, STEP_CLOSE, rp.fin[i].fd, 0);
+
+    c->plan = rp.steps;
+    c->nplan = rp.nsteps;
+    c->fd_max = fd_max;
+    c->plan_tmp = 0;
+    for (int i=0;i<rp.nsteps;++i) c->plan_tmp |= rp.steps[i].fd == REDIR_TMP;
+    return 0;
+}
+
+/* Build Command structs from tokens. argv[] receives every command's
+ * NULL-terminated argument vector back to back and needs room for
+ * (words + pipes + 1) entries; redirs[] their redirections, one per
+ * redirection operator.
+ */
+static int parse_pipeline(Token *toks, int ntokens, char **argv, Command cmds[], Redir *redirs) {
+    int cmd_idx = 0;
+    int out = 0;
+    if (ntokens == 0) return 0;
+
+    memset(&cmds[cmd_idx], 0, sizeof(Command));
+    cmds[cmd_idx].argv = &argv[0];
+    cmds[cmd_idx].redirs = redirs;
+    for (int i=0;i<ntokens;i++) {
+        Token *t = &toks[i];
+        switch (t->kind) {
+        case TOK_WORD:
+            /* normal arg */
+            argv[out++] = t->s;
+            cmds[cmd_idx].expand |= t->expand;
+            continue;
+        case TOK_PIPE:
+            /* a pipe needs a command (words or redirections) on both sides */
+            if (&argv[out] == cmds[cmd_idx].argv && !cmds[cmd_idx].nredirs) {
+                fprintf(stderr,"syntax error near '|'\n");
+                return -1;
+            }
+            if (redir_plan(&cmds[cmd_idx]) < 0) return -1;
+            redirs += cmds[cmd_idx].nredirs;
+            argv[out++] = NULL;
+            cmd_idx++;
+            memset(&cmds[cmd_idx], 0, sizeof(Command));
+            cmds[cmd_idx].argv = &argv[out];
+            cmds[cmd_idx].redirs = redirs;
+            continue;
+        default:
+            break;
+        }
+
+        /* redirection: operator + word (file, fd, here-string, delimiter) */
+        static const char *const ops[] = {
+            [TOK_LESS] = "<", [TOK_GREAT] = ">", [TOK_DGREAT] = ">>",
+            [TOK_DLESS] = "<<", [TOK_DLESSDASH] = "<<-", [TOK_TLESS] = "<<<",
+            [TOK_LESSAND] = "<&", [TOK_GREATAND] = ">&", [TOK_LESSGREAT] = "<>",
+            [TOK_ANDGREAT] = "&>", [TOK_ANDDGREAT] = "&>>",
+        };
+        static const unsigned char rops[] = {
+            [TOK_LESS] = R_IN, [TOK_GREAT] = R_OUT, [TOK_DGREAT] = R_APPEND,
+            [TOK_DLESS] = R_HERE, [TOK_DLESSDASH] = R_HERE, [TOK_TLESS] = R_HERE,
+            [TOK_LESSAND] = R_DUP_IN, [TOK_GREATAND] = R_DUP_OUT, [TOK_LESSGREAT] = R_RW,
+            [TOK_ANDGREAT] = R_ALL, [TOK_ANDDGREAT] = R_ALL_APPEND,
+        };
+        const char *op = ops[t->kind];
+        int here = t->kind == TOK_DLESS || t->kind == TOK_DLESSDASH || t->kind == TOK_TLESS;
+        if (i+1>=ntokens || toks[i+1].kind != TOK_WORD) {
+            fprintf(stderr,"syntax error: %s without %s\n", op,
+                    t->kind == TOK_TLESS ? "word" : here ? "delimiter" : "file");
+            return -1;
+        }
+        char *word = toks[++i].s;
+        Command *c = &cmds[cmd_idx];
+        Redir *r = &c->redirs[c->nredirs++];
+        int input = rops[t->kind] == R_IN || rops[t->kind] == R_HERE || rops[t->kind] == R_DUP_IN || rops[t->kind] == R_RW;
+        r->path = word;
+        r->op = rops[t->kind];
+        r->fd = t->io >= 0 ? t->io : !input;
+        r->src = -1;
+        if (t->kind != TOK_DLESS && t->kind != TOK_DLESSDASH) c->expand |= toks[i].expand;
+        if (r->op == R_DUP_IN || r->op == R_DUP_OUT) {
+            size_t nd = strspn(word, "0123456789");
+            r->path = NULL;
+            if (nd && !word[nd] && nd <= 6) r->src = atoi(word);
+            else if (t->kind == TOK_GREATAND && t->io < 0 && strcmp(word, "-") != 0) {
+                r->op = R_ALL;      /* >&file is &>file */
+                r->path = word;
+            } else if (strcmp(word, "-") != 0) {
+                fprintf(stderr,"syntax error: %s%s needs an fd number or -\n", op, word);
+                return -1;
+            }
+        } else if (here) {
+            /* one here text per command: a here-document's body follows
+             * the line and has to be read */
+            if (c->here_flags) { fprintf(stderr,"syntax error: %s after a here-document or here-string\n", op); return -1; }
+            r->path = NULL;
+            if (t->kind == TOK_TLESS) {
+                c->here = word;
+                c->here_len = toks[i].len;
+                c->here_flags = HERE_STRING;
+            } else {
+                c->here_delim = word;
+                c->here_flags = HERE_DOC | (t->kind == TOK_DLESSDASH ? HERE_STRIP : 0);
+            }
+        }
+    }
+    if (cmd_idx && &argv[out] == cmds[cmd_idx].argv && !cmds[cmd_idx].nredirs) {
+        fprintf(stderr,"syntax error near '|'\n");
+        return -1;
+    }
+    if (redir_plan(&cmds[cmd_idx]) < 0) return -1;
+    argv[out] = NULL;
+    return cmd_idx + 1;
+}
+
+/* One input line after parsing, ready to run: a command list, or NULL for
+ * an empty line. cmds are all its Commands in line order; heredocs of them
+ * wait for a here-document body (see heredoc_read_buf). */
+typedef struct {
+    Node *root;
+    Command *cmds;
+    int ncmds;
+    int heredocs;
+} ParsedLine;
+
+/* Recursive descent over one line's tokens:
+ *
+ *   list     := and_or ((';' | '&') and_or)* [';' | '&']
+ *   and_or   := pipeline (('&&' | '||') pipeline)*
+ *   pipeline := ['time'] command ('|' command)*
+ *
+ * Nodes, argv, Commands and Redirs come from line_arena; argv, cmds and
+ * redirs advance as pipelines are parsed into them.
+ */
+typedef struct {
+    Token *toks;
+    int ntokens, pos;
+    char **argv;
+    Command *cmds;
+    Redir *redirs;
+} Parser;
+
+static const char *tok_name(const Token *t) {
+    static const char *const names[] = {
+        [TOK_PIPE] = "|", [TOK_AMP] = "&", [TOK_SEMI] = ";", [TOK_AND] = "&&", [TOK_OR] = "||",
+    };
+    return names[t->kind];
+}
+
+static int tok_is_list_op(const Token *t) {
+    return t->kind >= TOK_AMP && t->kind <= TOK_OR;
+}
+
+static Node *node_new(node_kind_t kind, Node *left, Node *right) {
+    Node *n = arena_alloc(&line_arena, sizeof(Node));
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+static const char *parse_word(const Parser *p, int i) {
+    return i < p->ntokens && p->toks[i].kind == TOK_WORD ? p->toks[i].s : NULL;
+}
+
+/* A resource prefix at p->pos (see Limits), merged into *lim. Returns 1
+ * when one was consumed, 0 when there is none (a prefix word with no
+ * command after it is the builtin of that name, acting on the shell), -1
+ * on a bad argument. */
+static int parse_limit_prefix(Parser *p, Limits **lim) {
+    const char *name = parse_word(p, p->pos), *w;
+    int q = p->pos + 1, nkv = 0;
+    if (!name) return 0;
+    if (strcmp(name, "nice") == 0) {
+        if ((w = parse_word(p, q)) && strcmp(w, "-n") == 0) q += 2;
+    } else if (strcmp(name, "affinity") == 0) {
+        q++;
+    } else if (strcmp(name, "ulimit") == 0) {
+        while ((w = parse_word(p, q)) && ulimit_find(w) >= 0) q += 2;
+        if (q == p->pos + 1) return 0;
+    } else if (strcmp(name, "cgroup") == 0) {
+        while ((w = parse_word(p, q)) && strchr(w, '=')) { q++; nkv++; }
+    } else {
+        return 0;
+    }
+    if (!parse_word(p, q - 1) || !parse_word(p, q)) return 0;
+
+    Limits *l = *lim;
+    if (!l) {
+        l = *lim = arena_alloc(&line_arena, sizeof(Limits));
+        memset(l, 0, sizeof(*l));
+    }
+    const char *arg = parse_word(p, p->pos + 1);
+    if (name[0] == 'n') {
+        l->has_nice = 1;
+        l->nice = 10;
+        if (q > p->pos + 1 && nice_parse(parse_word(p, p->pos + 2), &l->nice) < 0) {
+            fprintf(stderr,"nice: %s: invalid adjustment\n", parse_word(p, p->pos + 2));
+            return -1;
+        }
+    } else if (name[0] == 'a') {
+        if (cpus_parse(arg, &l->cpuset) < 0) { fprintf(stderr,"affinity: %s: invalid CPU list\n", arg); return -1; }
+        l->cpus = arg;
+    } else if (name[0] == 'u') {
+        for (int i = p->pos + 1; i < q; i += 2) {
+            int opt = ulimit_find(parse_word(p, i)), k = 0;
+            rlim_t val;
+            if (ulimit_parse(opt, parse_word(p, i + 1), &val) < 0) {
+                fprintf(stderr,"ulimit: %s: invalid number\n", parse_word(p, i + 1));
+                return -1;
+            }
+            while (k < l->nrlim && l->rlim[k].opt != opt) k++;
+            l->rlim[k].opt = opt;
+            l->rlim[k].val = val;
+            if (k == l->nrlim) l->nrlim++;
+        }
+    } else {
+        l->cgroup = 1;
+        if (nkv) {
+            int old = 0;
+            while (l->cg_kv && l->cg_kv[old]) old++;
+            char **kv = arena_alloc(&line_arena, (size_t)(old + nkv + 1) * sizeof(char *));
+            for (int i=0;i<old;++i) kv[i] = l->cg_kv[i];
+            for (int i=0;i<nkv;++i) {
+                kv[old + i] = p->toks[p->pos + 1 + i].s;
+                if (!cgroup_kv_ok(kv[old + i])) { fprintf(stderr,"cgroup: %s: invalid setting\n", kv[old + i]); return -1; }
+            }
+            kv[old + nkv] = NULL;
+            l->cg_kv = kv;
+        }
+    }
+    p->pos = q;
+    return 1;
+}
+
+static Node *parse_pipeline_node(Parser *p) {
+    int timed = 0, nwords = 0;
+    Limits *lim = NULL;
+    for (;;) {
+        const char *w = parse_word(p, p->pos);
+        if (w && strcmp(w, "time") == 0) {
+            timed = 1;
+            p->pos++;
+            continue;
+        }
+        int r = parse_limit_prefix(p, &lim);
+        if (r < 0) return NULL;
+        if (!r) break;
+    }
+    int start = p->pos;
+    for (; p->pos < p->ntokens && !tok_is_list_op(&p->toks[p->pos]); p->pos++)
+        if (p->toks[p->pos].kind == TOK_WORD) nwords++;
+    if (p->pos == start) {
+        fprintf(stderr,"syntax error near '%s'\n", p->pos < p->ntokens ? tok_name(&p->toks[p->pos]) : "newline");
+        return NULL;
+    }
+
+    int ncmds = parse_pipeline(&p->toks[start], p->pos - start, p->argv, p->cmds, p->redirs);
+    if (ncmds < 0) return NULL;
+    Node *n = node_new(NODE_PIPELINE, NULL, NULL);
+    n->cmds = p->cmds;
+    n->ncmds = ncmds;
+    n->timed = timed;
+    n->lim = lim;
+    p->argv += nwords + ncmds;
+    for (int i=0;i<ncmds;++i) p->redirs += p->cmds[i].nredirs;
+    p->cmds += ncmds;
+    return n;
+}
+
+static Node *parse_and_or(Parser *p) {
+    Node *n = parse_pipeline_node(p);
+    while (n && p->pos < p->ntokens && (p->toks[p->pos].kind == TOK_AND || p->toks[p->pos].kind == TOK_OR)) {
+        node_kind_t kind = p->toks[p->pos++].kind == TOK_AND ? NODE_AND : NODE_OR;
+        Node *right = parse_pipeline_node(p);
+        n = right ? node_new(kind, n, right) : NULL;
+    }
+    return n;
+}
+
+static Node *parse_list(Parser *p) {
+    Node *list = NULL;
+    while (p->pos < p->ntokens) {
+        Node *n = parse_and_or(p);
+        if (!n) return NULL;
+        /* and_or stops at ';', '&' or the end */
+        if (p->pos < p->ntokens && p->toks[p->pos++].kind == TOK_AMP) n = node_new(NODE_BG, n, NULL);
+        list = list ? node_new(NODE_SEQ, list, n) : n;
+    }
+    return list;
+}
+
+/* Lex and parse one line in place. The tree, argv and Commands come from
+ * line_arena and stay valid until it is reset or released, so many lines
+ * can stay parsed at once (scripts are parsed whole before they run).
+ * Returns 1 when pl is ready to run, 0 for an empty line or comment, -1 on
+ * a syntax error.
+ */
+static int parse_line_untraced(char *line, ParsedLine *pl) {
+    Token *toks;
+    memset(pl, 0, sizeof(*pl));
+    line = trim(line);
+
+    int ntokens = lex_line(line, &lex_arena, &toks);
+    if (ntokens <= 0) { arena_reset(&lex_arena); return ntokens; }
+
+    /* every list operator or pipe ends at most one argv and one Command */
+    int nwords = 0, nops = 0, nredirs = 0;
+    for (int i=0;i<ntokens;++i) {
+        if (toks[i].kind == TOK_WORD) nwords++;
+        else if (toks[i].kind <= TOK_OR) nops++;
+        else nredirs++;
+    }
+
+    Parser p = { toks, ntokens, 0, NULL, NULL, NULL };
+    p.argv = arena_alloc(&line_arena, (size_t)(nwords + nops + 1) * sizeof(char *));
+    p.cmds = pl->cmds = arena_alloc(&line_arena, (size_t)(nops + 1) * sizeof(Command));
+    p.redirs = arena_alloc(&line_arena, (size_t)nredirs * sizeof(Redir));
+    pl->root = parse_list(&p);
+    arena_reset(&lex_arena);
+    if (!pl->root) return -1;
+    pl->ncmds = (int)(p.cmds - pl->cmds);
+    for (int i=0;i<pl->ncmds;++i) pl->heredocs += (pl->cmds[i].here_flags & HERE_DOC) != 0;
+    return 1;
+}
+
+static int parse_line(char *line, ParsedLine *pl) {
+    TRACE_BEGIN(t);
+    int r = parse_line_untraced(line, pl);
+    TRACE_END(TR_PARSE, t, 0);
+    return r;
+}
+
+/* Here-document bodies.
+ *
+ * A line with `<< DELIM` is followed by the body: the lines up to one that
+ * is exactly DELIM (after leading tabs, for <<-). In a script the body is
+ * left where it is in the script buffer and the Command points at it;
+ * lines read one at a time (stdin, the terminal) are gathered in
+ * line_arena. Bodies are taken literally.
+ */
+static int heredoc_is_end(const Command *c, const char *line, size_t len) {
+    if (c->here_flags & HERE_STRIP) while (len && *line == '\t') { line++; len--; }
+    return len == strlen(c->here_delim) && memcmp(line, c->here_delim, len) == 0;
+}
+
+static void heredoc_eof_warning(const Command *c) {
+    fprintf(stderr,"tsh: warning: here-document delimited by end-of-file (wanted '%s')\n", c->here_delim);
+}
+
+/* Point pl's here-documents at their bodies in buf, from p up to end.
+ * Returns the start of the line after the last body; *lineno counts the
+ * lines passed. */
+static char *heredoc_read_buf(ParsedLine *pl, char *p, char *end, size_t *lineno) {
+    for (int i=0;pl->heredocs && i<pl->ncmds;++i) {
+        Command *c = &pl->cmds[i];
+        if (!(c->here_flags & HERE_DOC)) continue;
+        c->here = p;
+        for (;;) {
+            if (p >= end) {
+                heredoc_eof_warning(c);
+                c->here_len = (size_t)(end - c->here);
+                break;
+            }
+            char *nl = memchr(p, '\n', (size_t)(end - p));
+            char *next = nl ? nl + 1 : end;
+            (*lineno)++;
+            if (heredoc_is_end(c, p, (size_t)((nl ? nl : end) - p))) {
+                c->here_len = (size_t)(p - c->here);
+                p = next;
+                break;
+            }
+            p = next;
+        }
+    }
+    return p;
+}
+
+/* The same for input read a line at a time from more(arg), which returns
+ * NULL at the end. */
+static void heredoc_read_lines(ParsedLine *pl, char *(*more)(void *), void *arg) {
+    for (int i=0;pl->heredocs && i<pl->ncmds;++i) {
+        Command *c = &pl->cmds[i];
+        if (!(c->here_flags & HERE_DOC)) continue;
+        size_t len = 0, cap = 256;
+        char *body = arena_alloc(&line_arena, cap), *line;
+        while ((line = more(arg))) {
+            size_t n = strlen(line);
+            if (heredoc_is_end(c, line, n)) break;
+            if (len + n + 1 > cap) {
+                size_t ncap = cap * 2 > len + n + 1 ? cap * 2 : len + n + 1;
+                body = arena_grow(&line_arena, body, len, ncap);
+                cap = ncap;
+            }
+            memcpy(body + len, line, n);
+            body[len + n] = '\n';
+            len += n + 1;
+        }
+        if (!line) heredoc_eof_warning(c);
+        c->here = body;
+        c->here_len = len;
+    }
+}
+
+/* Command hash (bash-style): command name -> absolute path of the executable.
+ * Open addressing with linear probing; filled lazily on first use of a name,
+ * dropped wholesale when $PATH changes and per entry when exec of the cached
+ * path fails with ENOENT.
+ */
+typedef struct HashEntry {
+    char *name;         /* NULL: empty slot */
+    char *path;
+    unsigned hits;
+} HashEntry;
+
+static HashEntry *cmd_hash;
+static size_t cmd_hash_cap;     /* power of two */
+static size_t cmd_hash_len;
+static char *cmd_hash_pathvar;  /* $PATH the entries were resolved under */
+static unsigned cmd_hash_gen = 1;   /* bumped whenever entries move or go away */
+
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 1469598103934665603ULL; /* FNV-1a */
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static void cmd_hash_clear(void) {
+    for (size_t i=0;i<cmd_hash_cap;++i) {
+        free(cmd_hash[i].name);
+        free(cmd_hash[i].path);
+    }
+    free(cmd_hash);
+    cmd_hash = NULL;
+    cmd_hash_cap = cmd_hash_len = 0;
+    cmd_hash_gen++;
+}
+
+static HashEntry *cmd_hash_find(const char *name) {
+    if (!cmd_hash_len) return NULL;
+    size_t mask = cmd_hash_cap - 1;
+    for (size_t i = hash_str(name) & mask; cmd_hash[i].name; i = (i+1) & mask)
+        if (strcmp(cmd_hash[i].name, name) == 0) return &cmd_hash[i];
+    return NULL;
+}
+
+static void cmd_hash_put(char *name, char *path, unsigned hits) {
+    if ((cmd_hash_len + 1) * 10 > cmd_hash_cap * 7) {
+        size_t oldcap = cmd_hash_cap;
+        HashEntry *old = cmd_hash;
+        cmd_hash_cap = oldcap ? oldcap * 2 : 64;
+        cmd_hash = calloc(cmd_hash_cap, sizeof(HashEntry));
+        if (!cmd_hash) { perror("calloc"); exit(1); }
+        cmd_hash_len = 0;
+        cmd_hash_gen++;
+        for (size_t i=0;i<oldcap;++i)
+            if (old[i].name) cmd_hash_put(old[i].name, old[i].path, old[i].hits);
+        free(old);
+    }
+    size_t mask = cmd_hash_cap - 1;
+    size_t i = hash_str(name) & mask;
+    while (cmd_hash[i].name) i = (i+1) & mask;
+    cmd_hash[i].name = name;
+    cmd_hash[i].path = path;
+    cmd_hash[i].hits = hits;
+    cmd_hash_len++;
+}
+
+/* Backward-shift deletion keeps probe chains intact without tombstones. */
+static void cmd_hash_remove(const char *name) {
+    HashEntry *e = cmd_hash_find(name);
+    if (!e) return;
+    size_t mask = cmd_hash_cap - 1;
+    size_t i = (size_t)(e - cmd_hash);
+    free(e->name); free(e->path);
+    e->name = e->path = NULL;
+    cmd_hash_len--;
+    cmd_hash_gen++;
+    for (size_t j = (i+1) & mask; cmd_hash[j].name; j = (j+1) & mask) {
+        size_t home = hash_str(cmd_hash[j].name) & mask;
+        /* move j back into the hole unless its home lies cyclically in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cmd_hash[i] = cmd_hash[j];
+            cmd_hash[j].name = cmd_hash[j].path = NULL;
+            i = j;
+        }
+    }
+}
+
+static void cmd_hash_check_path(void) {
+    const char *pathvar = getenv("PATH");
+    if (!pathvar) pathvar = "";
+    if (cmd_hash_pathvar && strcmp(cmd_hash_pathvar, pathvar) == 0) return;
+    cmd_hash_clear();
+    free(cmd_hash_pathvar);
+    /* without a copy nothing is found (and cached) until one can be made */
+    if (!(cmd_hash_pathvar = strdup(pathvar))) perror("strdup");
+}
+
+/* Search $PATH the way execvp does. Returns a malloc'd path or NULL. */
+static char *path_search(const char *name) {
+    const char *p = cmd_hash_pathvar;
+    size_t nlen = strlen(name);
+    char buf[PATH_MAX];
+    struct stat st;
+
+    if (!p) return NULL;
+    for (;;) {
+        const char *colon = strchr(p, ':');
+        size_t dlen = colon ? (size_t)(colon - p) : strlen(p);
+        if (dlen + 1 + nlen < sizeof(buf)) {
+            if (dlen == 0) { memcpy(buf, ".", 1); dlen = 1; }  /* empty entry means cwd */
+            else memcpy(buf, p, dlen);
+            buf[dlen] = '/';
+            memcpy(buf + dlen + 1, name, nlen + 1);
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) {
+                char *path = strdup(buf);
+                if (!path) perror("strdup");
+                return path;
+            }
+        }
+        if (!colon) return NULL;
+        p = colon + 1;
+    }
+}
+
+/* Resolve a command name to an executable path. Names containing '/' are used
+ * as given. *cached is set when the result came from the table. */
+static const char *resolve_command(const char *name, int *cached) {
+    *cached = 0;
+    if (strchr(name, '/')) return name;
+    cmd_hash_check_path();
+    HashEntry *e = cmd_hash_find(name);
+    if (e) { e->hits++; *cached = 1; return e->path; }
+    char *path = path_search(name);
+    if (!path) return NULL;
+    /* the table owns every path handed out: one it cannot take is dropped */
+    char *key = strdup(name);
+    if (!key) { perror("strdup"); free(path); return NULL; }
+    cmd_hash_put(key, path, 1);
+    return path;
+}
+
+/* resolve_command for a Command that may run again (a cached line): the
+ * entry it resolved to is remembered and reused while the table is
+ * unchanged. Relative results depend on the directory and are looked up
+ * each time. */
+static const char *resolve_cmd(Command *c, int *cached) {
+    cmd_hash_check_path();
+    if (c->exe && c->exe_gen == cmd_hash_gen) {
+        c->exe->hits++;
+        *cached = 1;
+        return c->exe->path;
+    }
+    const char *path = resolve_command(c->argv[0], cached);
+    c->exe = path && path[0] == '/' && path != c->argv[0] ? cmd_hash_find(c->argv[0]) : NULL;
+    c->exe_gen = cmd_hash_gen;
+    return path;
+}
+
+/* Parsed-line cache.
+ *
+ * Batch input repeats the same lines over and over, so a line that parsed
+ * is kept, keyed by its text: the tree, Commands, argv and words are copied
+ * into one block, together with each pipeline's job line. A hit runs the
+ * copy without lexing or parsing. A parse depends on nothing but the text
+ * (lines with here-documents are not kept: their bodies follow), so entries
+ * never go stale; what the environment affects, the executable, is
+ * resolved at launch (see resolve_cmd). Beyond cache_max entries the least
+ * recently used one goes.
+ */
+#define CACHE_DEFAULT 128
+#define CACHE_LINE_MAX 4096     /* longer lines are parsed every time */
+
+typedef struct CacheEntry {
+    struct CacheEntry *prev, *next;     /* LRU list, most recent first */
+    uint64_t hash;
+    size_t len;
+    char *line;
+    Node *root;
+    unsigned long hits;
+} CacheEntry;
+
+typedef struct {
+    char *base;                 /* NULL: only measure */
+    size_t used;
+} CacheBuf;
+
+static CacheEntry **cache_tab;  /* open addressing on hash; NULL: empty */
+static size_t cache_cap;        /* power of two */
+static size_t cache_len;
+static size_t cache_max = CACHE_DEFAULT;
+static CacheEntry *cache_head, *cache_tail;
+static CacheEntry *cache_running;   /* entry of the line being run */
+static int cache_running_dropped;   /* ...evicted meanwhile: free it when done */
+static unsigned long cache_hits, cache_misses, cache_evictions;
+
+static uint64_t cache_hash(const char *s, size_t *len) {
+    uint64_t h = 1469598103934665603ULL; /* FNV-1a */
+    const char *p = s;
+    for (; *p; ++p) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    *len = (size_t)(p - s);
+    return h;
+}
+
+static void *cache_take(CacheBuf *b, size_t n, size_t align) {
+    b->used = (b->used + align - 1) & ~(align - 1);
+    void *p = b->base ? b->base + b->used : NULL;
+    b->used += n;
+    return p;
+}
+
+static char *cache_copy_str(CacheBuf *b, const char *s) {
+    if (!s) return NULL;
+    size_t n = strlen(s) + 1;
+    char *d = cache_take(b, n, 1);
+    if (d) memcpy(d, s, n);
+    return d;
+}
+
+/* Copy a tree into b; with b->base NULL this only adds up the size. */
+static Node *cache_copy_node(CacheBuf *b, const Node *n) {
+    Node *d = cache_take(b, sizeof(Node), _Alignof(Node));
+    Node *left = n->left ? cache_copy_node(b, n->left) : NULL;
+    Node *right = n->right ? cache_copy_node(b, n->right) : NULL;
+    Command *cmds = NULL;
+    char *text = NULL;
+    if (n->kind == NODE_PIPELINE) {
+        cmds = cache_take(b, (size_t)n->ncmds * sizeof(Command), _Alignof(Command));
+        for (int i=0;i<n->ncmds;++i) {
+            const Command *c = &n->cmds[i];
+            int argc = 0;
+            while (c->argv[argc]) argc++;
+            char **argv = cache_take(b, (size_t)(argc + 1) * sizeof(char *), _Alignof(char *));
+            for (int k=0;k<argc;++k) {
+                char *w = cache_copy_str(b, c->argv[k]);
+                if (argv) argv[k] = w;
+            }
+            Redir *redirs = cache_take(b, (size_t)c->nredirs * sizeof(Redir), _Alignof(Redir));
+            for (int k=0;k<c->nredirs;++k) {
+                char *w = cache_copy_str(b, c->redirs[k].path);
+                if (redirs) { redirs[k] = c->redirs[k]; redirs[k].path = w; }
+            }
+            RedirStep *plan = cache_take(b, (size_t)c->nplan * sizeof(RedirStep), _Alignof(RedirStep));
+            if (plan) memcpy(plan, c->plan, (size_t)c->nplan * sizeof(RedirStep));
+            char *here = cache_copy_str(b, c->here_flags & HERE_STRING ? c->here : NULL);
+            char *delim = cache_copy_str(b, c->here_delim);
+            if (cmds) {
+                cmds[i] = *c;
+                argv[argc] = NULL;
+                cmds[i].argv = argv;
+                cmds[i].redirs = redirs;
+                cmds[i].plan = plan;
+                cmds[i].here = here;
+                cmds[i].here_delim = delim;
+                cmds[i].exe = NULL;
+            }
+        }
+        text = cache_take(b, job_text_pipeline(n, NULL) + 1, 1);
+        if (text) job_text_pipeline(n, text);
+    }
+    Limits *lim = NULL;
+    if (n->lim) {
+        int nkv = 0;
+        while (n->lim->cg_kv && n->lim->cg_kv[nkv]) nkv++;
+        lim = cache_take(b, sizeof(Limits), _Alignof(Limits));
+        char *cpus = cache_copy_str(b, n->lim->cpus);
+        char **kv = nkv ? cache_take(b, (size_t)(nkv + 1) * sizeof(char *), _Alignof(char *)) : NULL;
+        for (int i=0;i<nkv;++i) {
+            char *w = cache_copy_str(b, n->lim->cg_kv[i]);
+            if (kv) kv[i] = w;
+        }
+        if (lim) {
+            *lim = *n->lim;
+            lim->cpus = cpus;
+            lim->cg_kv = kv;
+            if (kv) kv[nkv] = NULL;
+        }
+    }
+    if (d) {
+        *d = *n;
+        d->left = left;
+        d->right = right;
+        d->cmds = cmds;
+        d->text = text;
+        d->lim = lim;
+    }
+    return d;
+}
+
+static void cache_unlink(CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next; else cache_head = e->next;
+    if (e->next) e->next->prev = e->prev; else cache_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cache_push(CacheEntry *e) {
+    e->next = cache_head;
+    if (cache_head) cache_head->prev = e; else cache_tail = e;
+    cache_head = e;
+}
+
+static CacheEntry **cache_slot(uint64_t hash, const char *line, size_t len) {
+    size_t mask = cache_cap - 1;
+    size_t i = (size_t)hash & mask;
+    for (; cache_tab[i]; i = (i+1) & mask) {
+        CacheEntry *e = cache_tab[i];
+        if (e->hash == hash && e->len == len && memcmp(e->line, line, len) == 0) break;
+    }
+    return &cache_tab[i];
+}
+
+/* Remove e from the table (backward-shift deletion, as in cmd_hash_remove)
+ * and free it, unless it is the line being run. */
+static void cache_drop(CacheEntry *e) {
+    size_t mask = cache_cap - 1;
+    size_t i = (size_t)(cache_slot(e->hash, e->line, e->len) - cache_tab);
+    cache_tab[i] = NULL;
+    cache_len--;
+    for (size_t j = (i+1) & mask; cache_tab[j]; j = (j+1) & mask) {
+        size_t home = (size_t)cache_tab[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache_tab[i] = cache_tab[j];
+            cache_tab[j] = NULL;
+            i = j;
+        }
+    }
+    cache_unlink(e);
+    if (e == cache_running) cache_running_dropped = 1;
+    else free(e);
+}
+
+static void cache_trim(size_t max) {
+    while (cache_len > max) {
+        cache_drop(cache_tail);
+        cache_evictions++;
+    }
+}
+
+/* The entry for line (hash from cache_hash), or NULL on a miss. */
+static CacheEntry *cache_get(const char *line, size_t len, uint64_t hash) {
+    CacheEntry *e = cache_len ? *cache_slot(hash, line, len) : NULL;
+    if (!e) {
+        if (cache_max) cache_misses++;
+        return NULL;
+    }
+    cache_hits++;
+    e->hits++;
+    if (e != cache_head) { cache_unlink(e); cache_push(e); }
+    return e;
+}
+
+/* Keep a copy of the parsed tree root for line; NULL when the cache is off
+ * or the line too long. */
+static CacheEntry *cache_put(const char *line, size_t len, uint64_t hash, const Node *root) {
+    if (!cache_max || len > CACHE_LINE_MAX) return NULL;
+    cache_trim(cache_max - 1);
+    if ((cache_len + 1) * 10 > cache_cap * 7) {
+        size_t oldcap = cache_cap;
+        CacheEntry **old = cache_tab;
+        cache_cap = oldcap ? oldcap * 2 : 64;
+        cache_tab = calloc(cache_cap, sizeof(*cache_tab));
+        if (!cache_tab) { perror("calloc"); exit(1); }
+        for (size_t i=0;i<oldcap;++i)
+            if (old[i]) *cache_slot(old[i]->hash, old[i]->line, old[i]->len) = old[i];
+        free(old);
+    }
+
+    CacheBuf b = { NULL, arena_round(sizeof(CacheEntry)) };
+    cache_copy_node(&b, root);
+    size_t tree = b.used;
+    CacheEntry *e = malloc(tree + len + 1);
+    if (!e) { perror("malloc"); exit(1); }
+    b.base = (char *)e;
+    b.used = arena_round(sizeof(CacheEntry));
+    e->root = cache_copy_node(&b, root);
+    e->line = (char *)e + tree;
+    memcpy(e->line, line, len + 1);
+    e->hash = hash;
+    e->len = len;
+    e->hits = 0;
+    e->prev = e->next = NULL;
+    *cache_slot(hash, line, len) = e;
+    cache_len++;
+    cache_push(e);
+    return e;
+}
+
+/* The line run from cache_running is done. */
+static void cache_release(void) {
+    if (cache_running_dropped) free(cache_running);
+    cache_running = NULL;
+    cache_running_dropped = 0;
+}
+
+/* find builtin: `find PATTERN [DIR...]` prints every path under DIR (default
+ * ".") whose last component matches the shell PATTERN, like
+ * `find DIR -name PATTERN`.
+ *
+ * The walk happens in this process (no sh, no /usr/bin/find): directories
+ * are read with getdents64 and matched with fnmatch. Each worker thread
+ * owns a deque of directories still to read; it pops its own newest entry
+ * (depth first, good locality) and, when empty, steals the oldest entry of
+ * another worker (a whole subtree); with nothing to take it sleeps on a
+ * condition variable until a directory is queued or the walk is over.
+ * Output is buffered per worker and
+ * written in whole lines. It runs in a forked child like an external
+ * command (see launch_command), so it has job control and redirections and
+ * can be a pipeline stage.
+ */
+#define FIND_MAX_THREADS 64
+#define FIND_OUTBUF (64 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+    char **items;           /* malloc'd directory paths */
+    size_t head, tail, cap; /* steal from head, own pops from tail */
+} FindDeque;
+
+typedef struct {
+    const char *pattern;
+    int nworkers;
+    FindDeque deques[FIND_MAX_THREADS];
+    atomic_long pending;    /* directories queued or being read */
+    atomic_int failed;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;   /* a directory was queued, or pending hit 0 */
+    atomic_int nidle;       /* workers waiting on idle_cond */
+    pthread_mutex_t out_lock;
+    int out_fd, err_fd;
+} FindWalk;
+
+typedef struct {
+    FindWalk *w;
+    int id;
+    char *out;
+    size_t outlen;
+} FindWorker;
+
+static void find_write(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) _exit(1);   /* reader went away (EPIPE): stop the walk */
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void find_flush(FindWorker *fw) {
+    if (!fw->outlen) return;
+    pthread_mutex_lock(&fw->w->out_lock);
+    find_write(fw->w->out_fd, fw->out, fw->outlen);
+    pthread_mutex_unlock(&fw->w->out_lock);
+    fw->outlen = 0;
+}
+
+static void find_emit(FindWorker *fw, const char *dir, size_t dlen, const char *name, size_t nlen) {
+    size_t need = dlen + 1 + nlen + 1;
+    if (fw->outlen + need > FIND_OUTBUF) find_flush(fw);
+    if (need > FIND_OUTBUF) {   /* absurdly long path: write it directly */
+        pthread_mutex_lock(&fw->w->out_lock);
+        find_write(fw->w->out_fd, dir, dlen);
+        find_write(fw->w->out_fd, "/", 1);
+        find_write(fw->w->out_fd, name, nlen);
+        find_write(fw->w->out_fd, "\n", 1);
+        pthread_mutex_unlock(&fw->w->out_lock);
+        return;
+    }
+    char *p = fw->out + fw->outlen;
+    memcpy(p, dir, dlen); p += dlen;
+    if (nlen) { *p++ = '/'; memcpy(p, name, nlen); p += nlen; }
+    *p++ = '\n';
+    fw->outlen = (size_t)(p - fw->out);
+}
+
+static void find_error(FindWalk *w, const char *path, int err) {
+    char msg[PATH_MAX + 128];
+    int n = snprintf(msg, sizeof(msg), "find: '%s': %s\n", path, strerror(err));
+    if (n > (int)sizeof(msg) - 1) n = (int)sizeof(msg) - 1;
+    pthread_mutex_lock(&w->out_lock);
+    find_write(w->err_fd, msg, (size_t)n);
+    pthread_mutex_unlock(&w->out_lock);
+    atomic_store(&w->failed, 1);
+}
+
+static void find_push(FindWalk *w, int id, char *path) {
+    FindDeque *d = &w->deques[id];
+    atomic_fetch_add(&w->pending, 1);
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        /* slide live entries down before growing */
+        if (d->head) {
+            memmove(d->items, d->items + d->head, (d->tail - d->head) * sizeof(char *));
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        if (d->tail == d->cap) {
+            d->cap = d->cap ? d->cap * 2 : 256;
+            d->items = realloc(d->items, d->cap * sizeof(char *));
+            if (!d->items) { perror("realloc"); _exit(1); }
+        }
+    }
+    d->items[d->tail++] = path;
+    pthread_mutex_unlock(&d->lock);
+    /* a worker that has found nothing counts itself idle before it looks
+     * again under idle_lock, so this cannot miss it */
+    if (atomic_load(&w->nidle)) {
+        pthread_mutex_lock(&w->idle_lock);
+        pthread_cond_signal(&w->idle_cond);
+        pthread_mutex_unlock(&w->idle_lock);
+    }
+}
+
+static char *find_pop(FindWalk *w, int id) {
+    FindDeque *d = &w->deques[id];
+    char *path = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) path = d->items[--d->tail];
+    pthread_mutex_unlock(&d->lock);
+    return path;
+}
+
+static char *find_steal(FindWalk *w, int id) {
+    for (int k=1;k<w->nworkers;++k) {
+        FindDeque *d = &w->deques[(id + k) % w->nworkers];
+        char *path = NULL;
+        pthread_mutex_lock(&d->lock);
+        if (d->tail > d->head) path = d->items[d->head++];
+        pthread_mutex_unlock(&d->lock);
+        if (path) return path;
+    }
+    return NULL;
+}
+
+/* Sleep until there is a directory to take (returned) or the walk is over
+ * (NULL). */
+static char *find_wait(FindWalk *w, int id) {
+    char *path = NULL;
+    pthread_mutex_lock(&w->idle_lock);
+    atomic_fetch_add(&w->nidle, 1);
+    while (!(path = find_pop(w, id)) && !(path = find_steal(w, id)) && atomic_load(&w->pending) != 0)
+        pthread_cond_wait(&w->idle_cond, &w->idle_lock);
+    atomic_fetch_sub(&w->nidle, 1);
+    pthread_mutex_unlock(&w->idle_lock);
+    return path;
+}
+
+/* Read one directory: print matching entries and queue subdirectories. */
+static void find_read_dir(FindWorker *fw, const char *path) {
+    FindWalk *w = fw->w;
+    char buf[32 * 1024];
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) { find_error(w, path, errno); return; }
+
+    size_t plen = strlen(path);
+    for (;;) {
+        ssize_t n = getdents64(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { find_error(w, path, errno); break; }
+        if (n == 0) break;
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            const char *name = de->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+
+            size_t nlen = strlen(name);
+            if (fnmatch(w->pattern, name, 0) == 0) find_emit(fw, path, plen, name, nlen);
+
+            int is_dir = de->d_type == DT_DIR;
+            if (de->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (!is_dir) continue;
+            char *sub = malloc(plen + 1 + nlen + 1);
+            if (!sub) { perror("malloc"); _exit(1); }
+            memcpy(sub, path, plen);
+            sub[plen] = '/';
+            memcpy(sub + plen + 1, name, nlen + 1);
+            find_push(w, fw->id, sub);
+        }
+    }
+    close(fd);
+}
+
+static void *find_worker(void *arg) {
+    FindWorker *fw = arg;
+    FindWalk *w = fw->w;
+
+    for (;;) {
+        char *path = find_pop(w, fw->id);
+        if (!path) path = find_steal(w, fw->id);
+        if (!path) path = find_wait(w, fw->id);
+        if (!path) break;
+        find_read_dir(fw, path);
+        free(path);
+        if (atomic_fetch_sub(&w->pending, 1) == 1) {
+            /* the last directory is done: wake everyone to finish */
+            pthread_mutex_lock(&w->idle_lock);
+            pthread_cond_broadcast(&w->idle_cond);
+            pthread_mutex_unlock(&w->idle_lock);
+        }
+    }
+    find_flush(fw);
+    return NULL;
+}
+
+/* Entry point; runs in the forked child with redirections already applied. */
+static int builtin_find(char **argv) {
+    static FindWalk walk;
+    FindWalk *w = &walk;
+    if (!argv[1]) { fprintf(stderr,"find: missing filename\n"); return 1; }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nworkers = ncpu < 1 ? 1 : ncpu > FIND_MAX_THREADS ? FIND_MAX_THREADS : (size_t)ncpu;
+    w->pattern = argv[1];
+    w->nworkers = (int)nworkers;
+    w->out_fd = STDOUT_FILENO;
+    w->err_fd = STDERR_FILENO;
+    atomic_init(&w->pending, 0);
+    atomic_init(&w->failed, 0);
+    atomic_init(&w->nidle, 0);
+    pthread_mutex_init(&w->out_lock, NULL);
+    pthread_mutex_init(&w->idle_lock, NULL);
+    pthread_cond_init(&w->idle_cond, NULL);
+    for (int i=0;i<w->nworkers;++i) pthread_mutex_init(&w->deques[i].lock, NULL);
+
+    FindWorker *fw = calloc(nworkers, sizeof(FindWorker));
+    if (!fw) { perror("calloc"); return 1; }
+    for (int i=0;i<w->nworkers;++i) {
+        fw[i].w = w;
+        fw[i].id = i;
+        fw[i].out = malloc(FIND_OUTBUF);
+        if (!fw[i].out) { perror("malloc"); return 1; }
+    }
+
+    /* roots: matched by their own name, then walked */
+    char *dot[] = { ".", NULL };
+    char **roots = argv[2] ? &argv[2] : dot;
+    for (int i=0;roots[i];++i) {
+        struct stat st;
+        size_t len = strlen(roots[i]);
+        while (len > 1 && roots[i][len-1] == '/') len--;    /* "dir/" prints as "dir/x" */
+        char *root = strndup(roots[i], len);
+        if (!root) { perror("strndup"); return 1; }
+        if (lstat(root, &st) < 0) { find_error(w, root, errno); free(root); continue; }
+        const char *base = strrchr(root, '/');
+        base = base && base[1] ? base + 1 : root;
+        if (fnmatch(w->pattern, base, 0) == 0) find_emit(&fw[0], root, len, "", 0);
+        if (S_ISDIR(st.st_mode)) find_push(w, 0, root); else free(root);
+    }
+    find_flush(&fw[0]);
+
+    pthread_t tids[FIND_MAX_THREADS];
+    int started = 1;
+    for (int i=1;i<w->nworkers;++i) {
+        if (pthread_create(&tids[i], NULL, find_worker, &fw[i]) != 0) break;
+        started++;
+    }
+    find_worker(&fw[0]);
+    for (int i=1;i<started;++i) pthread_join(tids[i], NULL);
+    return atomic_load(&w->failed) ? 1 : 0;
+}
+
+/* parallel builtin: `parallel [-j N] [-k] [-a FILE] CMD [ARG...] [::: ITEM...]`
+ * runs CMD once per input item, at most N at a time (default: online CPUs).
+ * Items are the words after ":::", else the lines of FILE, else the lines
+ * of stdin. Every "{}" in CMD and its arguments is replaced by the item;
+ * without one the item is appended as the last argument.
+ *
+ * The builtin is a forked supervisor (BI_FORK), so the whole fan-out is one
+ * job: the tasks stay in its process group and follow Ctrl-Z, fg and bg
+ * with it. The supervisor runs its own epoll loop over a SIGCHLD signalfd
+ * and the tasks' output pipes; a slot is refilled as soon as a task is
+ * reaped. Each task's stdout and stderr are buffered and written as one
+ * group when it finishes, or, with -k, in input order.
+ */
+typedef struct {
+    pid_t pid;
+    int fds[2];             /* read ends of the task's stdout/stderr pipes, -1 at EOF */
+    char *buf[2];
+    size_t len[2], cap[2];
+    int status;
+    int exited;
+} ParTask;
+
+typedef struct {
+    char **tmpl;            /* CMD [ARG...] */
+    int has_slot;           /* some word contains "{}" */
+    char **items;           /* ::: words, or NULL to read from in */
+    FILE *in;
+    int epfd;
+    ParTask *tasks;
+    size_t ntasks, cap;
+    size_t flushed;         /* -k: tasks before this index have been written */
+    size_t unwritten;       /* started, output not yet written */
+    int keep_order;
+    int failed;
+} ParRun;
+
+#define PAR_SIGCHLD UINT64_MAX
+
+static char *par_next_item(ParRun *p) {
+    if (p->items) return *p->items ? strdup(*p->items++) : NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&line, &cap, p->in);
+    if (n < 0) { free(line); return NULL; }
+    if (n > 0 && line[n-1] == '\n') line[n-1] = '\0';
+    return line;
+}
+
+/* Substitute item into one template word; returns the word itself when it
+ * has no "{}". */
+static char *par_subst(char *word, const char *item) {
+    if (!strstr(word, "{}")) return word;
+    size_t ilen = strlen(item), len = 0;
+    for (const char *s = word; (s = strstr(s, "{}")); s += 2) len += ilen;
+    len += strlen(word);
+    char *out = malloc(len + 1), *d = out;
+    if (!out) return word;
+    for (const char *s = word; *s; ) {
+        if (s[0] == '{' && s[1] == '}') { memcpy(d, item, ilen); d += ilen; s += 2; }
+        else *d++ = *s++;
+    }
+    *d = '\0';
+    return out;
+}
+
+static int par_start(ParRun *p, const char *item) {
+    size_t n = 0;
+    while (p->tmpl[n]) n++;
+    char **argv = malloc((n + 2) * sizeof(char *));
+    if (!argv) { perror("malloc"); return -1; }
+    for (size_t i=0;i<n;++i) argv[i] = par_subst(p->tmpl[i], item);
+    if (!p->has_slot) argv[n++] = (char *)item;
+    argv[n] = NULL;
+
+    if (p->ntasks == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        ParTask *t = realloc(p->tasks, cap * sizeof(ParTask));
+        if (!t) { perror("realloc"); free(argv); return -1; }
+        p->tasks = t;
+        p->cap = cap;
+    }
+    size_t id = p->ntasks;
+    ParTask *t = &p->tasks[id];
+    memset(t, 0, sizeof(*t));
+    t->fds[0] = t->fds[1] = -1;
+
+    int cached, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+    const char *path = resolve_command(argv[0], &cached);
+    if (!path) {
+        fprintf(stderr,"%s: command not found\n", argv[0]);
+        t->status = 127 << 8;
+        t->exited = 1;
+    } else if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        t->status = 1 << 8;
+        t->exited = 1;
+    } else {
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        sigset_t none;
+        sigemptyset(&none);
+        posix_spawn_file_actions_init(&fa);
+        posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &none);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        int rc = posix_spawn(&t->pid, path, &fa, &attr, argv, environ);
+        posix_spawn_file_actions_destroy(&fa);
+        posix_spawnattr_destroy(&attr);
+        if (rc != 0) {
+            fprintf(stderr,"%s: %s\n", argv[0], strerror(rc));
+            t->pid = 0;
+            t->status = 127 << 8;
+            t->exited = 1;
+        }
+    }
+    for (int k=0;k<2;++k) {
+        int fd = k ? err[0] : out[0];
+        if (fd < 0) continue;
+        if (t->pid > 0) {
+            struct epoll_event ev = { .events = EPOLLIN, .data.u64 = id << 1 | (uint64_t)k };
+            t->fds[k] = fd;
+            if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) continue;
+            t->fds[k] = -1;
+        }
+        close(fd);
+    }
+    if (out[1] >= 0) close(out[1]);
+    if (err[1] >= 0) close(err[1]);
+
+    for (size_t i=0;p->tmpl[i];++i)
+        if (argv[i] != p->tmpl[i]) free(argv[i]);
+    free(argv);
+    p->ntasks++;
+    p->unwritten++;
+    return t->pid > 0;
+}
+
+static int par_task_done(const ParTask *t) {
+    return t->exited && t->fds[0] < 0 && t->fds[1] < 0;
+}
+
+static void par_write_task(ParRun *p, ParTask *t) {
+    for (int k=0;k<2;++k) {
+        if (t->len[k]) find_write(k ? STDERR_FILENO : STDOUT_FILENO, t->buf[k], t->len[k]);
+        free(t->buf[k]);
+        t->buf[k] = NULL;
+    }
+    p->unwritten--;
+    if (!WIFEXITED(t->status) || WEXITSTATUS(t->status) != 0) p->failed = 1;
+}
+
+/* Write finished tasks: each one as soon as it is complete, or with -k the
+ * longest completed prefix. */
+static void par_flush(ParRun *p, size_t id) {
+    if (!p->keep_order) {
+        if (par_task_done(&p->tasks[id])) par_write_task(p, &p->tasks[id]);
+        return;
+    }
+    while (p->flushed < p->ntasks && par_task_done(&p->tasks[p->flushed]))
+        par_write_task(p, &p->tasks[p->flushed++]);
+}
+
+static void par_read(ParRun *p, size_t id, int k) {
+    ParTask *t = &p->tasks[id];
+    for (;;) {
+        if (t->cap[k] - t->len[k] < 4096) {
+            size_t cap = t->cap[k] ? t->cap[k] * 2 : 16384;
+            char *b = realloc(t->buf[k], cap);
+            if (!b) { perror("realloc"); _exit(1); }
+            t->buf[k] = b;
+            t->cap[k] = cap;
+        }
+        ssize_t n = read(t->fds[k], t->buf[k] + t->len[k], t->cap[k] - t->len[k]);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) { t->len[k] += (size_t)n; return; }
+        close(t->fds[k]);   /* EOF (or error): epoll drops the fd on close */
+        t->fds[k] = -1;
+        par_flush(p, id);
+        return;
+    }
+}
+
+/* Reap exited tasks; returns how many slots were freed. */
+static int par_reap(ParRun *p) {
+    int freed = 0, status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i=p->ntasks;i-- > 0;) {
+            ParTask *t = &p->tasks[i];
+            if (t->pid != pid || t->exited) continue;
+            t->status = status;
+            t->exited = 1;
+            freed++;
+            par_flush(p, i);
+            break;
+        }
+    }
+    return freed;
+}
+
+static int builtin_parallel(char **argv) {
+    ParRun run = { 0 };
+    ParRun *p = &run;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *file = NULL;
+    int i = 1;
+
+    for (; argv[i] && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        if (strcmp(argv[i], "-k") == 0) p->keep_order = 1;
+        else if (strcmp(argv[i], "-j") == 0 && argv[i+1]) {
+            char *end;
+            max_jobs = strtol(argv[++i], &end, 10);
+            if (*end || max_jobs < 1) { fprintf(stderr,"parallel: bad job count '%s'\n", argv[i]); return 2; }
+        } else if (strcmp(argv[i], "-a") == 0 && argv[i+1]) file = argv[++i];
+        else {
+            fprintf(stderr,"parallel: usage: parallel [-j N] [-k] [-a FILE] CMD [ARG...] [::: ITEM...]\n");
+            return 2;
+        }
+    }
+    if (max_jobs < 1) max_jobs = 1;
+    p->tmpl = &argv[i];
+    for (; argv[i]; ++i) {
+        if (strcmp(argv[i], ":::") == 0) { argv[i] = NULL; p->items = &argv[i+1]; break; }
+        if (strstr(argv[i], "{}")) p->has_slot = 1;
+    }
+    if (!p->tmpl[0]) { fprintf(stderr,"parallel: missing command\n"); return 2; }
+    if (!p->items) {
+        p->in = file ? fopen(file, "re") : stdin;
+        if (!p->in) { fprintf(stderr,"parallel: %s: %s\n", file, strerror(errno)); return 1; }
+    }
+
+    /* SIGCHLD through a signalfd, next to the output pipes */
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    int sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = PAR_SIGCHLD };
+    if (p->epfd < 0 || sfd < 0 || epoll_ctl(p->epfd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        perror("parallel");
+        return 1;
+    }
+
+    long running = 0;
+    int more = 1;
+    for (;;) {
+        while (more && running < max_jobs) {
+            char *item = par_next_item(p);
+            if (!item) { more = 0; break; }
+            int r = par_start(p, item);
+            free(item);
+            if (r > 0) running++;
+            else par_flush(p, p->ntasks - 1);
+            if (r < 0) { more = 0; p->failed = 1; }
+        }
+
+        if (!more && !p->unwritten) break;
+
+        struct epoll_event evs[64];
+        int n = epoll_wait(p->epfd, evs, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int e=0;e<n;++e) {
+            if (evs[e].data.u64 == PAR_SIGCHLD) {
+                struct signalfd_siginfo si[16];
+                while (read(sfd, si, sizeof(si)) > 0) { }
+                running -= par_reap(p);
+            } else {
+                par_read(p, (size_t)(evs[e].data.u64 >> 1), (int)(evs[e].data.u64 & 1));
+            }
+        }
+    }
+    return p->failed ? 1 : 0;
+}
+
+/* Command history.
+ *
+ * Interactive lines are appended to $TSH_HISTFILE (default ~/.tsh_history;
+ * empty turns history off), one per line, and the byte offset of each entry
+ * to the sidecar FILE.idx as a uint64_t. Both files are append-only and are
+ * only written under flock(LOCK_EX) on the data file, so concurrent shells
+ * interleave whole entries. Each shell maps both files read-only: opening
+ * the history costs the same however long it is, entry n is off[n-1], and
+ * entries other shells add appear once the files are seen to have grown
+ * (hist_sync). An index that does not end exactly at the data's last line
+ * (missing, or the data file was edited) is rebuilt with one scan.
+ *
+ * Searches use a trigram index built in memory on the first search and
+ * then extended entry by entry: each distinct trigram of an entry maps to
+ * an ascending posting list of entry numbers. A query of three or more
+ * bytes walks the shortest posting list among its trigrams newest-first
+ * and confirms candidates with memmem; shorter queries scan. Trigrams in
+ * more than 1/8 of all entries ("git", " --") would not narrow a search,
+ * so their lists are dropped, which keeps the index to a fraction of the
+ * file's size; a query made only of those scans too.
+ */
+#define HIST_COMMON_MIN 4096    /* shortest list that may be declared common */
+
+typedef struct {
+    uint32_t *ids;
+    uint32_t n, cap;
+    int common;                 /* list dropped: too frequent to be useful */
+} HistPosting;
+
+static int hist_fd = -1, hist_idx_fd = -1;     /* -1: history is off */
+static const char *hist_data;   /* mapped data file */
+static size_t hist_data_len;
+static const uint64_t *hist_off;    /* mapped index: entry i (0-based) starts at hist_off[i] */
+static size_t hist_count;
+static IntMap hist_tri;         /* trigram + 1 -> index into hist_postings */
+static HistPosting *hist_postings;
+static size_t hist_npostings, hist_postings_cap;
+static size_t hist_indexed;     /* entries covered by the trigram index */
+static int hist_tri_on;
+static int state_hist_known;    /* hist_count and hist_data_len in a restored snapshot */
+static size_t state_hist_count, state_hist_len;
+
+/* Entry i (0-based) without its newline. */
+static const char *hist_entry(size_t i, size_t *len) {
+    const char *s = hist_data + hist_off[i];
+    const char *nl = memchr(s, '\n', hist_data_len - hist_off[i]);
+    *len = nl ? (size_t)(nl - s) : hist_data_len - hist_off[i];
+    return s;
+}
+
+static void *hist_remap(void *old, size_t oldlen, int fd, size_t len) {
+    if (old) munmap(old, oldlen);
+    if (!len) return NULL;
+    void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Map both files at their current sizes. The index is read first: its
+ * entries were written after their data, so the data map covers them. */
+static void hist_map(void) {
+    struct stat si, sd;
+    if (fstat(hist_idx_fd, &si) < 0 || fstat(hist_fd, &sd) < 0) return;
+    size_t count = (size_t)si.st_size / sizeof(uint64_t);
+    if (count != hist_count) {
+        hist_off = hist_remap((void *)hist_off, hist_count * sizeof(uint64_t), hist_idx_fd, count * sizeof(uint64_t));
+        hist_count = hist_off ? count : 0;
+    }
+    if ((size_t)sd.st_size != hist_data_len) {
+        hist_data = hist_remap((void *)hist_data, hist_data_len, hist_fd, (size_t)sd.st_size);
+        hist_data_len = hist_data ? (size_t)sd.st_size : 0;
+    }
+    /* an index entry past the data would mean a damaged file */
+    while (hist_count && hist_off[hist_count-1] >= hist_data_len) hist_count--;
+}
+
+/* Does the index end exactly at the data's last line? */
+static int hist_index_ok(void) {
+    struct stat si;
+    if (fstat(hist_idx_fd, &si) < 0 || si.st_size % sizeof(uint64_t)) return 0;
+    if (!hist_count) return hist_data_len == 0;
+    uint64_t last = hist_off[hist_count-1];
+    if (hist_data[hist_data_len-1] != '\n' || (last && hist_data[last-1] != '\n')) return 0;
+    return memchr(hist_data + last, '\n', hist_data_len - last) == hist_data + hist_data_len - 1;
+}
+
+/* A write to the history file or its index failed (disk full, I/O error):
+ * say so and stop keeping history for this shell. What is mapped stays
+ * readable; the next shell to open the files repairs the index. */
+static void hist_write_failed(void) {
+    fprintf(stderr,"tsh: history disabled: write failed: %s\n", strerror(errno));
+    close(hist_idx_fd);
+    close(hist_fd);     /* drops our lock too */
+    hist_fd = hist_idx_fd = -1;
+}
+
+static void hist_rebuild_index(void) {
+    size_t cap = 4096, n = 0;
+    uint64_t *off = malloc(cap * sizeof(*off));
+    if (!off) return;
+    for (size_t pos = 0; pos < hist_data_len; ) {
+        const char *nl = memchr(hist_data + pos, '\n', hist_data_len - pos);
+        if (n == cap) {
+            uint64_t *o = realloc(off, (cap *= 2) * sizeof(*off));
+            if (!o) { free(off); return; }
+            off = o;
+        }
+        off[n++] = pos;
+        pos = nl ? (size_t)(nl - hist_data) + 1 : hist_data_len;
+    }
+    struct iovec iov = { off, n * sizeof(*off) };
+    int r = ftruncate(hist_idx_fd, 0) < 0 ? -1 : write_iov(hist_idx_fd, &iov, 1);
+    free(off);
+    if (r < 0) { hist_write_failed(); return; }
+    hist_map();
+}
+
+static void hist_open(void) {
+    char path[PATH_MAX], idx[PATH_MAX + 8];
+    const char *file = getenv("TSH_HISTFILE");
+    if (file && !*file) return;
+    if (!file) {
+        const char *home = getenv("HOME");
+        if (!home) return;
+        snprintf(path, sizeof(path), "%s/.tsh_history", home);
+        file = path;
+    }
+    snprintf(idx, sizeof(idx), "%s.idx", file);
+    hist_fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    hist_idx_fd = hist_fd < 0 ? -1 : open(idx, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (hist_idx_fd < 0) {
+        fprintf(stderr,"tsh: history disabled: %s: %s\n", hist_fd < 0 ? file : idx, strerror(errno));
+        if (hist_fd >= 0) close(hist_fd);
+        hist_fd = -1;
+        return;
+    }
+    flock(hist_fd, LOCK_EX);
+    hist_map();
+    /* unchanged since the snapshot was taken: its index was good then */
+    int known = state_hist_known && hist_count == state_hist_count && hist_data_len == state_hist_len;
+    if (!known && !hist_index_ok()) hist_rebuild_index();
+    if (hist_fd >= 0) flock(hist_fd, LOCK_UN);
+}
+
+static void hist_tri_add(size_t i) {
+    size_t len;
+    const unsigned char *s = (const unsigned char *)hist_entry(i, &len);
+    for (size_t k = 0; k + 3 <= len; ++k) {
+        int32_t key = (int32_t)(s[k] << 16 | s[k+1] << 8 | s[k+2]) + 1;
+        int64_t slot = intmap_get(&hist_tri, key);
+        if (slot < 0) {
+            if (hist_npostings == hist_postings_cap) {
+                hist_postings_cap = hist_postings_cap ? hist_postings_cap * 2 : 4096;
+                hist_postings = realloc(hist_postings, hist_postings_cap * sizeof(*hist_postings));
+                if (!hist_postings) { perror("realloc"); exit(1); }
+            }
+            slot = (int64_t)hist_npostings++;
+            memset(&hist_postings[slot], 0, sizeof(HistPosting));
+            intmap_put(&hist_tri, key, slot);
+        }
+        HistPosting *p = &hist_postings[slot];
+        if (p->common || (p->n && p->ids[p->n-1] == i)) continue;     /* repeated in this entry */
+        if (p->n >= HIST_COMMON_MIN && p->n > i / 8) {
+            free(p->ids);
+            p->ids = NULL;
+            p->n = p->cap = 0;
+            p->common = 1;
+            continue;
+        }
+        if (p->n == p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 4;
+            p->ids = realloc(p->ids, p->cap * sizeof(uint32_t));
+            if (!p->ids) { perror("realloc"); exit(1); }
+        }
+        p->ids[p->n++] = (uint32_t)i;
+    }
+}
+
+/* Pick up entries added since the last look, by us or by other shells. */
+static void hist_sync(void) {
+    if (hist_fd < 0) return;
+    hist_map();
+    if (hist_tri_on) while (hist_indexed < hist_count) hist_tri_add(hist_indexed++);
+}
+
+static void hist_add(const char *line) {
+    if (hist_fd < 0) return;
+    struct stat st;
+    size_t len = strlen(line);
+    flock(hist_fd, LOCK_EX);
+    if (fstat(hist_fd, &st) == 0) {
+        uint64_t off = (uint64_t)st.st_size;
+        struct iovec iov[3] = { { (void *)line, len }, { "\n", 1 }, { &off, sizeof(off) } };
+        if (write_iov(hist_fd, iov, 2) < 0 || write_iov(hist_idx_fd, iov + 2, 1) < 0) {
+            hist_write_failed();
+            return;
+        }
+    }
+    flock(hist_fd, LOCK_UN);
+}
+
+/* Newest entry before `before` (0-based, exclusive) that contains q, or
+ * starts with it when prefix is set; -1 when there is none. Sees the
+ * entries known at the last hist_sync. */
+static int hist_match(size_t i, const char *q, size_t qlen, int prefix) {
+    size_t len;
+    const char *s = hist_entry(i, &len);
+    return prefix ? len >= qlen && memcmp(s, q, qlen) == 0 : memmem(s, len, q, qlen) != NULL;
+}
+
+static ssize_t hist_find(const char *q, size_t qlen, int prefix, size_t before) {
+    const HistPosting *best = NULL;
+    if (before > hist_count) before = hist_count;
+    if (qlen >= 3) {
+        hist_tri_on = 1;
+        while (hist_indexed < hist_count) hist_tri_add(hist_indexed++);
+        const unsigned char *u = (const unsigned char *)q;
+        for (size_t k = 0; k + 3 <= qlen; ++k) {
+            int64_t slot = intmap_get(&hist_tri, (int32_t)(u[k] << 16 | u[k+1] << 8 | u[k+2]) + 1);
+            if (slot < 0) return -1;
+            if (hist_postings[slot].common) continue;
+            if (!best || hist_postings[slot].n < best->n) best = &hist_postings[slot];
+        }
+    }
+    if (!best) {
+        for (size_t i = before; i-- > 0; ) if (hist_match(i, q, qlen, prefix)) return (ssize_t)i;
+        return -1;
+    }
+
+    /* ids ascend: find the last one below `before`, then walk back */
+    size_t lo = 0, hi = best->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (best->ids[mid] < before) lo = mid + 1; else hi = mid;
+    }
+    while (lo-- > 0) if (hist_match(best->ids[lo], q, qlen, prefix)) return (ssize_t)best->ids[lo];
+    return -1;
+}
+
+/* Bash-style history expansion on a line just read at the terminal:
+ * !! (last entry), !n, !-n, !prefix and !?substring[?]. Single quotes and
+ * a backslash protect a '!'. Returns the line itself when nothing was
+ * expanded, the expanded line (in line_arena, echoed like bash does), or
+ * NULL after reporting an event that was not found.
+ */
+static char *hist_expand(char *line) {
+    char *bang = strchr(line, '!');
+    if (!bang || hist_fd < 0) return line;
+    hist_sync();
+
+    size_t cap = strlen(line) + 1, len = 0;
+    char *out = arena_alloc(&line_arena, cap);
+    int squote = 0, expanded = 0;
+    for (const char *p = line; *p; ) {
+        const char *ev = NULL;
+        size_t evlen = 0;
+        if (*p == '\'') squote = !squote;
+        if (*p == '\\' && p[1] && !squote) {
+            ev = p;
+            evlen = 2;
+        } else if (*p == '!' && !squote && p[1] && !strchr(" \t=(\"", p[1])) {
+            const char *q = p + 1, *end;
+            ssize_t i = -1;
+            if (*q == '!') {
+                i = (ssize_t)hist_count - 1;
+                end = q + 1;
+            } else if (isdigit((unsigned char)*q) || (*q == '-' && isdigit((unsigned char)q[1]))) {
+                long n = strtol(q, (char **)&end, 10);
+                i = n < 0 ? (ssize_t)hist_count + n : n - 1;
+                if (i < 0 || (size_t)i >= hist_count) i = -1;
+            } else if (*q == '?') {
+                end = q + 1 + strcspn(q + 1, "?");
+                i = hist_find(q + 1, (size_t)(end - q - 1), 0, hist_count);
+                if (*end == '?') end++;
+            } else {
+                end = q + strcspn(q, " \t;|&<>");
+                i = hist_find(q, (size_t)(end - q), 1, hist_count);
+            }
+            if (i < 0) {
+                fprintf(stderr,"tsh: %.*s: event not found\n", (int)(end - p), p);
+                return NULL;
+            }
+            ev = hist_entry((size_t)i, &evlen);
+            size_t need = len + evlen + strlen(end) + 1;
+            if (need > cap) {
+                out = arena_grow(&line_arena, out, cap, need);
+                cap = need;
+            }
+            memcpy(out + len, ev, evlen);
+            len += evlen;
+            p = end;
+            expanded = 1;
+            continue;
+        } else {
+            ev = p;
+            evlen = 1;
+        }
+        memcpy(out + len, ev, evlen);
+        len += evlen;
+        p += evlen;
+    }
+    out[len] = '\0';
+    if (!expanded) return line;
+    printf("%s\n", out);
+    return out;
+}
+
+/* Builtins. Each handler takes argv and returns an exit status; it reads
+ * and writes the shell's fds 0-2, which run_builtin points at the command's
+ * pipes and redirections for the duration of the call. */
+static int builtin_exit(char **argv) {
+    fflush(stdout);
+    state_save_on_exit();
+    exit(argv[1] ? atoi(argv[1]) & 0xff : last_status);
+}
+
+static int builtin_cd(char **argv) {
+    if (!argv[1]) { fprintf(stderr,"cd: missing operand\n"); return 1; }
+    if (chdir(argv[1]) != 0) { perror("cd"); return 1; }
+    return 0;
+}
+
+static int builtin_pwd(char **argv) {
+    char buf[4096];
+    (void)argv;
+    if (getcwd(buf,sizeof(buf))) printf("%s\n", buf);
+    else { perror("pwd"); return 1; }
+    return 0;
+}
+
+static int builtin_hash(char **argv) {
+    int status = 0;
+    cmd_hash_check_path();
+    if (argv[1] && strcmp(argv[1], "-r") == 0) { cmd_hash_clear(); return 0; }
+    if (argv[1]) {
+        for (int i=1;argv[i];++i) {
+            int cached;
+            if (!resolve_command(argv[i], &cached)) { fprintf(stderr,"hash: %s: not found\n", argv[i]); status = 1; }
+        }
+        return status;
+    }
+    if (!cmd_hash_len) { printf("hash: hash table empty\n"); return 0; }
+    printf("hits\tcommand\n");
+    for (size_t i=0;i<cmd_hash_cap;++i)
+        if (cmd_hash[i].name) printf("%4u\t%s\n", cmd_hash[i].hits, cmd_hash[i].path);
+    return 0;
+}
+
+/* The resource prefixes with no command after them act on the shell
+ * itself, and so on every job started later. */
+
+/* ulimit [-a] [-X [N]]...: show limits, or set one (soft and hard, as bash
+ * does). */
+static int builtin_ulimit(char **argv) {
+    char val[32];
+    struct rlimit rl;
+    int all = !argv[1] || (strcmp(argv[1], "-a") == 0 && !argv[2]);
+    for (int i=0;all && i<NULIMITS;++i) {
+        getrlimit(ulimits[i].res, &rl);
+        ulimit_format(i, rl.rlim_cur, val, sizeof(val));
+        printf("%-28s (-%c) %s\n", ulimits[i].name, ulimits[i].opt, val);
+    }
+    for (int i=1;!all && argv[i];++i) {
+        int opt = ulimit_find(argv[i]);
+        if (opt < 0) { fprintf(stderr,"ulimit: %s: invalid option\nulimit: usage: ulimit [-a] [-cdflnstuv [N]]...\n", argv[i]); return 2; }
+        if (!argv[i+1] || ulimit_find(argv[i+1]) >= 0) {
+            getrlimit(ulimits[opt].res, &rl);
+            ulimit_format(opt, rl.rlim_cur, val, sizeof(val));
+            printf("%s\n", val);
+            continue;
+        }
+        if (ulimit_parse(opt, argv[++i], &rl.rlim_cur) < 0) { fprintf(stderr,"ulimit: %s: invalid number\n", argv[i]); return 1; }
+        rl.rlim_max = rl.rlim_cur;
+        if (setrlimit(ulimits[opt].res, &rl) < 0) { fprintf(stderr,"ulimit: -%c: %s\n", ulimits[opt].opt, strerror(errno)); return 1; }
+    }
+    return 0;
+}
+
+/* nice [-n N]: show the shell's niceness, or add N to it. */
+static int builtin_nice(char **argv) {
+    int inc;
+    errno = 0;
+    int cur = getpriority(PRIO_PROCESS, 0);
+    if (cur == -1 && errno) { perror("nice"); return 1; }
+    if (!argv[1]) { printf("%d\n", cur); return 0; }
+    if (strcmp(argv[1], "-n") != 0 || !argv[2] || argv[3] || nice_parse(argv[2], &inc) < 0) {
+        fprintf(stderr,"nice: usage: nice [-n N] [command]\n");
+        return 2;
+    }
+    if (setpriority(PRIO_PROCESS, 0, cur + inc) < 0) { perror("nice"); return 1; }
+    return 0;
+}
+
+/* affinity [CPUS]: show the CPUs the shell may run on, or set them. */
+static int builtin_affinity(char **argv) {
+    cpu_set_t set;
+    char buf[1024];
+    if (!argv[1]) {
+        if (sched_getaffinity(0, sizeof(set), &set) < 0) { perror("affinity"); return 1; }
+        cpus_format(&set, buf, sizeof(buf));
+        printf("%s\n", buf);
+        return 0;
+    }
+    if (argv[2] || cpus_parse(argv[1], &set) < 0) {
+        fprintf(stderr,"affinity: usage: affinity [CPUS] [command]   (CPUS like 0-3,8)\n");
+        return 2;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) { perror("affinity"); return 1; }
+    return 0;
+}
+
+/* cgroup: show where job cgroups are made; settings need a command. */
+static int builtin_cgroup(char **argv) {
+    char root[PATH_MAX];
+    if (argv[1]) {
+        fprintf(stderr,"cgroup: usage: cgroup [KEY=VALUE...] command\n");
+        return 2;
+    }
+    if (cgroup_root(root, sizeof(root)) < 0) { fprintf(stderr,"cgroup: no cgroup v2 hierarchy\n"); return 1; }
+    printf("%s\n", root);
+    return 0;
+}
+
+/* cache [-c] [-l] [-s N]: parse cache counters; -c empties it and zeroes
+ * them, -l lists the lines by recency, -s sets the capacity (0: off). */
+static int builtin_cache(char **argv) {
+    int list = 0;
+    for (int i=1;argv[i];++i) {
+        if (strcmp(argv[i], "-c") == 0) {
+            cache_trim(0);
+            cache_hits = cache_misses = cache_evictions = 0;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            list = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && argv[i+1]) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end || n < 0) { fprintf(stderr,"cache: %s: invalid size\n", argv[i]); return 1; }
+            cache_max = (size_t)n;
+            cache_trim(cache_max);
+        } else {
+            fprintf(stderr,"cache: usage: cache [-c] [-l] [-s N]\n");
+            return 2;
+        }
+    }
+    printf("%zu/%zu entries, %lu hits, %lu misses, %lu evictions\n",
+           cache_len, cache_max, cache_hits, cache_misses, cache_evictions);
+    if (list)
+        for (const CacheEntry *e = cache_head; e; e = e->next) printf("%6lu\t%s\n", e->hits, e->line);
+    return 0;
+}
+
+static int builtin_jobs(char **argv) {
+    int members = 0, verbose = 0;
+    for (int i=1;argv[i];++i) {
+        if (argv[i][0] != '-' || !argv[i][1]) { fprintf(stderr,"jobs: usage: jobs [-l|-v]\n"); return 2; }
+        for (const char *f = argv[i] + 1; *f; ++f) {
+            if (*f == 'l') members = 1;
+            else if (*f == 'v') members = verbose = 1;
+            else { fprintf(stderr,"jobs: -%c: invalid option\njobs: usage: jobs [-l|-v]\n", *f); return 2; }
+        }
+    }
+    Job **list = malloc((size_t)(njobs ? njobs : 1) * sizeof(Job *));
+    int n = 0;
+    if (!list) { perror("malloc"); return 1; }
+    for (int i=0;i<jobs_cap;++i) if (jobs[i].jid) list[n++] = &jobs[i];
+    qsort(list, (size_t)n, sizeof(Job *), job_cmp_jid);
+    for (int i=0;i<n;++i) {
+        print_job_status(list[i]);
+        if (members) print_job_members(list[i], verbose);
+    }
+    free(list);
+    return 0;
+}
+
+/* Look up the %N job spec of fg/bg, reporting errors under that name. */
+static Job *builtin_job_arg(char **argv) {
+    if (!argv[1]) { fprintf(stderr,"%s: missing job spec\n", argv[0]); return NULL; }
+    char *s = argv[1];
+    if (s[0] != '%') { fprintf(stderr,"%s: job spec should be %%N\n", argv[0]); return NULL; }
+    int jid = atoi(s+1);
+    Job *j = job_by_jid(jid);
+    if (!j) fprintf(stderr,"%s: no such job %d\n", argv[0], jid);
+    return j;
+}
+
+/* fg and bg forked into a pipeline would act on a copy of the job table,
+ * for processes that are not their children. */
+static int builtin_no_job_control(const char *name) {
+    fprintf(stderr,"%s: no job control in a pipeline\n", name);
+    return 1;
+}
+
+/* Send sig to every process of j: its process group, or each live member
+ * without job control (members of a script's jobs stay in the shell's
+ * group). A stopped job is continued so that it sees the signal. */
+static void job_kill(Job *j, int sig) {
+    int stopped = j->status == JOB_STOPPED;
+    if (shell_interactive) {
+        if (kill(-j->pgid, sig) < 0) perror("kill");
+        if (stopped) kill(-j->pgid, SIGCONT);
+        return;
+    }
+    for (int i=0;i<j->nprocs;++i) {
+        const Proc *p = &j->procs[i];
+        if (p->pid <= 0 || p->status == JOB_DONE) continue;
+        kill(p->pid, sig);
+        if (stopped) kill(p->pid, SIGCONT);
+    }
+}
+
+static int builtin_bg(char **argv) {
+    if (getpid() != shell_pid) return builtin_no_job_control(argv[0]);
+    Job *j = builtin_job_arg(argv);
+    if (!j) return 1;
+    job_kill(j, SIGCONT);
+    j->status = JOB_RUNNING;
+    j->is_background = 1;
+    printf("[%d]+ %s &\n", j->jid, job_cmdline(j));
+    return 0;
+}
+
+static int builtin_fg(char **argv) {
+    if (getpid() != shell_pid) return builtin_no_job_control(argv[0]);
+    Job *j = builtin_job_arg(argv);
+    if (!j) return 1;
+
+    /* bring to foreground: terminal first, so it cannot hit SIGTTIN on resume */
+    j->status = JOB_RUNNING;
+    j->is_background = 0;
+    if (shell_interactive && tcsetpgrp(STDIN_FILENO, j->pgid) < 0) perror("tcsetpgrp fg");
+    job_kill(j, SIGCONT);
+
+    return wait_for_job(j);
+}
+
+/* wait [-n] [-t SECS [-k]] [%N|PID...]: block until the given jobs (all
+ * running background jobs by default) finish, and return the status of
+ * the last one named (0 without operands). -n returns at the first to
+ * finish, with its status. -t gives up after SECS with status 124, and -k
+ * then sends SIGTERM to the jobs still running. A stopped job counts as
+ * finished, 128 + SIGTSTP. Jobs that finished earlier are remembered
+ * (done_record) until a wait reports them. The shell sleeps in the event
+ * loop throughout: children through the signalfd, adopted members through
+ * their pidfds. Ctrl-C gives up with 130. */
+typedef struct {
+    int jid;                    /* %N, or 0 for a pid */
+    pid_t pid;
+    int status;                 /* WAIT_PENDING until known */
+} WaitTarget;
+
+#define WAIT_PENDING (-1)
+#define WAIT_UNKNOWN (-2)
+
+static int wait_interrupted;
+
+static void ev_wait_intr_fn(EvSource *src, uint32_t events) {
+    struct signalfd_siginfo si;
+    (void)events;
+    while (read(src->fd, &si, sizeof(si)) > 0) wait_interrupted = 1;
+}
+
+static int wait_target(const WaitTarget *t) {
+    Proc *p = NULL;
+    Job *j = t->jid ? job_by_jid(t->jid) : job_by_pid(t->pid, &p);
+    if (!j) {
+        int status = done_take(t->jid, t->pid);
+        return status < 0 ? WAIT_UNKNOWN : status;
+    }
+    if (p && p->status == JOB_DONE) return wait_status_code(p->wstatus);
+    if (j->status == JOB_DONE) return job_exit_status(j);
+    if (j->status == JOB_STOPPED) return 128 + SIGTSTP;
+    return WAIT_PENDING;
+}
+
+static int builtin_wait(char **argv) {
+    int any = 0, kill_late = 0, i = 1;
+    double secs = -1;
+    for (; argv[i] && argv[i][0] == '-'; ++i) {
+        char *end;
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        if (strcmp(argv[i], "-n") == 0) any = 1;
+        else if (strcmp(argv[i], "-k") == 0) kill_late = 1;
+        else if (strcmp(argv[i], "-t") == 0 && argv[i+1] && (secs = strtod(argv[i+1], &end)) >= 0 && !*end && end != argv[i+1]) i++;
+        else { fprintf(stderr,"wait: usage: wait [-n] [-t SECS [-k]] [%%N|PID...]\n"); return 2; }
+    }
+    /* a builtin forked into a pipeline: the jobs are the shell's, not ours */
+    if (getpid() != shell_pid) return argv[i] ? 127 : 0;
+
+    int operands = argv[i] != NULL;
+    int n = 0, cap = operands ? 0 : njobs;
+    for (int k=i;argv[k];++k) cap++;
+    WaitTarget *t = malloc((size_t)(cap ? cap : 1) * sizeof(*t));
+    if (!t) { perror("malloc"); return 1; }
+    int status = 0, done = -1;
+
+    if (!operands) {
+        int jid = any ? done_oldest() : 0;
+        if (jid) { free(t); return done_take(jid, 0); }
+        for (int k=0;k<jobs_cap;++k)
+            if (jobs[k].jid && jobs[k].status == JOB_RUNNING) t[n++] = (WaitTarget){ jobs[k].jid, 0, WAIT_PENDING };
+        if (any && !n) { free(t); return 127; }
+    }
+    for (; argv[i]; ++i) {
+        char *end;
+        WaitTarget w = { 0, 0, WAIT_PENDING };
+        if (argv[i][0] == '%') w.jid = (int)strtol(argv[i] + 1, &end, 10);
+        else w.pid = (pid_t)strtol(argv[i], &end, 10);
+        if (*end || end == argv[i] + (argv[i][0] == '%') || (w.jid <= 0 && w.pid <= 0)) {
+            fprintf(stderr,"wait: %s: not a pid or valid job spec\n", argv[i]);
+            w.status = 127;
+        } else if ((w.status = wait_target(&w)) == WAIT_UNKNOWN) {
+            if (w.jid) fprintf(stderr,"wait: %%%d: no such job\n", w.jid);
+            else fprintf(stderr,"wait: pid %d is not a child of this shell\n", (int)w.pid);
+            w.status = 127;
+        } else if (w.status >= 0 && done < 0) {
+            done = n;
+        }
+        t[n++] = w;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs - (double)(time_t)secs) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+
+    /* the shell ignores SIGINT; blocked, it queues for a signalfd instead */
+    EvSource intr = { -1, ev_wait_intr_fn, NULL };
+    sigset_t ints;
+    sigemptyset(&ints);
+    sigaddset(&ints, SIGINT);
+    if (shell_interactive) {
+        sigprocmask(SIG_BLOCK, &ints, NULL);
+        intr.fd = signalfd(-1, &ints, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (intr.fd >= 0 && ev_add(&intr, EPOLLIN) < 0) { close(intr.fd); intr.fd = -1; }
+    }
+    wait_interrupted = 0;
+
+    TRACE_BEGIN(tr);
+    for (;;) {
+        int pending = 0;
+        for (int k=0;k<n;++k) {
+            if (t[k].status != WAIT_PENDING) continue;
+            t[k].status = wait_target(&t[k]);
+            if (t[k].status == WAIT_UNKNOWN) t[k].status = 127;  /* lost: DONE_MAX newer records */
+            if (t[k].status == WAIT_PENDING) pending++;
+            else if (done < 0) done = k;
+        }
+        if (any ? done >= 0 || !pending : !pending) {
+            if (any) status = done >= 0 ? t[done].status : 127;
+            else status = operands ? t[n-1].status : 0;
+            break;
+        }
+        int timeout_ms = -1;
+        if (secs >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = ts_elapsed(now, deadline);
+            if (left <= 0) {
+                for (int k=0;kill_late && k<n;++k) {
+                    Proc *p;
+                    Job *j = t[k].status != WAIT_PENDING ? NULL : t[k].jid ? job_by_jid(t[k].jid) : job_by_pid(t[k].pid, &p);
+                    if (j) job_kill(j, SIGTERM);
+                }
+                status = 124;
+                break;
+            }
+            timeout_ms = (int)(left * 1000) + 1;
+        }
+        ev_dispatch(timeout_ms);
+        if (wait_interrupted) { printf("\n"); status = 130; break; }
+    }
+    TRACE_END(TR_WAIT, tr, 0);
+
+    if (intr.fd >= 0) {
+        epoll_ctl(ev_epfd, EPOLL_CTL_DEL, intr.fd, NULL);
+        close(intr.fd);
+    }
+    if (shell_interactive) sigprocmask(SIG_UNBLOCK, &ints, NULL);  /* a pending one is ignored */
+    /* a plain `wait` reports everything that finished */
+    if (!any && !operands) memset(done_ring, 0, sizeof(done_ring));
+    free(t);
+    return status;
+}
+
+/* history [N]: the last N entries (all by default), numbered for !n.
+ * history -s TEXT: every entry containing TEXT, through the index. */
+static int builtin_history(char **argv) {
+    size_t len, first = 0;
+    if (hist_fd < 0) return 0;
+    hist_sync();
+
+    if (argv[1] && strcmp(argv[1], "-s") == 0) {
+        if (!argv[2]) { fprintf(stderr,"history: -s: missing text\n"); return 2; }
+        size_t qlen = strlen(argv[2]), n = 0, cap = 64;
+        size_t *hits = malloc(cap * sizeof(*hits));
+        if (!hits) { perror("malloc"); return 1; }
+        for (ssize_t i = hist_find(argv[2], qlen, 0, hist_count); i >= 0; i = hist_find(argv[2], qlen, 0, (size_t)i)) {
+            if (n == cap) {
+                size_t *h = realloc(hits, (cap *= 2) * sizeof(*hits));
+                if (!h) { perror("realloc"); free(hits); return 1; }
+                hits = h;
+            }
+            hits[n++] = (size_t)i;
+        }
+        while (n-- > 0) {
+            const char *s = hist_entry(hits[n], &len);
+            printf("%5zu  %.*s\n", hits[n] + 1, (int)len, s);
+        }
+        free(hits);
+        return 0;
+    }
+    if (argv[1]) {
+        char *end;
+        long n = strtol(argv[1], &end, 10);
+        if (*end || n < 0) { fprintf(stderr,"history: %s: numeric argument required\n", argv[1]); return 2; }
+        if ((size_t)n < hist_count) first = hist_count - (size_t)n;
+    }
+    for (size_t i=first;i<hist_count;++i) {
+        const char *s = hist_entry(i, &len);
+        printf("%5zu  %.*s\n", i + 1, (int)len, s);
+    }
+    return 0;
+}
+
+static int trace_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* tsh-stats [-H|-j|-r]: per-phase summary of the trace ring (-H adds a
+ * log2 histogram), Chrome trace-event JSON (-j), or reset (-r). */
+static int builtin_tsh_stats(char **argv) {
+    const char *mode = argv[1] ? argv[1] : "";
+    uint64_t first = trace_count > TRACE_RING ? trace_count - TRACE_RING : 0;
+    size_t n = (size_t)(trace_count - first);
+
+    if (argv[1] && (argv[2] || (strcmp(mode, "-H") && strcmp(mode, "-j") && strcmp(mode, "-r")))) {
+        fprintf(stderr,"tsh-stats: usage: tsh-stats [-H|-j|-r]\n");
+        return 2;
+    }
+    if (strcmp(mode, "-r") == 0) { trace_count = 0; return 0; }
+
+    if (strcmp(mode, "-j") == 0) {
+        int self = (int)getpid();
+        printf("[");
+        for (uint64_t i=first;i<trace_count;++i) {
+            const TraceEvent *ev = &trace_ring[i & (TRACE_RING - 1)];
+            printf("%s\n{\"name\":\"%s\",\"cat\":\"tsh\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%d}}",
+                   i == first ? "" : ",", trace_names[ev->phase], ev->start_ns / 1e3, ev->dur_ns / 1e3,
+                   self, self, (int)ev->arg);
+        }
+        printf("\n]\n");
+        return 0;
+    }
+
+    if (!n) {
+        printf("tsh-stats: no events recorded%s\n", opt_trace ? "" : " (enable with set -o trace)");
+        return 0;
+    }
+    uint64_t *durs = malloc(n * sizeof(uint64_t));
+    if (!durs) { perror("malloc"); return 1; }
+    if (trace_count > TRACE_RING) printf("(last %d of %llu events)\n", TRACE_RING, (unsigned long long)trace_count);
+    printf("%-8s %8s %12s %10s %10s %10s %10s\n", "phase", "count", "total_ms", "p50_us", "p90_us", "p99_us", "max_us");
+    for (int ph=0;ph<TR_NPHASES;++ph) {
+        size_t m = 0;
+        uint64_t total = 0;
+        for (uint64_t i=first;i<trace_count;++i) {
+            const TraceEvent *ev = &trace_ring[i & (TRACE_RING - 1)];
+            if (ev->phase != ph) continue;
+            durs[m++] = ev->dur_ns;
+            total += ev->dur_ns;
+        }
+        if (!m) continue;
+        qsort(durs, m, sizeof(uint64_t), trace_cmp_u64);
+        printf("%-8s %8zu %12.3f %10.1f %10.1f %10.1f %10.1f\n", trace_names[ph], m, total / 1e6,
+               durs[m / 2] / 1e3, durs[m * 9 / 10] / 1e3, durs[m * 99 / 100] / 1e3, durs[m - 1] / 1e3);
+        if (strcmp(mode, "-H") != 0) continue;
+
+        /* log2 buckets in microseconds: [<1us] [1-2us) [2-4us) ... */
+        size_t buckets[32] = { 0 }, peak = 0;
+        int lo = 31, hi = 0;
+        for (size_t i=0;i<m;++i) {
+            uint64_t us = durs[i] / 1000;
+            int b = 0;
+            while (us && b < 31) { us >>= 1; b++; }
+            if (++buckets[b] > peak) peak = buckets[b];
+            if (b < lo) lo = b;
+            if (b > hi) hi = b;
+        }
+        for (int b=lo;b<=hi;++b) {
+            int bar = (int)((buckets[b] * 40 + peak - 1) / peak);
+            if (b == 0) printf("    %10s ", "<1us");
+            else printf("    %7lluus+ ", 1ull << (b - 1));
+            printf("%8zu %.*s\n", buckets[b], bar, "########################################");
+        }
+    }
+    free(durs);
+    return 0;
+}
+
+/* Shell options, toggled with set -o NAME / set +o NAME. */
+static const struct {
+    const char *name;
+    int *flag;
+} shell_options[] = {
+    { "fastpipes", &opt_fastpipes },
+    { "parlaunch", &opt_parlaunch },
+    { "trace",     &opt_trace },
+};
+
+static int builtin_set(char **argv) {
+    size_t nopts = sizeof(shell_options)/sizeof(shell_options[0]);
+    int status = 0;
+
+    if (!argv[1] || (!argv[2] && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0))) {
+        for (size_t k=0;k<nopts;++k)
+            printf("%-15s\t%s\n", shell_options[k].name, *shell_options[k].flag ? "on" : "off");
+        return 0;
+    }
+    for (int i=1;argv[i];i+=2) {
+        int on = strcmp(argv[i], "-o") == 0;
+        if ((!on && strcmp(argv[i], "+o") != 0) || !argv[i+1]) {
+            fprintf(stderr,"set: usage: set [-o|+o] option\n");
+            return 2;
+        }
+        size_t k = 0;
+        while (k < nopts && strcmp(shell_options[k].name, argv[i+1]) != 0) k++;
+        if (k == nopts) { fprintf(stderr,"set: %s: invalid option name\n", argv[i+1]); status = 1; continue; }
+        *shell_options[k].flag = on;
+    }
+    return status;
+}
+
+/* Session state (TSH_STATE=FILE, checkpoint, restart).
+ *
+ * A snapshot is a compact binary image of what a new shell needs to carry
+ * on where this one stopped: cwd, $?, options, the command hash, history
+ * offsets and the job table, with every member's pid and state. It goes to
+ * FILE.XXXXXX, is synced and renamed over FILE, so a reader sees the old
+ * snapshot or the new one and never part of one. With TSH_STATE set the
+ * shell writes it on exit, SIGHUP and SIGTERM; `checkpoint [FILE]` writes
+ * one at any time.
+ *
+ * A shell started with TSH_STATE restores FILE and adopts the jobs in it.
+ * Members that are gone, or whose pid now belongs to another process group
+ * (reused), count as done. The rest are no longer our children once the
+ * old shell exited, so each is watched through a pidfd, which reports its
+ * exit but no wait status. The shell is a child subreaper: a member that
+ * loses its parent is reparented to us and reaped with wait4 as usual.
+ * `restart [PATH]` re-execs the shell in place with the snapshot in a
+ * memfd: the pid stays, the jobs are still its children, nothing is lost.
+ *
+ * Layout: "TSHSTAT1", then u32/u64 fields and strings (u32 length, bytes,
+ * NUL) in the order snap_build writes them. Same host, same binary format.
+ */
+#define STATE_MAGIC "TSHSTAT1"
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    size_t pos;                 /* reading: next byte */
+    int bad;                    /* reading: ran past the end */
+} SnapBuf;
+
+static char *state_path;        /* TSH_STATE: written on exit, read at startup */
+static char *restart_path;      /* `restart` ran: exec this once the line is done */
+
+static void snap_put(SnapBuf *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+        b->buf = realloc(b->buf, b->cap);
+        if (!b->buf) { perror("realloc"); exit(1); }
+    }
+    memcpy(b->buf + b->len, p, n);
+    b->len += n;
+}
+
+static void snap_u32(SnapBuf *b, uint32_t v) { snap_put(b, &v, sizeof(v)); }
+static void snap_u64(SnapBuf *b, uint64_t v) { snap_put(b, &v, sizeof(v)); }
+
+static void snap_str(SnapBuf *b, const char *s) {
+    size_t n = s ? strlen(s) : 0;
+    snap_u32(b, (uint32_t)n);
+    snap_put(b, s ? s : "", n + 1);
+}
+
+static const void *snap_get(SnapBuf *b, size_t n) {
+    if (b->bad || b->len - b->pos < n) { b->bad = 1; return NULL; }
+    b->pos += n;
+    return b->buf + b->pos - n;
+}
+
+static uint32_t snap_get_u32(SnapBuf *b) {
+    uint32_t v = 0;
+    const void *p = snap_get(b, sizeof(v));
+    if (p) memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t snap_get_u64(SnapBuf *b) {
+    uint64_t v = 0;
+    const void *p = snap_get(b, sizeof(v));
+    if (p) memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* A string in place in the buffer; "" once the buffer is bad. */
+static const char *snap_get_str(SnapBuf *b) {
+    uint32_t n = snap_get_u32(b);
+    const char *s = snap_get(b, (size_t)n + 1);
+    if (s && s[n] != '\0') b->bad = 1;
+    return b->bad ? "" : s;
+}
+
+static void snap_timeval(SnapBuf *b, struct timeval tv) {
+    snap_u64(b, (uint64_t)tv.tv_sec);
+    snap_u64(b, (uint64_t)tv.tv_usec);
+}
+
+static struct timeval snap_get_timeval(SnapBuf *b) {
+    struct timeval tv;
+    tv.tv_sec = (time_t)snap_get_u64(b);
+    tv.tv_usec = (suseconds_t)snap_get_u64(b);
+    return tv;
+}
+
+static void snap_build(SnapBuf *b) {
+    char cwd[PATH_MAX];
+    size_t nopts = sizeof(shell_options)/sizeof(shell_options[0]);
+
+    snap_put(b, STATE_MAGIC, 8);
+    snap_u32(b, (uint32_t)shell_pid);
+    snap_str(b, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    snap_u32(b, (uint32_t)last_status);
+    snap_u32(b, (uint32_t)next_jid);
+
+    snap_u32(b, (uint32_t)nopts);
+    for (size_t k=0;k<nopts;++k) {
+        snap_str(b, shell_options[k].name);
+        snap_u32(b, (uint32_t)*shell_options[k].flag);
+    }
+
+    snap_str(b, cmd_hash_pathvar);
+    snap_u32(b, (uint32_t)cmd_hash_len);
+    for (size_t i=0;i<cmd_hash_cap;++i) {
+        if (!cmd_hash[i].name) continue;
+        snap_str(b, cmd_hash[i].name);
+        snap_str(b, cmd_hash[i].path);
+        snap_u32(b, cmd_hash[i].hits);
+    }
+
+    snap_u64(b, hist_fd < 0 ? 0 : hist_count);
+    snap_u64(b, hist_fd < 0 ? 0 : hist_data_len);
+
+    snap_u32(b, (uint32_t)njobs);
+    for (int i=0;i<jobs_cap;++i) {
+        const Job *j = &jobs[i];
+        if (!j->jid) continue;
+        snap_u32(b, (uint32_t)j->jid);
+        snap_u32(b, (uint32_t)j->pgid);
+        snap_u32(b, (uint32_t)j->is_background);
+        snap_u32(b, (uint32_t)j->timed);
+        snap_u32(b, (uint32_t)j->nstages);
+        snap_u64(b, (uint64_t)j->start.tv_sec);
+        snap_u64(b, (uint64_t)j->start.tv_nsec);
+        snap_str(b, j->cgroup);
+        snap_str(b, job_cmdline(j));
+        snap_u32(b, (uint32_t)j->nprocs);
+        for (int k=0;k<j->nprocs;++k) {
+            const Proc *p = &j->procs[k];
+            snap_u32(b, (uint32_t)p->pid);
+            /* its group now (scripts do not give jobs one): a pid reused
+             * by the time the snapshot is restored will not match it */
+            snap_u32(b, (uint32_t)(p->pid > 0 && p->status != JOB_DONE ? getpgid(p->pid) : 0));
+            snap_u32(b, (uint32_t)p->status);
+            snap_u32(b, (uint32_t)p->wstatus);
+            snap_u32(b, (uint32_t)p->foreign);
+            snap_timeval(b, p->ru.ru_utime);
+            snap_timeval(b, p->ru.ru_stime);
+            snap_u64(b, (uint64_t)p->ru.ru_maxrss);
+            snap_u64(b, (uint64_t)p->ru.ru_nvcsw);
+            snap_u64(b, (uint64_t)p->ru.ru_nivcsw);
+        }
+    }
+}
+
+/* Write a snapshot to path, atomically. */
+static int state_save(const char *path) {
+    SnapBuf b = { 0 };
+    size_t plen = strlen(path);
+    char *tmp = malloc(plen + 8);
+    if (!tmp) { perror("malloc"); return -1; }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".XXXXXX", 8);
+
+    snap_build(&b);
+    struct iovec iov = { b.buf, b.len };
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    int ok = fd >= 0 && write_iov(fd, &iov, 1) == 0 && fdatasync(fd) == 0;
+    if (ok) ok = close(fd) == 0 && rename(tmp, path) == 0;
+    else if (fd >= 0) close(fd);
+    if (!ok) {
+        fprintf(stderr,"tsh: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) unlink(tmp);
+    }
+    free(tmp);
+    free(b.buf);
+    return ok ? 0 : -1;
+}
+
+/* On exit, from the shell itself (not a forked builtin calling exit). */
+static void state_save_on_exit(void) {
+    if (state_path && getpid() == shell_pid) state_save(state_path);
+}
+
+/* An adopted member that is not our child has exited. */
+static void ev_pidfd_fn(EvSource *src, uint32_t events) {
+    pid_t pid = (pid_t)(intptr_t)src->arg;
+    Proc *p;
+    (void)events;
+    epoll_ctl(ev_epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    close(src->fd);
+    free(src);
+    reap_children();            /* reparented to us meanwhile: reaped with a status */
+    Job *j = job_by_pid(pid, &p);
+    if (!j || p->status == JOB_DONE) return;
+    job_status_t before = j->status;
+    p->status = JOB_DONE;
+    j->nlive--;
+    job_changed(j, before);
+}
+
+/* Take over live member i of a restored job from another shell, in
+ * process group pgrp when the snapshot was taken: watch it through a pidfd
+ * unless it is our child, or mark it done when it is gone. */
+static void state_adopt(Job *j, int i, pid_t pgrp) {
+    Proc *p = &j->procs[i];
+    siginfo_t si;
+    int fd = (int)syscall(SYS_pidfd_open, p->pid, 0);
+    /* the pidfd pins the process; the pid must still be in its group */
+    if (fd >= 0 && getpgid(p->pid) == pgrp) {
+        if (waitid(P_PIDFD, (id_t)fd, &si, WEXITED | WNOHANG | WNOWAIT) == 0) {
+            close(fd);          /* reparented to us already: wait4 sees it */
+            return;
+        }
+        EvSource *src = malloc(sizeof(*src));
+        if (src) {
+            src->fd = fd;
+            src->fn = ev_pidfd_fn;
+            src->arg = (void *)(intptr_t)p->pid;
+            if (ev_add(src, EPOLLIN) == 0) {
+                p->foreign = 1;
+                p->status = JOB_RUNNING;    /* stops are not visible through a pidfd */
+                return;
+            }
+            free(src);
+        }
+    }
+    if (fd >= 0) close(fd);
+    p->foreign = 1;
+    p->status = JOB_DONE;
+    j->nlive--;
+}
+
+/* Read a snapshot; with apply unset only check that it is whole. */
+static int snap_load(SnapBuf *b, int apply) {
+    b->pos = 0;
+    b->bad = 0;
+    const char *magic = snap_get(b, 8);
+    if (!magic || memcmp(magic, STATE_MAGIC, 8) != 0) return -1;
+    int ours = (pid_t)snap_get_u32(b) == getpid();  /* restart: the jobs are our children */
+    const char *cwd = snap_get_str(b);
+    int status = (int)snap_get_u32(b);
+    int jid_next = (int)snap_get_u32(b);
+    if (apply) {
+        if (*cwd && chdir(cwd) < 0) fprintf(stderr,"tsh: %s: %s\n", cwd, strerror(errno));
+        last_status = status;
+    }
+
+    size_t nopts = sizeof(shell_options)/sizeof(shell_options[0]);
+    for (uint32_t n = snap_get_u32(b); n > 0 && !b->bad; --n) {
+        const char *name = snap_get_str(b);
+        int on = (int)snap_get_u32(b);
+        for (size_t k=0;apply && k<nopts;++k)
+            if (strcmp(shell_options[k].name, name) == 0) *shell_options[k].flag = on;
+    }
+
+    /* the hash is only good under the $PATH it was filled for */
+    const char *pathvar = snap_get_str(b);
+    const char *cur = getenv("PATH");
+    int hash = apply && strcmp(pathvar, cur ? cur : "") == 0;
+    if (hash) cmd_hash_check_path();
+    for (uint32_t n = snap_get_u32(b); n > 0 && !b->bad; --n) {
+        const char *name = snap_get_str(b);
+        const char *path = snap_get_str(b);
+        unsigned hits = snap_get_u32(b);
+        if (!hash || cmd_hash_find(name)) continue;
+        char *key = strdup(name), *exe = strdup(path);
+        if (key && exe) cmd_hash_put(key, exe, hits);
+        else { perror("strdup"); free(key); free(exe); }    /* looked up again when run */
+    }
+
+    state_hist_count = (size_t)snap_get_u64(b);
+    state_hist_len = (size_t)snap_get_u64(b);
+    state_hist_known = apply;
+
+    for (uint32_t n = snap_get_u32(b); n > 0 && !b->bad; --n) {
+        int jid = (int)snap_get_u32(b);
+        pid_t pgid = (pid_t)snap_get_u32(b);
+        snap_get_u32(b);        /* is_background */
+        int timed = (int)snap_get_u32(b);
+        int nstages = (int)snap_get_u32(b);
+        struct timespec start;
+        start.tv_sec = (time_t)snap_get_u64(b);
+        start.tv_nsec = (long)snap_get_u64(b);
+        const char *cgroup = snap_get_str(b);
+        const char *cmd = snap_get_str(b);
+        uint32_t nprocs = snap_get_u32(b);
+        if (!nprocs) b->bad = 1;    /* every job saved has a member */
+        if (b->bad) break;
+
+        Job *j = NULL;
+        if (apply) {
+            j = job_alloc(pgid, 1);     /* no one waits on it here, so background */
+            intmap_del(&jobs_by_jid, j->jid);
+            j->jid = jid;
+            intmap_put(&jobs_by_jid, jid, j - jobs);
+            j->timed = timed;
+            j->nstages = nstages;
+            j->start = start;
+            j->cgroup = *cgroup ? strdup(cgroup) : NULL;
+            j->cmd_len = strlen(cmd);
+            j->cmd_off = jobstr_reserve(j->cmd_len + 1);
+            memcpy(jobstr + j->cmd_off, cmd, j->cmd_len + 1);
+        }
+        for (uint32_t k = 0; k < nprocs && !b->bad; ++k) {
+            pid_t pid = (pid_t)snap_get_u32(b);
+            pid_t pgrp = (pid_t)snap_get_u32(b);
+            job_status_t pstat = (job_status_t)snap_get_u32(b);
+            int wstatus = (int)snap_get_u32(b);
+            int foreign = (int)snap_get_u32(b);
+            struct rusage ru;
+            memset(&ru, 0, sizeof(ru));
+            ru.ru_utime = snap_get_timeval(b);
+            ru.ru_stime = snap_get_timeval(b);
+            ru.ru_maxrss = (long)snap_get_u64(b);
+            ru.ru_nvcsw = (long)snap_get_u64(b);
+            ru.ru_nivcsw = (long)snap_get_u64(b);
+            if (!apply) continue;
+
+            int i = job_add_pid(j, pid);
+            Proc *p = &j->procs[i];
+            p->wstatus = wstatus;
+            p->foreign = foreign;
+            p->ru = ru;
+            p->launched_ns = 0;
+            if (pstat == JOB_DONE || pid <= 0) {
+                p->status = JOB_DONE;   /* pump threads do not survive the shell */
+                j->nlive--;
+            } else {
+                p->status = pstat;
+                if (!ours) state_adopt(j, i, pgrp);
+            }
+        }
+        if (!apply) continue;
+        /* the status comes from member nstages-1: keep it among those loaded */
+        if (j->nstages < 0 || j->nstages > j->nprocs) j->nstages = j->nprocs;
+        job_update_status(j);
+    }
+    if (apply && jid_next > next_jid) next_jid = jid_next;
+    return b->bad ? -1 : 0;
+}
+
+/* Restore the snapshot at path (fd >= 0: read from fd instead). Jobs that
+ * finished while no shell watched them are reported and dropped. */
+static void state_restore(const char *path, int fd) {
+    SnapBuf b = { 0 };
+    struct stat st;
+    int own = fd < 0;
+    if (own && (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT) fprintf(stderr,"tsh: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &st) < 0 || !(b.buf = malloc((size_t)st.st_size + 1))) {
+        perror("tsh: snapshot");
+        if (own) close(fd);
+        return;
+    }
+    while (b.len < (size_t)st.st_size) {
+        ssize_t n = pread(fd, b.buf + b.len, (size_t)st.st_size - b.len, (off_t)b.len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        b.len += (size_t)n;
+    }
+    if (own) close(fd);
+
+    if (snap_load(&b, 0) < 0) {
+        fprintf(stderr,"tsh: %s: not a usable snapshot, ignored\n", path);
+    } else {
+        snap_load(&b, 1);
+        for (int i=0;i<jobs_cap;++i) {
+            if (!jobs[i].jid || jobs[i].status != JOB_DONE) continue;
+            job_notify(&jobs[i], "Done");
+            job_remove_jid(jobs[i].jid);
+        }
+        reap_children();        /* restart: children that exited meanwhile */
+    }
+    free(b.buf);
+}
+
+/* Startup: pick up TSH_STATE (kept from our children, which would
+ * otherwise restore and overwrite the same file) and any snapshot handed
+ * over by `restart`. */
+static void state_init(void) {
+    const char *env = getenv("TSH_STATE");
+    const char *handover = getenv("TSH_RESTORE");
+    if (env && *env) state_path = strdup(env);
+    unsetenv("TSH_STATE");
+    if (handover) {
+        int fd = atoi(handover);
+        unsetenv("TSH_RESTORE");
+        state_restore("restart", fd);
+        close(fd);
+    } else if (state_path) {
+        state_restore(state_path, -1);
+    }
+    if (!state_path && !handover) return;
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) perror("prctl");
+
+    /* a hangup or kill still writes the snapshot (ev_sigchld_fn) */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 || signalfd(ev_sigchld.fd, &mask, 0) < 0) perror("signalfd");
+}
+
+/* checkpoint [FILE]: write a snapshot now, to FILE or $TSH_STATE. */
+static int builtin_checkpoint(char **argv) {
+    const char *path = argv[1] ? argv[1] : state_path;
+    if (!path) { fprintf(stderr,"checkpoint: no FILE and TSH_STATE is not set\n"); return 2; }
+    return state_save(path) < 0;
+}
+
+/* restart [PATH]: re-exec the shell (PATH, by default the running binary)
+ * once the current line is done; see shell_restart. */
+static int builtin_restart(char **argv) {
+    if (!shell_interactive || getpid() != shell_pid) {
+        fprintf(stderr,"restart: only in an interactive shell\n");
+        return 1;
+    }
+    free(restart_path);
+    restart_path = strdup(argv[1] ? argv[1] : "/proc/self/exe");
+    return 0;
+}
+
+/* Hand the session to a fresh image of the shell: the snapshot goes in a
+ * memfd named by TSH_RESTORE. Returns only when the exec failed. */
+static void shell_restart(void) {
+    SnapBuf b = { 0 };
+    char num[16];
+    char *path = restart_path;
+    restart_path = NULL;
+
+    snap_build(&b);
+    struct iovec iov = { b.buf, b.len };
+    int fd = memfd_create("tsh-state", 0);
+    if (fd < 0 || write_iov(fd, &iov, 1) < 0) {
+        perror("restart");
+    } else {
+        snprintf(num, sizeof(num), "%d", fd);
+        setenv("TSH_RESTORE", num, 1);
+        if (state_path) setenv("TSH_STATE", state_path, 1);
+        fflush(NULL);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+        execv(path, shell_argv);
+        fprintf(stderr,"restart: %s: %s\n", path, strerror(errno));
+        unsetenv("TSH_RESTORE");
+        unsetenv("TSH_STATE");
+    }
+    if (fd >= 0) close(fd);
+    free(b.buf);
+    free(path);
+}
+
+enum {
+    BI_FORK = 1,            /* always runs in a forked child (threads, long-running) */
+};
+
+typedef struct {
+    const char *name;
+    int (*fn)(char **argv);
+    int flags;
+} Builtin;
+
+static const Builtin builtins[] = {
+    { "exit", builtin_exit, 0 },
+    { "cd",   builtin_cd,   0 },
+    { "pwd",  builtin_pwd,  0 },
+    { "find", builtin_find, BI_FORK },
+    { "parallel", builtin_parallel, BI_FORK },
+    { "hash", builtin_hash, 0 },
+    { "cache", builtin_cache, 0 },
+    { "ulimit", builtin_ulimit, 0 },
+    { "nice", builtin_nice, 0 },
+    { "affinity", builtin_affinity, 0 },
+    { "cgroup", builtin_cgroup, 0 },
+    { "jobs", builtin_jobs, 0 },
+    { "bg",   builtin_bg,   0 },
+    { "fg",   builtin_fg,   0 },
+    { "wait", builtin_wait, 0 },
+    { "set",  builtin_set,  0 },
+    { "history", builtin_history, 0 },
+    { "tsh-stats", builtin_tsh_stats, 0 },
+    { "checkpoint", builtin_checkpoint, 0 },
+    { "restart", builtin_restart, 0 },
+};
+
+static const Builtin *builtin_lookup(const char *name) {
+    if (!name) return NULL;
+    for (size_t i=0;i<sizeof(builtins)/sizeof(builtins[0]);++i)
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    return NULL;
+}
+
+/* Child-side failure (which redirection, or exec when path is NULL). A vfork
+ * child shares our memory, so it reports through this instead of stdio. */
+typedef struct {
+    int err;
+    const char *what;
+    const char *path;
+    int stale;              /* cached executable was gone; fell back to $PATH */
+    int fd;                 /* a copy of this fd failed, else -1 */
+} LaunchError;
+
+static void report_launch_error(const Command *c, const LaunchError *le) {
+    if (le->fd >= 0)
+        fprintf(stderr,"tsh: %d: %s\n", le->fd, strerror(le->err));
+    else if (le->path)
+        fprintf(stderr,"failed to open '%s' for %s: %s\n", le->path, le->what, strerror(le->err));
+    else if (le->what)
+        fprintf(stderr,"%s: %s\n", le->what, strerror(le->err));
+    else
+        fprintf(stderr,"execvp '%s' failed: %s\n", c->argv[0], strerror(le->err));
+}
+
+static int redir_flags(int op) {
+    switch (op) {
+    case R_OUT: case R_ALL: return O_WRONLY | O_CREAT | O_TRUNC;
+    case R_APPEND: case R_ALL_APPEND: return O_WRONLY | O_CREAT | O_APPEND;
+    case R_RW: return O_RDWR | O_CREAT;
+    default: return O_RDONLY;
+    }
+}
+
+/* What an open is for, in error messages. */
+static const char *redir_what(const Redir *r) {
+    if (r->op == R_IN || r->op == R_HERE || (r->op == R_RW && r->fd == 0)) return "input";
+    return r->fd == 2 ? "stderr" : "output";
+}
+
+/* The plan's copies of fds as they were (they all come before the first
+ * open) must name fds the command can see, not the shell's own, which are
+ * close-on-exec. Returns the first that is not, or -1. */
+static int redir_hidden_fd(const Command *c) {
+    for (int i=0;i<c->nplan && c->plan[i].op != STEP_OPEN;++i) {
+        int src = c->plan[i].src, fl;
+        if (c->plan[i].op != STEP_DUP || src <= 2) continue;
+        if ((fl = fcntl(src, F_GETFD)) < 0 || (fl & FD_CLOEXEC)) return src;
+    }
+    return -1;
+}
+
+/* Carry out c's redirection plan on this process's fds. The scratch fd is
+ * close-on-exec and above every fd the plan names. Returns -1 with le
+ * filled when a step fails. */
+static int redir_apply(const Command *c, LaunchError *le) {
+    int tmp = -1;
+    for (int i=0;i<c->nplan;++i) {
+        const RedirStep *st = &c->plan[i];
+        if (st->op == STEP_OPEN) {
+            const Redir *r = &c->redirs[st->src];
+            int fd = open(r->path, redir_flags(r->op) | (st->fd == REDIR_TMP ? O_CLOEXEC : 0), 0644);
+            if (fd < 0) { le->err = errno; le->what = redir_what(r); le->path = r->path; return -1; }
+            if (st->fd == REDIR_TMP) tmp = fd;
+            else if (fd != st->fd) { dup2(fd, st->fd); close(fd); }
+        } else if (st->op == STEP_DUP) {
+            int fd = st->fd == REDIR_TMP ? (tmp = fcntl(st->src, F_DUPFD_CLOEXEC, c->fd_max + 1))
+                                         : dup2(st->src == REDIR_TMP ? tmp : st->src, st->fd);
+            if (fd < 0) { le->err = errno; le->what = NULL; le->path = NULL; le->fd = st->src; return -1; }
+        } else {
+            close(st->fd == REDIR_TMP ? tmp : st->fd);
+        }
+    }
+    return 0;
+}
+
+/* Run a builtin in the shell with the command's pipes (in_fd/out_fd, or -1)
+ * and redirections applied; fds 0-2 and every fd the redirections set are
+ * saved first (above all of them) and put back afterwards, so no fork is
+ * needed. */
+static int run_builtin(const Builtin *b, Command *c, int in_fd, int out_fd) {
+    int nsave = 3;
+    int *fds = arena_alloc(&line_arena, (size_t)(c->nplan + 3) * 2 * sizeof(int)), *saved;
+    int status = 1;
+    TRACE_BEGIN(t);
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd=0;fd<3;++fd) fds[fd] = fd;
+    for (int i=0;i<c->nplan;++i) {
+        int fd = c->plan[i].fd, k = 0;
+        while (k < nsave && fds[k] != fd) k++;
+        if (fd >= 0 && k == nsave) fds[nsave++] = fd;
+    }
+    saved = fds + nsave;
+    for (int i=0;i<nsave;++i) saved[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, c->fd_max < 10 ? 10 : c->fd_max + 1);
+
+    if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+    if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+    LaunchError le = { 0, NULL, NULL, 0, -1 };
+    if ((le.fd = redir_hidden_fd(c)) >= 0) le.err = EBADF;
+    if (le.fd >= 0 || redir_apply(c, &le) < 0) report_launch_error(c, &le);
+    else status = b->fn(c->argv);
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i=0;i<nsave;++i) {
+        if (saved[i] >= 0) { dup2(saved[i], fds[i]); close(saved[i]); }
+        else close(fds[i]);
+    }
+    TRACE_END(TR_BUILTIN, t, 0);
+    return status;
+}
+
+/* Process launch engine.
+ *
+ * Children are started with posix_spawn (glibc implements it with
+ * clone(CLONE_VM|CLONE_VFORK), so no page tables are copied), with a plain
+ * vfork, or with the classic fork. The mode is picked at startup from
+ * $TSH_LAUNCH (spawn, vfork or fork); spawn is the default. Commands that
+ * posix_spawn cannot express (a stage made only of redirections) go through
+ * vfork instead.
+ */
+typedef enum { LAUNCH_SPAWN, LAUNCH_VFORK, LAUNCH_FORK } launch_mode_t;
+
+static launch_mode_t launch_mode = LAUNCH_SPAWN;
+
+/* Start gate of a parallel launch (set -o parlaunch): each child reports in
+ * on ready and then waits on the pipe until the shell closes the other end. */
+typedef struct {
+    int ready;              /* eventfd, one count per child at the gate */
+    int wait;               /* read end: EOF opens the gate */
+    int hold;               /* write end, kept by the shell only */
+} LaunchGate;
+
+/* Everything a child needs between fork and exec. Built by the parent so the
+ * vfork/fork child only issues async-signal-safe syscalls. */
+typedef struct {
+    Command *cmd;
+    pid_t pgid;             /* 0: child becomes group leader */
+    int in_fd;              /* fd to place on stdin, or -1 */
+    int out_fd;             /* fd to place on stdout, or -1 */
+    const int *close_fds;   /* parent fds a child that runs a builtin must not keep */
+    int nclose;
+    const char *path;       /* resolved executable, set by launch_command */
+    int foreground;         /* hand the terminal to the new group before exec */
+    int (*run)(char **argv);    /* builtin run in a forked child instead of exec */
+    const Limits *lim;      /* resource prefixes, or NULL */
+    int cgroup_fd;          /* the job cgroup's cgroup.procs, or -1 */
+    const LaunchGate *gate; /* parallel launch: wait here first, or NULL */
+    pid_t *gate_pid;        /* where the gated (vfork) child leaves its pid */
+    int status;             /* set by launch_command when no child was made:
+                             * 127 not found, else 1 as a failed child exits */
+} LaunchSpec;
+
+static const int launch_default_sigs[] = { SIGINT, SIGTSTP, SIGQUIT, SIGTTIN, SIGTTOU, SIGCHLD };
+
+static void launch_mode_init(void) {
+    const char *m = getenv("TSH_LAUNCH");
+    if (!m || !*m) return;
+    if (strcmp(m, "spawn") == 0) launch_mode = LAUNCH_SPAWN;
+    else if (strcmp(m, "vfork") == 0) launch_mode = LAUNCH_VFORK;
+    else if (strcmp(m, "fork") == 0) launch_mode = LAUNCH_FORK;
+    else fprintf(stderr,"tsh: unknown TSH_LAUNCH '%s', using spawn\n", m);
+}
+
+/* Apply a job's resource prefixes to this child: join the job's cgroup
+ * first, so everything after is accounted there. */
+static int child_limits(const LaunchSpec *ls, LaunchError *le) {
+    const Limits *l = ls->lim;
+    const char *what = NULL;
+    if (ls->cgroup_fd >= 0 && write(ls->cgroup_fd, "0", 1) < 0) what = "cgroup";
+    for (int i=0;!what && i<l->nrlim;++i) {
+        struct rlimit rl = { l->rlim[i].val, l->rlim[i].val };
+        if (setrlimit(ulimits[l->rlim[i].opt].res, &rl) < 0) what = "ulimit";
+    }
+    if (!what && l->has_nice && setpriority(PRIO_PROCESS, 0, getpriority(PRIO_PROCESS, 0) + l->nice) < 0) what = "nice";
+    if (!what && l->cpus && sched_setaffinity(0, sizeof(l->cpuset), &l->cpuset) < 0) what = "affinity";
+    if (!what) return 0;
+    le->err = errno; le->what = what; le->path = NULL;
+    return -1;
+}
+
+/* Runs in the child (fork or vfork). Returns only on failure, with le filled. */
+static void child_setup_and_exec(const LaunchSpec *ls, const sigset_t *mask, LaunchError *le) {
+    Command *c = ls->cmd;
+
+    /* a gated child tells the shell it exists, then waits while the shell
+     * sets the group (into ls->pgid, shared memory) and starts the rest */
+    if (ls->gate) {
+        uint64_t one = 1;
+        char ch;
+        close(ls->gate->hold);
+        *ls->gate_pid = getpid();
+        if (write(ls->gate->ready, &one, sizeof(one)) < 0) { /* cannot fail on an eventfd */ }
+        while (read(ls->gate->wait, &ch, 1) < 0 && errno == EINTR) {}
+    }
+
+    /* without job control (scripts) children stay in the shell's group */
+    if (shell_interactive && setpgid(0, ls->pgid) < 0) { /* parent sets it too */ }
+    /* take the terminal while SIGTTOU is still blocked, before the program
+     * can race the parent to read from it */
+    if (shell_interactive && ls->foreground) tcsetpgrp(STDIN_FILENO, ls->pgid ? ls->pgid : getpid());
+
+    /* restore default signals in child so it reacts to Ctrl-C/Ctrl-Z */
+    for (size_t i=0;i<sizeof(launch_default_sigs)/sizeof(launch_default_sigs[0]);++i)
+        signal(launch_default_sigs[i], SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    if (ls->lim && child_limits(ls, le) < 0) return;
+
+    if (ls->in_fd >= 0) dup2(ls->in_fd, STDIN_FILENO);
+    if (ls->out_fd >= 0) dup2(ls->out_fd, STDOUT_FILENO);
+    for (int i=0;i<ls->nclose;++i) close(ls->close_fds[i]);
+
+    if (redir_apply(c, le) < 0) return;
+
+    if (!c->argv[0]) _exit(0);
+    if (ls->run) {
+        int status = ls->run(c->argv);
+        fflush(NULL);
+        _exit(status);
+    }
+    execve(ls->path, c->argv, environ);
+    if (errno == ENOENT && ls->path != c->argv[0]) {
+        le->stale = 1;
+        execvp(c->argv[0], c->argv);
+    }
+    le->err = errno; le->what = NULL; le->path = NULL;
+}
+
+/* posix_spawn reports one errno for the whole file-action list plus exec;
+ * replay the opens, and check the fds copied, to tell the user which step
+ * actually failed. */
+static void diagnose_spawn_failure(const Command *c, int err, LaunchError *le) {
+    for (int i=0;i<c->nplan;++i) {
+        const RedirStep *st = &c->plan[i];
+        if (st->op == STEP_DUP && err == EBADF && fcntl(st->src, F_GETFD) < 0) {
+            le->err = err; le->what = NULL; le->path = NULL; le->fd = st->src;
+            return;
+        }
+        if (st->op != STEP_OPEN) continue;
+        const Redir *r = &c->redirs[st->src];
+        int fd = open(r->path, redir_flags(r->op) | O_CLOEXEC, 0644);
+        if (fd < 0) { le->err = errno; le->what = redir_what(r); le->path = r->path; return; }
+        close(fd);
+    }
+    le->err = err; le->what = NULL; le->path = NULL;
+}
+
+static pid_t launch_spawn(const LaunchSpec *ls, LaunchError *le) {
+    Command *c = ls->cmd;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t defsigs, mask;
+    pid_t pid = -1;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+
+    sigemptyset(&defsigs);
+    for (size_t i=0;i<sizeof(launch_default_sigs)/sizeof(launch_default_sigs[0]);++i)
+        sigaddset(&defsigs, launch_default_sigs[i]);
+    sigemptyset(&mask);
+    posix_spawnattr_setflags(&attr, (shell_interactive ? POSIX_SPAWN_SETPGROUP : 0) |
+                                    POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, ls->pgid);
+    posix_spawnattr_setsigdefault(&attr, &defsigs);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    /* runs with all signals blocked, so a background child may take the tty */
+    if (shell_interactive && ls->foreground) posix_spawn_file_actions_addtcsetpgrp_np(&fa, STDIN_FILENO);
+    if (ls->in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, ls->in_fd, STDIN_FILENO);
+    if (ls->out_fd >= 0) posix_spawn_file_actions_adddup2(&fa, ls->out_fd, STDOUT_FILENO);
+    for (int i=0;i<ls->nclose;++i) posix_spawn_file_actions_addclose(&fa, ls->close_fds[i]);
+    /* the redirection plan, step for step (one without a scratch fd) */
+    for (int i=0;i<c->nplan;++i) {
+        const RedirStep *st = &c->plan[i];
+        if (st->op == STEP_OPEN)
+            posix_spawn_file_actions_addopen(&fa, st->fd, c->redirs[st->src].path, redir_flags(c->redirs[st->src].op), 0644);
+        else if (st->op == STEP_DUP) posix_spawn_file_actions_adddup2(&fa, st->src, st->fd);
+        else posix_spawn_file_actions_addclose(&fa, st->fd);
+    }
+
+    TRACE_BEGIN(t);
+    int err = posix_spawn(&pid, ls->path, &fa, &attr, c->argv, environ);
+    TRACE_END(TR_SPAWN, t, err ? -1 : pid);
+    if (err != 0) {
+        diagnose_spawn_failure(c, err, le);
+        pid = -1;
+    }
+
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    return pid;
+}
+
+static pid_t launch_fork(const LaunchSpec *ls, int use_vfork, LaunchError *le) {
+    sigset_t all, old, childmask;
+
+    /* keep handlers from running in a child that shares our memory */
+    sigfillset(&all);
+    sigemptyset(&childmask);    /* the shell's SIGCHLD block must not leak */
+    sigprocmask(SIG_BLOCK, &all, &old);
+
+    TRACE_BEGIN(t);
+    pid_t pid = use_vfork ? vfork() : fork();
+    if (pid == 0) {
+        child_setup_and_exec(ls, &childmask, le);
+        if (!use_vfork) report_launch_error(ls->cmd, le);
+        _exit(1);
+    }
+    int saved = errno;
+    TRACE_END(TR_SPAWN, t, pid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0) { errno = saved; perror(use_vfork ? "vfork" : "fork"); return -1; }
+
+    /* setpgid for child too: a forked child may not have run yet */
+    if (!use_vfork && shell_interactive && setpgid(pid, ls->pgid ? ls->pgid : pid) < 0) { /* ignore possible races */ }
+    return pid;
+}
+
+/* Start one command as described by ls. Returns the child's pid, or -1 when
+ * no child was created (the error has been reported, ls->status says what
+ * $? it stands for). A child that failed after vfork/fork exits 1 and is
+ * returned like any other; a failed posix_spawn counts the same. */
+static pid_t launch_command(LaunchSpec *ls) {
+    LaunchError le = { 0, NULL, NULL, 0, -1 };
+    launch_mode_t mode = launch_mode;
+    Command *c = ls->cmd;
+    int cached = 0;
+    pid_t pid;
+
+    ls->status = 1;
+    fflush(stdout);     /* keep our buffered output ahead of the child's */
+    if ((le.fd = redir_hidden_fd(c)) >= 0) {
+        le.err = EBADF;
+        report_launch_error(c, &le);
+        return -1;
+    }
+    /* posix_spawn has no attributes for limits or affinity, and no action
+     * that picks a free fd */
+    if (mode == LAUNCH_SPAWN && (!c->argv[0] || ls->lim || c->plan_tmp)) mode = LAUNCH_VFORK;
+    const Builtin *b = builtin_lookup(c->argv[0]);
+    if (b) {
+        /* a subshell running shell code (maybe threads): needs a real fork */
+        ls->run = b->fn;
+        mode = LAUNCH_FORK;
+    } else if (c->argv[0]) {
+        TRACE_BEGIN(t);
+        ls->path = resolve_cmd(c, &cached);
+        TRACE_END(TR_RESOLVE, t, 0);
+        if (!ls->path) { fprintf(stderr,"%s: command not found\n", c->argv[0]); ls->status = 127; return -1; }
+    }
+    if (!b) ls->nclose = 0;     /* exec closes them: they are close-on-exec */
+
+    if (mode == LAUNCH_SPAWN) {
+        pid = launch_spawn(ls, &le);
+        if (pid < 0 && cached && le.err == ENOENT && !le.path) {
+            /* hashed binary disappeared: forget it and look it up again */
+            cmd_hash_remove(c->argv[0]);
+            ls->path = resolve_cmd(c, &cached);
+            if (!ls->path) { fprintf(stderr,"%s: command not found\n", c->argv[0]); ls->status = 127; return -1; }
+            pid = launch_spawn(ls, &le);
+        }
+        if (pid < 0) report_launch_error(c, &le);
+        return pid;
+    }
+    pid = launch_fork(ls, mode == LAUNCH_VFORK, &le);
+    /* only a vfork child can tell us (through shared memory) that the entry is stale */
+    if (le.stale) cmd_hash_remove(c->argv[0]);
+    if (pid > 0 && mode == LAUNCH_VFORK && le.err) report_launch_error(c, &le);
+    return pid;
+}
+
+/* Process substitutions and here-documents.
+ *
+ * Both reach a command as a /dev/fd/N path, made when its pipeline is about
+ * to run (see expand_commands): <(cmd) and >(cmd) one end of a pipe whose
+ * other end goes to cmd; a here-document or here-string a sealed memfd
+ * holding the text. The shell closes its copies of those fds as soon as the
+ * pipeline is launched, then starts each cmd as a member of the pipeline's
+ * job, after the stages: it shares the job's group and is waited for with
+ * it, while the last stage still decides the status.
+ */
+typedef struct {
+    const char *text;       /* the command, as typed */
+    int fd;                 /* its end of the pipe (close-on-exec) */
+    int out;                /* >(cmd): it reads */
+} ProcSub;
+
+static ProcSub *psubs;      /* of the pipeline being launched */
+static int npsubs, psubs_cap;
+static int *launch_fds;     /* fds the pipeline opens as /dev/fd/N */
+static int nlaunch_fds, launch_fds_cap;
+
+/* Let the pipeline's commands inherit fd; returns its path (in line_arena). */
+static char *launch_fd_path(int fd) {
+    if (nlaunch_fds == launch_fds_cap) {
+        launch_fds_cap = launch_fds_cap ? launch_fds_cap * 2 : 8;
+        launch_fds = realloc(launch_fds, (size_t)launch_fds_cap * sizeof(int));
+        if (!launch_fds) { perror("realloc"); exit(1); }
+    }
+    launch_fds[nlaunch_fds++] = fd;
+    fcntl(fd, F_SETFD, 0);
+    char *path = arena_alloc(&line_arena, 24);
+    snprintf(path, 24, "/dev/fd/%d", fd);
+    return path;
+}
+
+static void launch_fds_close(void) {
+    for (int i=0;i<nlaunch_fds;++i) close(launch_fds[i]);
+    nlaunch_fds = 0;
+}
+
+/* The pipe for process substitution word w; returns the pipeline's path to
+ * it, or NULL (reported). */
+static char *psub_open(const char *w) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) { perror("pipe"); return NULL; }
+    if (npsubs == psubs_cap) {
+        psubs_cap = psubs_cap ? psubs_cap * 2 : 4;
+        psubs = realloc(psubs, (size_t)psubs_cap * sizeof(ProcSub));
+        if (!psubs) { perror("realloc"); exit(1); }
+    }
+    ProcSub *ps = &psubs[npsubs++];
+    ps->text = w + 1;
+    ps->out = w[0] == CTL_PSUB_OUT;
+    ps->fd = ps->out ? p[0] : p[1];
+    return launch_fd_path(ps->out ? p[1] : p[0]);
+}
+
+static void psub_discard(void) {
+    for (int i=0;i<npsubs;++i) close(psubs[i].fd);
+    npsubs = 0;
+}
+
+/* A word as it runs (in line_arena): CTL_STATUS replaced by the status text
+ * st, a process substitution by the path to its pipe. *err is set when the
+ * pipe could not be made. */
+static char *expand_word(char *w, const char *st, int *err) {
+    if (w && (w[0] == CTL_PSUB_IN || w[0] == CTL_PSUB_OUT)) {
+        char *path = psub_open(w);
+        if (!path) *err = 1;
+        return path ? path : w;
+    }
+    if (!w || !strchr(w, CTL_STATUS)) return w;
+    size_t stlen = strlen(st), len = 0;
+    for (const char *q = w; *q; ++q) len += *q == CTL_STATUS ? stlen : 1;
+    char *out = arena_alloc(&line_arena, len + 1), *d = out;
+    for (const char *q = w; *q; ++q) {
+        if (*q == CTL_STATUS) { memcpy(d, st, stlen); d += stlen; }
+        else *d++ = *q;
+    }
+    *d = '\0';
+    return out;
+}
+
+/* writev all of iov[0..n), which it may modify. */
+static int write_iov(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--) w -= (ssize_t)iov->iov_len;
+        if (n > 0) { iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+    return 0;
+}
+
+/* A memfd with c's here-document or here-string (with $? as st), sealed so
+ * nothing can change it; returns the pipeline's path to it, or NULL. <<-
+ * drops leading tabs here, line by line, without copying the body. */
+static char *here_open(const Command *c, const char *st) {
+    struct iovec iov[64];
+    int n = 0, err = 0;
+    int fd = memfd_create("tsh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) { perror("memfd_create"); return NULL; }
+    if (c->here_flags & HERE_STRING) {
+        char *w = expand_word(c->here, st, &err);
+        iov[n++] = (struct iovec){ w, strlen(w) };
+        iov[n++] = (struct iovec){ "\n", 1 };
+    } else if (!(c->here_flags & HERE_STRIP)) {
+        iov[n++] = (struct iovec){ c->here, c->here_len };
+    } else {
+        for (char *p = c->here, *end = p + c->here_len; p < end && !err; ) {
+            while (p < end && *p == '\t') p++;
+            char *nl = memchr(p, '\n', (size_t)(end - p));
+            char *next = nl ? nl + 1 : end;
+            iov[n++] = (struct iovec){ p, (size_t)(next - p) };
+            if (n == 64) { err = write_iov(fd, iov, n) < 0; n = 0; }
+            p = next;
+        }
+    }
+    if (err || write_iov(fd, iov, n) < 0) {
+        perror("here-document");
+        close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return launch_fd_path(fd);
+}
+
+/* Set up a freshly forked copy of the shell to run shell code: it joins
+ * process group pgid (0: its own) and has no job control, no jobs and an
+ * event loop of its own. */
+static void subshell_enter(pid_t pgid) {
+    if (shell_interactive) setpgid(0, pgid);
+    for (size_t i=0;i<sizeof(launch_default_sigs)/sizeof(launch_default_sigs[0]);++i)
+        signal(launch_default_sigs[i], SIG_DFL);
+    shell_interactive = 0;
+    shell_pid = getpid();       /* a shell of its own, without the session */
+    state_path = NULL;
+    spawners_forget();
+    for (int i=0;i<jobs_cap;++i) {
+        if (!jobs[i].jid) continue;
+        free(jobs[i].cgroup);   /* the parent's to remove */
+        jobs[i].cgroup = NULL;
+        job_remove_jid(jobs[i].jid);
+    }
+    /* the signalfd reports to whoever reads it, but the epoll instance is
+     * shared with the parent: make a fresh one */
+    close(ev_epfd);
+    close(ev_sigchld.fd);
+    ev_input.fd = -1;
+    ev_init();
+    /* hangups are the parent's to save the session on (state_init) */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/* Start psubs[i] in group pgid. A lone external command is launched like a
+ * stage; anything else runs in a subshell. */
+static pid_t psub_launch(int i, Node *root, pid_t pgid) {
+    ProcSub *ps = &psubs[i];
+    Command *c = root->kind == NODE_PIPELINE && root->ncmds == 1 && !root->lim && !root->timed ? &root->cmds[0] : NULL;
+    if (c && c->argv[0] && !c->expand && !c->here_flags && !builtin_lookup(c->argv[0])) {
+        LaunchSpec ls = { c, pgid, ps->out ? ps->fd : -1, ps->out ? -1 : ps->fd, NULL, 0, NULL, 0, NULL, NULL, -1, NULL, NULL, 0 };
+        return launch_command(&ls);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        subshell_enter(pgid);
+        dup2(ps->fd, ps->out ? STDIN_FILENO : STDOUT_FILENO);
+        for (int k=i;k<npsubs;++k) close(psubs[k].fd);   /* earlier ones are closed already */
+        npsubs = 0;
+        int status = run_node(root);
+        fflush(NULL);
+        _exit(status);
+    }
+    if (pid < 0) { perror("fork"); return -1; }
+    if (shell_interactive) setpgid(pid, pgid);
+    return pid;
+}
+
+/* The pipeline of job j is launched: let go of its /dev/fd ends and start
+ * its process substitutions. */
+static void psub_start(Job *j) {
+    launch_fds_close();
+    if (!npsubs) return;
+    j->nstages = j->nprocs;
+    for (int i=0;i<npsubs;++i) {
+        /* parsing writes into the text, which may be a cached line's */
+        size_t len = strlen(psubs[i].text);
+        char *text = arena_alloc(&line_arena, len + 1);
+        memcpy(text, psubs[i].text, len + 1);
+        ParsedLine pl;
+        int r = parse_line(text, &pl);
+        if (r < 0) fprintf(stderr,"parse error\n");
+        pid_t pid = r > 0 ? psub_launch(i, pl.root, j->pgid) : -1;
+        if (pid > 0) job_add_pid(j, pid);
+        close(psubs[i].fd);
+    }
+    npsubs = 0;
+}
+
+/* Execute single command (no pipeline). foreground flag indicates whether to make it foreground job.
+ * background_flag is separate: if background_flag=1, we don't wait, and job added as background.
+ */
+static int execute_single(Command *c, int foreground, const Node *n) {
+    struct timespec start;
+    char *cgroup = NULL;
+    int cgroup_fd = -1;
+    if (n->lim && n->lim->cgroup && !(cgroup = cgroup_create(n->lim, &cgroup_fd))) return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LaunchSpec ls = { c, 0, -1, -1, NULL, 0, NULL, foreground, NULL, n->lim, cgroup_fd, NULL, NULL, 0 };
+    TRACE_BEGIN(t);
+    pid_t pid = launch_command(&ls);
+    TRACE_END(TR_LAUNCH, t, pid);
+    if (cgroup_fd >= 0) close(cgroup_fd);
+    if (pid < 0) { cgroup_discard(cgroup); return ls.status; }
+
+    /* add job to table */
+    int jid = job_add(pid, n, !foreground);
+    Job *j = job_by_jid(jid);
+    job_add_pid(j, pid);
+    j->start = start;
+    j->timed = n->timed;
+    j->cgroup = cgroup;
+    psub_start(j);
+
+    if (!foreground) {
+        if (shell_interactive) printf("[%d] %d\n", j->jid, (int)pid);
+        return 0;   /* background: do not wait */
+    }
+    return wait_for_job(j);
+}
+
+/* Byte pumps (set -o fastpipes).
+ *
+ * With fastpipes on, pipeline pipes are enlarged with F_SETPIPE_SZ, and a
+ * stage that only copies a file into the pipeline (`cat FILE` or
+ * `cat < FILE` first) or out of it (`cat > FILE` or `cat >> FILE` last) is
+ * not started at all: a pump thread in the shell moves the bytes with
+ * splice, so they never pass through user space. A pump is a member of its
+ * job like a process; when it finishes it queues itself and wakes the event
+ * loop through an eventfd, and the member is marked done as if reaped.
+ */
+#define PUMP_CHUNK (1 << 20)
+
+typedef struct Pump {
+    int in_fd, out_fd;          /* owned; closed by the pump when it is done */
+    int jid, member;            /* job member the pump stands for */
+    int err;                    /* errno of a failed transfer, 0 on success */
+    struct Pump *next;          /* on pump_done once finished */
+} Pump;
+
+static pthread_mutex_t pump_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pump *pump_done;
+static EvSource ev_pump = { -1, NULL, NULL };
+static int pipe_fast_size;      /* F_SETPIPE_SZ target, -1 when unavailable */
+
+/* `cat FILE` or `cat < FILE` with nothing else: the file it would copy. */
+static const char *pump_source_file(const Command *c) {
+    if (!c->argv[0] || strcmp(c->argv[0], "cat") != 0 || c->nredirs > 1) return NULL;
+    if (!c->argv[1] && c->nredirs) {
+        const Redir *r = &c->redirs[0];
+        return (r->op == R_IN || r->op == R_HERE) && r->fd == 0 ? r->path : NULL;
+    }
+    if (!c->argv[1] || c->argv[2] || c->nredirs || c->argv[1][0] == '-') return NULL;
+    return c->argv[1];
+}
+
+/* `cat > FILE` or `cat >> FILE`: the redirection to the file it would fill. */
+static const Redir *pump_sink(const Command *c) {
+    if (!c->argv[0] || strcmp(c->argv[0], "cat") != 0 || c->argv[1] || c->nredirs != 1) return NULL;
+    const Redir *r = &c->redirs[0];
+    return (r->op == R_OUT || r->op == R_APPEND) && r->fd == 1 ? r : NULL;
+}
+
+static void pump_finish(Pump *pm) {
+    uint64_t one = 1;
+    close(pm->in_fd);
+    close(pm->out_fd);  /* readers see EOF now, before the shell hears of it */
+    pthread_mutex_lock(&pump_lock);
+    pm->next = pump_done;
+    pump_done = pm;
+    pthread_mutex_unlock(&pump_lock);
+    if (write(ev_pump.fd, &one, sizeof(one)) < 0) { /* counter already nonzero */ }
+}
+
+static void *pump_main(void *arg) {
+    Pump *pm = arg;
+    int use_splice = 1;
+    char *buf = NULL;
+
+    for (;;) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(pm->in_fd, NULL, pm->out_fd, NULL, PUMP_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            /* e.g. an O_APPEND sink: nothing moved, copy through a buffer */
+            if (n < 0 && errno == EINVAL) { use_splice = 0; continue; }
+        } else {
+            if (!buf && !(buf = malloc(PUMP_CHUNK))) { pm->err = errno; break; }
+            n = read(pm->in_fd, buf, PUMP_CHUNK);
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t w = write(pm->out_fd, buf + off, (size_t)(n - off));
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) { n = -1; break; }
+                off += w;
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EPIPE) pm->err = errno;   /* EPIPE: the reader quit, like cat's SIGPIPE */
+        if (n <= 0) break;
+    }
+    free(buf);
+    pump_finish(pm);
+    return NULL;
+}
+
+static void ev_pump_fn(EvSource *src, uint32_t events) {
+    uint64_t count;
+    (void)events;
+    if (read(src->fd, &count, sizeof(count)) < 0) { /* spurious wakeup */ }
+
+    pthread_mutex_lock(&pump_lock);
+    Pump *list = pump_done;
+    pump_done = NULL;
+    pthread_mutex_unlock(&pump_lock);
+
+    while (list) {
+        Pump *pm = list;
+        list = pm->next;
+        if (pm->err) fprintf(stderr,"tsh: pipe copy failed: %s\n", strerror(pm->err));
+        Job *j = job_by_jid(pm->jid);
+        if (j && pm->member < j->nprocs && j->procs[pm->member].status != JOB_DONE) {
+            Proc *p = &j->procs[pm->member];
+            job_status_t before = j->status;
+            p->status = JOB_DONE;
+            p->wstatus = pm->err ? 1 << 8 : 0;
+            j->nlive--;
+            job_changed(j, before);
+        }
+        free(pm);
+    }
+}
+
+/* Copy in_fd to out_fd on a pump thread as member `member` of job jid. */
+static void pump_start(int jid, int member, int in_fd, int out_fd) {
+    if (ev_pump.fd < 0) {
+        ev_pump.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev_pump.fn = ev_pump_fn;
+        if (ev_pump.fd < 0 || ev_add(&ev_pump, EPOLLIN) < 0) { perror("eventfd"); exit(1); }
+    }
+    Pump *pm = calloc(1, sizeof(Pump));
+    if (!pm) { perror("calloc"); exit(1); }
+    pm->in_fd = in_fd;
+    pm->out_fd = out_fd;
+    pm->jid = jid;
+    pm->member = member;
+
+    /* the thread takes no signals: SIGPIPE becomes EPIPE, the rest stay ours */
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&tid, &attr, pump_main, pm);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        pm->err = rc;
+        pump_finish(pm);
+    }
+}
+
+/* Open the file of a pump stage, reporting failures like a failed redirection. */
+static int pump_open(const char *path, int flags, const char *what) {
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) fprintf(stderr,"failed to open '%s' for %s: %s\n", path, what, strerror(errno));
+    return fd;
+}
+
+static void pipe_set_fast(int fd) {
+    if (pipe_fast_size == 0) {
+        /* as large as an unprivileged user may go, up to one pump chunk */
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+        pipe_fast_size = -1;
+        if (f) {
+            int max;
+            if (fscanf(f, "%d", &max) == 1) pipe_fast_size = max < PUMP_CHUNK ? max : PUMP_CHUNK;
+            fclose(f);
+        }
+    }
+    if (pipe_fast_size > 0) fcntl(fd, F_SETPIPE_SZ, pipe_fast_size);
+}
+
+/* Parallel launch (set -o parlaunch).
+ *
+ * The serial path starts stage i+1 only once stage i's spawn has returned,
+ * that is after its exec. Here the shell does all per-stage work first
+ * (pipes, path lookups, specs), then hands the stages to a pool of spawner
+ * threads that vfork them side by side. Every child stops at a gate before
+ * anything else; when all have reported in, the shell puts them in one
+ * group and closes the gate, and they set up their fds and exec together.
+ * A spawner stays suspended until its child has exec'd, so the pool grows
+ * to the longest pipeline run this way, up to PARLAUNCH_MAX stages; longer
+ * pipelines and those with builtin or pump stages start serially.
+ */
+#define PARLAUNCH_MAX 64
+#define SPAWNER_STACK (256 * 1024)
+
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spawn_go = PTHREAD_COND_INITIALIZER;     /* a batch was posted */
+static pthread_cond_t spawn_idle = PTHREAD_COND_INITIALIZER;   /* the batch is done */
+static LaunchSpec *spawn_specs;
+static LaunchError *spawn_errs;
+static int spawn_n, spawn_next;     /* batch size; next spec to take */
+static int spawn_left;              /* specs not yet back from vfork */
+static int nspawners;
+static int spawn_ready_fd = -1;     /* the gates' eventfd */
+
+static void *spawner_main(void *arg) {
+    sigset_t childmask;
+    (void)arg;
+    sigemptyset(&childmask);
+    pthread_mutex_lock(&spawn_lock);
+    for (;;) {
+        while (spawn_next >= spawn_n) pthread_cond_wait(&spawn_go, &spawn_lock);
+        LaunchSpec *ls = &spawn_specs[spawn_next];
+        LaunchError *le = &spawn_errs[spawn_next++];
+        pthread_mutex_unlock(&spawn_lock);
+
+        /* signals are blocked in this thread, so in the child too */
+        pid_t pid = vfork();
+        if (pid == 0) {
+            child_setup_and_exec(ls, &childmask, le);
+            _exit(1);
+        }
+        if (pid < 0) {
+            uint64_t one = 1;
+            le->err = errno; le->what = "vfork"; le->path = NULL;
+            *ls->gate_pid = -1;
+            if (write(ls->gate->ready, &one, sizeof(one)) < 0) { /* cannot fail on an eventfd */ }
+        }
+
+        pthread_mutex_lock(&spawn_lock);
+        if (--spawn_left == 0) pthread_cond_signal(&spawn_idle);
+    }
+    return NULL;
+}
+
+/* Grow the pool to n spawners; returns 0 when it could not. */
+static int spawners_reserve(int n) {
+    if (spawn_ready_fd < 0 && (spawn_ready_fd = eventfd(0, EFD_CLOEXEC)) < 0) return 0;
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, SPAWNER_STACK);
+    while (nspawners < n && pthread_create(&tid, &attr, spawner_main, NULL) == 0) nspawners++;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return nspawners >= n;
+}
+
+/* A forked subshell has none of the parent's threads, and must not share
+ * its eventfd. */
+static void spawners_forget(void) {
+    if (spawn_ready_fd >= 0) close(spawn_ready_fd);
+    spawn_ready_fd = -1;
+    pthread_mutex_init(&spawn_lock, NULL);
+    pthread_cond_init(&spawn_go, NULL);
+    pthread_cond_init(&spawn_idle, NULL);
+    spawn_n = spawn_next = spawn_left = 0;
+    nspawners = 0;
+}
+
+/* Can this pipeline be launched in parallel? Builtin stages need a real fork
+ * and pumps a serial setup. */
+static int parlaunch_ok(Command cmds[], int num_cmds) {
+    if (num_cmds < 2 || num_cmds > PARLAUNCH_MAX) return 0;
+    for (int i=0;i<num_cmds;++i)
+        if (builtin_lookup(cmds[i].argv[0])) return 0;
+    return spawners_reserve(num_cmds);
+}
+
+/* Start every stage of the pipeline through the spawners and the gate; pids
+ * get the started children in stage order. A stage that cannot start (not
+ * found, a bad fd) is reported and skipped, its neighbours see EOF or EPIPE
+ * as on the serial path; when that is the last stage, *last_failed gets
+ * the status it stands for. Returns the number started, -1 when no pipe
+ * could be made. */
+static int launch_parallel(Command cmds[], int num_cmds, int foreground, const Limits *lim,
+                           int cgroup_fd, pid_t *pids, int *last_failed) {
+    int *fds = arena_alloc(&line_arena, (size_t)(num_cmds - 1) * 2 * sizeof(int));
+    LaunchSpec *specs = arena_alloc(&line_arena, (size_t)num_cmds * sizeof(LaunchSpec));
+    LaunchError *errs = arena_alloc(&line_arena, (size_t)num_cmds * sizeof(LaunchError));
+    pid_t *gpids = arena_alloc(&line_arena, (size_t)num_cmds * sizeof(pid_t));
+    int gate[2], npipes = 0, nspecs = 0, started = 0;
+    uint64_t count, ready = 0;
+    pid_t pgid = 0;
+
+    for (; npipes<num_cmds-1; ++npipes) {
+        if (pipe2(fds + 2*npipes, O_CLOEXEC) < 0) break;
+        if (opt_fastpipes) pipe_set_fast(fds[2*npipes + 1]);
+    }
+    if (npipes < num_cmds-1 || pipe2(gate, O_CLOEXEC) < 0) {
+        perror("pipe");
+        for (int i=0;i<2*npipes;++i) close(fds[i]);
+        return -1;
+    }
+    LaunchGate g = { spawn_ready_fd, gate[0], gate[1] };
+
+    fflush(stdout);     /* keep our buffered output ahead of the children's */
+    for (int i=0;i<num_cmds;++i) {
+        Command *c = &cmds[i];
+        LaunchError le = { 0, NULL, NULL, 0, -1 };
+        int cached = 0;
+        const char *path = NULL;
+        if ((le.fd = redir_hidden_fd(c)) >= 0) {
+            le.err = EBADF;
+            report_launch_error(c, &le);
+            if (i == num_cmds-1) *last_failed = 1;
+            continue;
+        }
+        if (c->argv[0] && !(path = resolve_cmd(c, &cached))) {
+            fprintf(stderr,"%s: command not found\n", c->argv[0]);
+            if (i == num_cmds-1) *last_failed = 127;
+            continue;
+        }
+        LaunchSpec ls = { c, 0, i ? fds[2*(i-1)] : -1, i < num_cmds-1 ? fds[2*i + 1] : -1, NULL, 0, path,
+                          foreground, NULL, lim, cgroup_fd, &g, &gpids[nspecs], 0 };
+        specs[nspecs] = ls;
+        errs[nspecs++] = le;
+    }
+
+    pthread_mutex_lock(&spawn_lock);
+    spawn_specs = specs;
+    spawn_errs = errs;
+    spawn_n = spawn_left = nspecs;
+    spawn_next = 0;
+    pthread_cond_broadcast(&spawn_go);
+    pthread_mutex_unlock(&spawn_lock);
+
+    while (ready < (uint64_t)nspecs)
+        if (read(spawn_ready_fd, &count, sizeof(count)) == (ssize_t)sizeof(count)) ready += count;
+
+    /* all are at the gate: group them before any can run */
+    for (int i=0;i<nspecs;++i) {
+        if (gpids[i] <= 0) continue;
+        if (!pgid) pgid = gpids[i];
+        if (shell_interactive) setpgid(gpids[i], pgid);
+        specs[i].pgid = pgid;
+    }
+    close(gate[1]);
+    close(gate[0]);
+    for (int i=0;i<2*npipes;++i) close(fds[i]);
+
+    pthread_mutex_lock(&spawn_lock);
+    while (spawn_left) pthread_cond_wait(&spawn_idle, &spawn_lock);
+    spawn_n = spawn_next = 0;
+    pthread_mutex_unlock(&spawn_lock);
+
+    for (int i=0;i<nspecs;++i) {
+        Command *c = specs[i].cmd;
+        if (errs[i].stale) cmd_hash_remove(c->argv[0]);
+        if (errs[i].err) report_launch_error(c, &errs[i]);
+        if (gpids[i] > 0) pids[started++] = gpids[i];
+        else if (c == &cmds[num_cmds-1]) *last_failed = 1;
+    }
+    return started;
+}
+
+/* Pipes are made as the stages start, close-on-exec: the shell holds at
+ * most the read end of the pipe into the next stage plus that stage's own
+ * pipe, and a child keeps only the ends placed on its stdin and stdout.
+ * When a pipe cannot be made no further stage starts; the shell lets go of
+ * its ends, so the stages already running see EOF or EPIPE and finish, and
+ * they are reaped as the job. */
+static int execute_pipeline(Command cmds[], int num_cmds, int background_flag, const Node *n) {
+    pid_t *pids = arena_alloc(&line_arena, (size_t)num_cmds * sizeof(pid_t));
+    int npids = 0;
+    pid_t pgid = 0;
+    struct timespec start;
+    char *cgroup = NULL;
+    int cgroup_fd = -1;
+
+    if (n->lim && n->lim->cgroup && !(cgroup = cgroup_create(n->lim, &cgroup_fd))) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* a builtin ending a foreground pipeline runs in the shell itself,
+     * reading the previous stage's pipe; earlier builtins get a subshell,
+     * and so does every stage of a job with resource prefixes or process
+     * substitutions */
+    const Builtin *last = background_flag ? NULL : builtin_lookup(cmds[num_cmds-1].argv[0]);
+    if (last && ((last->flags & BI_FORK) || n->lim || npsubs)) last = NULL;
+
+    /* fastpipes: a file copy at either end becomes a pump; keep at least
+     * one process so the job has a group to signal */
+    const char *src = NULL;
+    const Redir *sink = NULL;
+    int src_fd = -1, sink_fd = -1;
+    if (opt_fastpipes) {
+        src = pump_source_file(&cmds[0]);
+        sink = last ? NULL : pump_sink(&cmds[num_cmds-1]);
+        if (src && sink && num_cmds == 2) { src = NULL; sink = NULL; }
+        if (src) src_fd = pump_open(src, O_RDONLY, "input");
+        if (sink) sink_fd = pump_open(sink->path, redir_flags(sink->op), "output");
+    }
+
+    int prev = -1;              /* read end of the pipe into stage i */
+    int src_pipe = -1;          /* write end the source pump fills */
+    int setup_failed = 0;
+    int last_failed = 0;        /* $? of a last stage that could not start */
+    if (opt_parlaunch && !src && !sink && parlaunch_ok(cmds, num_cmds)) {
+        TRACE_BEGIN(t);
+        npids = launch_parallel(cmds, num_cmds, !background_flag, n->lim, cgroup_fd, pids, &last_failed);
+        TRACE_END(TR_LAUNCH, t, npids);
+        if (npids < 0) { npids = 0; setup_failed = 1; }
+        if (npids) pgid = pids[0];
+    } else {
+        for (int i=0;i<num_cmds;++i) {
+            int p[2] = { -1, -1 };
+            if (i == num_cmds-1 && (sink || last)) break;   /* prev goes to the pump or builtin */
+            if (i < num_cmds-1) {
+                TRACE_BEGIN(tp);
+                int r = pipe2(p, O_CLOEXEC);
+                TRACE_END(TR_PIPES, tp, 1);
+                if (r < 0) { perror("pipe"); setup_failed = 1; break; }
+                if (opt_fastpipes) pipe_set_fast(p[1]);
+            }
+            if (i == 0 && src) {
+                /* a source whose file failed to open behaves like a stage that
+                 * exited at once */
+                if (src_fd >= 0) src_pipe = p[1];
+                else close(p[1]);
+            } else {
+                /* only a child that does not exec (a builtin) has to close what
+                 * the shell still holds */
+                int close_fds[2], nclose = 0;
+                if (p[0] >= 0) close_fds[nclose++] = p[0];
+                if (src_pipe >= 0) close_fds[nclose++] = src_pipe;
+                LaunchSpec ls = { &cmds[i], pgid, prev, p[1], close_fds, nclose, NULL, !background_flag,
+                                  NULL, n->lim, cgroup_fd, NULL, NULL, 0 };
+                TRACE_BEGIN(t);
+                pid_t pid = launch_command(&ls);
+                TRACE_END(TR_LAUNCH, t, pid);
+                if (pid > 0) pids[npids++] = pid;
+                else if (i == num_cmds-1) last_failed = ls.status;
+                if (pid > 0 && pgid == 0) pgid = pid; /* first started child leads the group */
+                if (prev >= 0) close(prev);
+                if (p[1] >= 0) close(p[1]);
+            }
+            prev = p[0];
+        }
+    }
+    if (cgroup_fd >= 0) close(cgroup_fd);
+    if (setup_failed || (sink && sink_fd < 0)) {
+        if (prev >= 0) close(prev);
+        prev = -1;
+    }
+    if (setup_failed) {
+        last = NULL;
+        if (src_fd >= 0) close(src_fd);
+        if (src_pipe >= 0) close(src_pipe);
+        if (sink_fd >= 0) close(sink_fd);
+        src_fd = sink_fd = -1;
+    }
+
+    int status = setup_failed ? 1 : last_failed ? last_failed : 127;
+    if (pgid == 0) {
+        cgroup_discard(cgroup);
+        if (last) status = run_builtin(last, &cmds[num_cmds-1], prev, -1);
+        if (prev >= 0) close(prev);
+        if (src_fd >= 0) { close(src_fd); close(src_pipe); }
+        if (sink_fd >= 0) close(sink_fd);
+        return status;
+    }
 
-/* Globals for shell */
-static Job jobs[MAX_JOBS];
-static int next_jid = 1;
-static pid_t shell_pgid;
-static struct termios shell_tmodes;
-static volatile sig_atomic_t sigchld_flag = 0; /* set by SIGCHLD handler */
+    /* After starting all children, add job entry. Members stay in stage
+     * order, so the last one decides the job's status. */
+    int jid = job_add(pgid, n, background_flag);
+    Job *j = job_by_jid(jid);
+    int src_member = src_fd >= 0 ? job_add_pid(j, 0) : -1;
+    for (int i=0;i<npids;++i) job_add_pid(j, pids[i]);
+    if (last_failed) {
+        /* a member already done, so the job's status is that stage's */
+        Proc *p = &j->procs[job_add_pid(j, 0)];
+        p->status = JOB_DONE;
+        p->wstatus = last_failed << 8;
+        j->nlive--;
+    }
+    j->start = start;
+    j->timed = n->timed;
+    j->cgroup = cgroup;
+    if (src_fd >= 0) pump_start(jid, src_member, src_fd, src_pipe);
+    if (sink_fd >= 0) pump_start(jid, job_add_pid(j, 0), prev, sink_fd);
+    psub_start(j);
 
-/* Helper declarations */
-static char *trim(char *s);
-static void space_operators(const char *in, char *out, size_t outsz);
-static int tokenize(char *buf, char *tokens[], int max_tokens);
-static int parse_pipeline(char *tokens[], int ntokens, Command cmds[], int max_cmds);
-static int handle_builtins(Command *c);
-static void execute_single(Command *c, int foreground);
-static void execute_pipeline(Command cmds[], int num_cmds, int foreground, int background_flag, char *orig_line);
-static void sigchld_handler(int sig);
-static void check_sigchld_and_reap(void);
+    /* the job exists first, so children reaped meanwhile (fg) are tracked */
+    if (last) {
+        status = run_builtin(last, &cmds[num_cmds-1], prev, -1);
+        close(prev);
+    }
 
-/* Job table helpers */
-static int job_add(pid_t pgid, const char *cmdline, int bg) {
-    for (int i = 0; i < MAX_JOBS; ++i) {
-        if (jobs[i].jid == 0) {
-            jobs[i].jid = next_jid++;
-            jobs[i].pgid = pgid;
-            jobs[i].status = JOB_RUNNING;
-            jobs[i].is_background = bg;
-            strncpy(jobs[i].cmdline, cmdline, CMDLINE_LEN-1);
-            jobs[i].cmdline[CMDLINE_LEN-1] = '\0';
-            return jobs[i].jid;
-        }
+    if (background_flag) {
+        if (shell_interactive) printf("[%d] %d\n", j->jid, (int)pgid);
+        return setup_failed;    /* don't wait; leave processes running in background */
     }
-    return -1; /* no slot */
+    int job_status = wait_for_job(j);
+    return setup_failed ? 1 : last ? status : job_status;
 }
 
-static Job* job_by_jid(int jid) {
-    for (int i=0;i<MAX_JOBS;++i) if (jobs[i].jid == jid) return &jobs[i];
-    return NULL;
-}
+/* A builtin run in the shell is timed with the shell's own usage. */
+static int run_builtin_timed(const Builtin *b, Command *c, int timed) {
+    struct timespec t0, t1;
+    struct rusage r0, r1;
+    if (!timed) return run_builtin(b, c, -1, -1);
 
-static Job* job_by_pgid(pid_t pgid) {
-    for (int i=0;i<MAX_JOBS;++i) if (jobs[i].jid != 0 && jobs[i].pgid == pgid) return &jobs[i];
-    return NULL;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    getrusage(RUSAGE_SELF, &r0);
+    int status = run_builtin(b, c, -1, -1);
+    getrusage(RUSAGE_SELF, &r1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    print_times(ts_elapsed(t0, t1), tv_sec(r1.ru_utime) - tv_sec(r0.ru_utime),
+                tv_sec(r1.ru_stime) - tv_sec(r0.ru_stime));
+    return status;
 }
 
-static void job_mark_done(pid_t pgid) {
-    Job *j = job_by_pgid(pgid);
-    if (j) { j->status = JOB_DONE; j->is_background = 0; }
-}
+/* Commands as they run: words expanded, here-documents and here-strings
+ * turned into files to open. The parsed ones are left as they are, so a
+ * script line can run again. NULL when an fd could not be made (reported). */
+static Command *expand_commands(Command *cmds, int ncmds) {
+    int any = 0, err = 0;
+    for (int i=0;i<ncmds;++i) any |= cmds[i].expand | cmds[i].here_flags;
+    if (!any) return cmds;
 
-static void job_mark_stopped(pid_t pgid) {
-    Job *j = job_by_pgid(pgid);
-    if (j) { j->status = JOB_STOPPED; }
+    char st[16];
+    snprintf(st, sizeof(st), "%d", last_status);
+    Command *out = arena_alloc(&line_arena, (size_t)ncmds * sizeof(Command));
+    for (int i=0;i<ncmds;++i) {
+        Command *c = &out[i];
+        *c = cmds[i];
+        if (c->expand) {
+            int argc = 0;
+            while (cmds[i].argv[argc]) argc++;
+            c->argv = arena_alloc(&line_arena, (size_t)(argc + 1) * sizeof(char *));
+            for (int k=0;k<=argc;++k) c->argv[k] = expand_word(cmds[i].argv[k], st, &err);
+        }
+        if (c->expand || c->here_flags) {
+            c->redirs = arena_alloc(&line_arena, (size_t)c->nredirs * sizeof(Redir));
+            for (int k=0;k<c->nredirs;++k) {
+                Redir *r = &c->redirs[k];
+                *r = cmds[i].redirs[k];
+                if (r->op == R_HERE && !(r->path = here_open(c, st))) err = 1;
+                else if (r->path) r->path = expand_word(r->path, st, &err);
+            }
+        }
+        if (err) return NULL;
+    }
+    return out;
 }
 
-static void job_mark_running(pid_t pgid) {
-    Job *j = job_by_pgid(pgid);
-    if (j) { j->status = JOB_RUNNING; }
+/* Run one pipeline: a lone builtin runs in the shell, anything else is launched. */
+static int run_pipeline(Node *n, int foreground) {
+    Command *cmds = expand_commands(n->cmds, n->ncmds);
+    const Builtin *b = cmds && n->ncmds == 1 ? builtin_lookup(cmds[0].argv[0]) : NULL;
+    int status;
+    if (!cmds) status = 1;
+    else if (b && !(b->flags & BI_FORK) && foreground && !n->lim && !npsubs) status = run_builtin_timed(b, &cmds[0], n->timed);
+    else if (n->ncmds == 1) status = execute_single(&cmds[0], foreground, n);
+    else status = execute_pipeline(cmds, n->ncmds, !foreground, n);
+    /* whatever a failed launch left behind */
+    launch_fds_close();
+    psub_discard();
+    return status;
 }
 
-static void job_remove_jid(int jid) {
-    Job *j = job_by_jid(jid);
-    if (!j) return;
-    j->jid = 0;
-    j->pgid = 0;
-    j->cmdline[0] = '\0';
-    j->status = JOB_DONE;
-    j->is_background = 0;
-}
+/* `a && b &`: run an and-or list in a forked copy of the shell, as one
+ * background job. The subshell has no job control of its own; its children
+ * stay in its process group. */
+static void run_subshell_bg(Node *n) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        subshell_enter(0);
+        int status = run_node(n);
+        fflush(NULL);
+        _exit(status);
+    }
+    if (pid < 0) { perror("fork"); return; }
+    if (shell_interactive) setpgid(pid, pid);
 
-static void print_job_status(Job *j) {
-    if (!j) return;
-    const char *stat = (j->status == JOB_RUNNING) ? "Running" : (j->status == JOB_STOPPED) ? "Stopped" : "Done";
-    printf("[%d] %d %s\t%s\n", j->jid, j->pgid, stat, j->cmdline);
+    Job *j = job_by_jid(job_add_list(pid, n, 1));
+    job_add_pid(j, pid);
+    if (shell_interactive) printf("[%d] %d\n", j->jid, (int)pid);
 }
 
-static void sigchld_handler(int sig) {
-    (void)sig;
-    sigchld_flag = 1;
+/* Run a command list; returns (and sets $? to) the status of the last
+ * pipeline run. At the terminal, Ctrl-C on one pipeline skips the rest of
+ * the list, as in bash. */
+static int run_node(Node *n) {
+    switch (n->kind) {
+    case NODE_PIPELINE:
+        fg_interrupted = 0;
+        last_status = run_pipeline(n, 1);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        run_node(n->left);
+        if (shell_interactive && fg_interrupted) break;
+        if ((last_status == 0) == (n->kind == NODE_AND)) run_node(n->right);
+        break;
+    case NODE_SEQ:
+        run_node(n->left);
+        if (shell_interactive && fg_interrupted) break;
+        if (njobs) ev_dispatch(0);  /* reap finished background jobs */
+        run_node(n->right);
+        break;
+    case NODE_BG:
+        if (n->left->kind == NODE_PIPELINE) run_pipeline(n->left, 0);
+        else run_subshell_bg(n->left);
+        last_status = 0;
+        break;
+    }
+    return last_status;
 }
 
-static void check_sigchld_and_reap(void) {
-    if (!sigchld_flag) return;
-    sigchld_flag = 0;
+/* Run a whole script held in buf (len bytes, buf[len] writable). Every line
+ * is tokenized and parsed before the first one runs, so a syntax error
+ * anywhere stops the script before it has side effects.
+ */
+static int run_script(char *buf, size_t len, const char *name) {
+    size_t nlines = 0, cap = 0, lineno = 0;
+    ParsedLine *lines = NULL;
+    int status = 0;
 
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        pid_t pgid = getpgid(pid);
-        if (pgid < 0) pgid = pid; /* fallback */
+    buf[len] = '\0';
+    for (char *p = buf, *end = buf + len; p < end; ) {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (nl) *nl = '\0';
+        if (nlines == cap) {
+            cap = cap ? cap * 2 : 256;
+            lines = realloc(lines, cap * sizeof(*lines));
+            if (!lines) { perror("realloc"); exit(1); }
+        }
+        int r = parse_line(p, &lines[nlines]);
+        lineno++;
+        if (r < 0) {
+            fprintf(stderr,"%s: line %zu: parse error\n", name, lineno);
+            status = 2;
+        }
+        p = nl ? nl + 1 : end;
+        if (r > 0) p = heredoc_read_buf(&lines[nlines], p, end, &lineno);
+        nlines++;
+    }
 
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            /* terminated */
-            job_mark_done(pgid);
-            Job *j = job_by_pgid(pgid);
-            if (j && j->is_background) {
-                printf("\n[%d]+ Done\t%s\n", j->jid, j->cmdline);
-            }
-        } else if (WIFSTOPPED(status)) {
-            job_mark_stopped(pgid);
-            Job *j = job_by_pgid(pgid);
-            if (j) {
-                printf("\n[%d]+ Stopped\t%s\n", j->jid, j->cmdline);
-            }
-        } else if (WIFCONTINUED(status)) {
-            job_mark_running(pgid);
-            /* maybe notify */
+    if (status == 0) {
+        /* what running a line allocates is dropped before the next one */
+        ArenaMark parsed = arena_mark(&line_arena);
+        for (size_t i=0;i<nlines;++i) {
+            if (njobs) ev_dispatch(0);  /* reap finished background jobs */
+            if (lines[i].root) run_node(lines[i].root);
+            arena_release(&line_arena, parsed);
         }
     }
+    arena_reset(&line_arena);
+    free(lines);
+    return status ? status : last_status;
 }
 
-static char *trim(char *s) {
-    if (!s) return s;
-    while (*s && isspace((unsigned char)*s)) s++;
-    if (*s == '\0') return s;
-    char *end = s + strlen(s) - 1;
-    while (end > s && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return s;
-}
+/* Map a script file privately (the parser writes NULs into it); fall back to
+ * reading it when it cannot be mapped or has no room for a terminator. */
+static int run_script_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { fprintf(stderr,"tsh: %s: %s\n", path, strerror(errno)); return 127; }
 
-static void space_operators(const char *in, char *out, size_t outsz) {
-    size_t inlen = strlen(in);
-    size_t j = 0;
-    for (size_t i=0;i<inlen && j+1<outsz;i++) {
-        if (in[i] == '|' || in[i] == '<') {
-            if (j+3 >= outsz) break;
-            out[j++] = ' ';
-            out[j++] = in[i];
-            out[j++] = ' ';
-        } else if (in[i] == '>') {
-            if (i+1<inlen && in[i+1] == '>') {
-                if (j+4>=outsz) break;
-                out[j++]=' '; out[j++]='>'; out[j++]='>'; out[j++]=' ';
-                i++;
-            } else {
-                if (j+3>=outsz) break;
-                out[j++]=' '; out[j++]='>'; out[j++]=' ';
-            }
-        } else if (in[i]=='2' && i+1<inlen && in[i+1]=='>') {
-            if (j+4>=outsz) break;
-            out[j++]=' '; out[j++]='2'; out[j++]='>'; out[j++]=' ';
-            i++;
-        } else {
-            out[j++] = in[i];
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0, maplen = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        st.st_size % sysconf(_SC_PAGESIZE) != 0) {
+        len = (size_t)st.st_size;
+        maplen = len + 1;   /* the tail of the last page is zero-filled */
+        buf = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) { buf = NULL; maplen = 0; }
+    }
+    if (!buf) {
+        size_t cap = 1 << 16;
+        len = 0;
+        buf = malloc(cap);
+        for (;;) {
+            if (!buf) { perror("malloc"); exit(1); }
+            if (len + 1 >= cap) { cap *= 2; buf = realloc(buf, cap); continue; }
+            ssize_t n = read(fd, buf + len, cap - len - 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            len += (size_t)n;
         }
     }
-    out[j] = '\0';
+    close(fd);
+
+    int status = run_script(buf, len, path);
+    if (maplen) munmap(buf, maplen); else free(buf);
+    return status;
+}
+
+/* Buffered line reader over an fd: large read() calls, lines handed out in
+ * place. A returned line stays valid until the next call. When the fd can be
+ * polled, the event loop runs while waiting so children are reaped and job
+ * notices appear without waiting for the next line. */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len, cap, start;
+    int eof;
+} LineReader;
+
+static void reader_init(LineReader *r, int fd) {
+    r->fd = fd;
+    r->cap = 1 << 16;
+    r->buf = malloc(r->cap);
+    if (!r->buf) { perror("malloc"); exit(1); }
+    r->len = r->start = 0;
+    r->eof = 0;
+    ev_watch_input(fd);
 }
 
-/* Tokenize by whitespace */
-static int tokenize(char *buf, char *tokens[], int max_tokens) {
-    int n=0;
-    char *saveptr=NULL;
-    char *t = strtok_r(buf, " \t", &saveptr);
-    while (t && n < max_tokens) {
-        tokens[n++] = t;
-        t = strtok_r(NULL, " \t", &saveptr);
+static char *reader_next_line(LineReader *r) {
+    for (;;) {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line, '\n', r->len - r->start);
+        if (nl) {
+            *nl = '\0';
+            r->start = (size_t)(nl + 1 - r->buf);
+            return line;
+        }
+        if (r->eof) {
+            if (r->start == r->len) return NULL;
+            r->buf[r->len] = '\0';  /* last line without a newline */
+            r->start = r->len;
+            return line;
+        }
+        /* keep only the partial line, then read more behind it */
+        r->len -= r->start;
+        memmove(r->buf, line, r->len);
+        r->start = 0;
+        if (r->len + 1 >= r->cap) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+            if (!r->buf) { perror("realloc"); exit(1); }
+        }
+        wait_for_input();
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) r->eof = 1;
+        else r->len += (size_t)n;
     }
-    return n;
 }
 
-/* Parse tokens into array of Command structs */
-static int parse_pipeline(char *tokens[], int ntokens, Command cmds[], int max_cmds) {
-    int cmd_idx = 0;
-    int arg_idx = 0;
-    if (ntokens == 0) return 0;
+/* Line editor.
+ *
+ * At a terminal, lines are read by this editor in raw mode (derived from
+ * the saved shell_tmodes, which are put back before a command runs).
+ * Keys: arrows, Home/End, ^A ^E ^B ^F to move; Backspace, Delete, ^D, ^K,
+ * ^U, ^W to delete; Up/Down or ^P/^N to walk the history; ^R for reverse
+ * incremental search; ^L to clear; ^C to drop the line; Tab to complete.
+ *
+ * Rendering is incremental: the editor remembers what the screen shows
+ * and, while the line fits on one row, moves the cursor to the first
+ * changed column and rewrites only from there, clearing a shorter tail
+ * with one ESC[K. Type-ahead and pastes are applied as a batch before the
+ * screen is touched. Input is read a byte at a time so that keys typed
+ * ahead of the next prompt stay in the terminal for the command that runs
+ * first. Longer lines scroll horizontally and are redrawn
+ * whole. Keys are read through the event loop, so children are reaped
+ * while the user types; a job notice clears the line, prints, and redraws
+ * it (ed_hide/ed_show).
+ *
+ * Tab completes the first word of a command from the builtins and the
+ * executables on $PATH, and other words from directory entries. Both come
+ * from a cache of directory listings read once and kept current with
+ * inotify: a change marks that directory stale and it is read again at
+ * the next completion that needs it, never per keypress.
+ */
+#define ED_MAX_DIRS 64          /* cached directories besides $PATH's */
 
-    memset(&cmds[cmd_idx], 0, sizeof(Command));
-    for (int i=0;i<ntokens;i++) {
-        char *t = tokens[i];
-        if (strcmp(t, "|") == 0) {
-            cmds[cmd_idx].argv[arg_idx] = NULL;
-            cmd_idx++;
-            if (cmd_idx >= max_cmds) { fprintf(stderr,"too many pipeline stages\n"); return -1; }
-            memset(&cmds[cmd_idx], 0, sizeof(Command));
-            arg_idx = 0;
-            continue;
+enum {
+    KEY_EOF = -1,
+    KEY_LEFT = 0x100, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DEL,
+};
+
+typedef struct {
+    char *name;
+    int isdir;
+} CompEntry;
+
+typedef struct {
+    char *path;
+    int wd;                     /* inotify watch, -1: unwatched, read every time */
+    int stale;
+    int in_path;                /* a $PATH directory: executables only */
+    CompEntry *ents;            /* sorted by name */
+    size_t n;
+    uint64_t used;              /* for evicting the least recently used */
+} CompDir;
+
+static CompDir *comp_dirs;
+static size_t comp_ndirs, comp_cap;
+static char *comp_pathvar;      /* $PATH the in_path directories came from */
+static uint64_t comp_clock, comp_epoch;
+static EvSource comp_inotify = { -1, NULL, NULL };
+
+typedef struct {
+    int active;                 /* editing a line in raw mode */
+    const char *prompt;
+    size_t plen;
+    char *buf;                  /* the line; buf[len] is NUL */
+    size_t len, cap, pos;
+    char *shown;                /* what the screen shows after the prompt */
+    size_t shown_len, shown_cap, shown_pos;
+    int shown_ok;               /* 0: screen unknown, redraw whole */
+    size_t cols;
+    char *out;                  /* escape sequences and text for one write */
+    size_t out_len, out_cap;
+    int ready;                  /* input known to be waiting */
+    size_t hidx;                /* history entry shown; hist_count: the new line */
+    char *saved;                /* the new line while browsing history */
+    int last_key;
+} LineEditor;
+
+static LineEditor ed;
+
+static int comp_cmp(const void *a, const void *b) {
+    return strcmp(((const CompEntry *)a)->name, ((const CompEntry *)b)->name);
+}
+
+static void comp_free_ents(CompDir *d) {
+    for (size_t i=0;i<d->n;++i) free(d->ents[i].name);
+    free(d->ents);
+    d->ents = NULL;
+    d->n = 0;
+}
+
+static void comp_read_dir(CompDir *d) {
+    size_t cap = 0;
+    comp_free_ents(d);
+    d->stale = 0;
+    DIR *dir = opendir(d->path);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        int isdir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+            struct stat st;
+            isdir = fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
         }
-        if (strcmp(t, "<") == 0) {
-            if (i+1>=ntokens) { fprintf(stderr,"syntax error: < without file\n"); return -1; }
-            cmds[cmd_idx].infile = tokens[++i];
-            continue;
+        if (d->in_path && (isdir || faccessat(dirfd(dir), name, X_OK, 0) != 0)) continue;
+        if (d->n == cap) {
+            cap = cap ? cap * 2 : 64;
+            CompEntry *e = realloc(d->ents, cap * sizeof(*e));
+            if (!e) break;
+            d->ents = e;
         }
-        if (strcmp(t, ">") == 0) {
-            if (i+1>=ntokens) { fprintf(stderr,"syntax error: > without file\n"); return -1; }
-            cmds[cmd_idx].outfile = tokens[++i];
-            cmds[cmd_idx].out_append = 0;
-            continue;
+        d->ents[d->n].name = strdup(name);
+        d->ents[d->n].isdir = isdir;
+        if (d->ents[d->n].name) d->n++;
+    }
+    closedir(dir);
+    qsort(d->ents, d->n, sizeof(*d->ents), comp_cmp);
+}
+
+static void comp_drop(size_t i) {
+    CompDir *d = &comp_dirs[i];
+    int shared = 0;
+    for (size_t k=0;k<comp_ndirs;++k) if (k != i && comp_dirs[k].wd == d->wd) shared = 1;
+    if (d->wd >= 0 && !shared) inotify_rm_watch(comp_inotify.fd, d->wd);
+    comp_free_ents(d);
+    free(d->path);
+    comp_dirs[i] = comp_dirs[--comp_ndirs];
+}
+
+static void comp_inotify_fn(EvSource *src, uint32_t events) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    (void)events;
+    while ((n = read(src->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ie = (const struct inotify_event *)p;
+            for (size_t i=0;i<comp_ndirs;++i) {
+                if (comp_dirs[i].wd != ie->wd) continue;
+                comp_dirs[i].stale = 1;
+                if (ie->mask & IN_IGNORED) comp_dirs[i].wd = -1;
+            }
+            p += sizeof(*ie) + ie->len;
         }
-        if (strcmp(t, ">>") == 0) {
-            if (i+1>=ntokens) { fprintf(stderr,"syntax error: >> without file\n"); return -1; }
-            cmds[cmd_idx].outfile = tokens[++i];
-            cmds[cmd_idx].out_append = 1;
-            continue;
+    }
+}
+
+/* The cached listing of path, read or refreshed as needed. An unwatched
+ * directory is read again once per completion (comp_epoch). */
+static CompDir *comp_dir(const char *path, int in_path) {
+    for (size_t i=0;i<comp_ndirs;++i) {
+        CompDir *d = &comp_dirs[i];
+        if (d->in_path != in_path || strcmp(d->path, path) != 0) continue;
+        if (d->stale || (d->wd < 0 && d->used < comp_epoch)) comp_read_dir(d);
+        d->used = ++comp_clock;
+        return d;
+    }
+
+    if (!in_path) {
+        size_t cached = 0, lru = 0;
+        for (size_t i=0;i<comp_ndirs;++i) {
+            if (comp_dirs[i].in_path) continue;
+            if (!cached++ || comp_dirs[i].used < comp_dirs[lru].used) lru = i;
         }
-        if (strcmp(t, "2>") == 0) {
-            if (i+1>=ntokens) { fprintf(stderr,"syntax error: 2> without file\n"); return -1; }
-            cmds[cmd_idx].errfile = tokens[++i];
-            continue;
+        if (cached >= ED_MAX_DIRS) comp_drop(lru);
+    }
+    if (comp_ndirs == comp_cap) {
+        comp_cap = comp_cap ? comp_cap * 2 : 32;
+        CompDir *d = realloc(comp_dirs, comp_cap * sizeof(*d));
+        if (!d) { perror("realloc"); exit(1); }
+        comp_dirs = d;
+    }
+    CompDir *d = &comp_dirs[comp_ndirs++];
+    memset(d, 0, sizeof(*d));
+    d->path = strdup(path);
+    d->in_path = in_path;
+    d->wd = -1;
+    if (comp_inotify.fd < 0) {
+        comp_inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        comp_inotify.fn = comp_inotify_fn;
+        if (comp_inotify.fd >= 0 && ev_add(&comp_inotify, EPOLLIN) < 0) {
+            close(comp_inotify.fd);
+            comp_inotify.fd = -1;
         }
-        /* normal arg */
-        if (arg_idx >= MAX_ARGS-1) { fprintf(stderr,"too many args\n"); return -1; }
-        cmds[cmd_idx].argv[arg_idx++] = t;
     }
-    cmds[cmd_idx].argv[arg_idx] = NULL;
-    return cmd_idx + 1;
+    if (comp_inotify.fd >= 0 && d->path)
+        d->wd = inotify_add_watch(comp_inotify.fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                  IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (d->path) comp_read_dir(d);
+    d->used = ++comp_clock;
+    return d;
+}
+
+/* Re-point the $PATH listings when $PATH changed. */
+static void comp_check_path(void) {
+    const char *path = getenv("PATH");
+    if (!path) path = "/usr/bin:/bin";
+    if (comp_pathvar && strcmp(comp_pathvar, path) == 0) return;
+    for (size_t i=comp_ndirs;i-- > 0;) if (comp_dirs[i].in_path) comp_drop(i);
+    free(comp_pathvar);
+    comp_pathvar = strdup(path);
 }
 
-/* Handle built-ins for single command. Return 1 if handled (no fork), 0 otherwise. */
-static int handle_builtins(Command *c) {
-    if (!c->argv[0]) return 0;
-    if (strcmp(c->argv[0], "exit") == 0) {
-        exit(0);
+typedef struct {
+    CompEntry *v;
+    size_t n, cap;
+} CompMatches;
+
+static void comp_add(CompMatches *m, char *name, int isdir) {
+    if (m->n == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 32;
+        CompEntry *v = realloc(m->v, m->cap * sizeof(*v));
+        if (!v) return;
+        m->v = v;
     }
-    if (strcmp(c->argv[0], "cd") == 0) {
-        if (!c->argv[1]) { fprintf(stderr,"cd: missing operand\n"); return 1; }
-        if (chdir(c->argv[1]) != 0) perror("cd");
-        return 1;
+    m->v[m->n].name = name;
+    m->v[m->n].isdir = isdir;
+    m->n++;
+}
+
+/* Entries of d starting with prefix (a binary search, then a scan). */
+static void comp_add_dir(CompMatches *m, const CompDir *d, const char *prefix, size_t plen) {
+    size_t lo = 0, hi = d->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(d->ents[mid].name, prefix, plen) < 0) lo = mid + 1; else hi = mid;
     }
-    if (strcmp(c->argv[0], "pwd") == 0) {
-        char buf[4096];
-        if (getcwd(buf,sizeof(buf))) printf("%s\n", buf);
-        else perror("pwd");
-        return 1;
+    for (; lo < d->n && strncmp(d->ents[lo].name, prefix, plen) == 0; ++lo) {
+        if (d->ents[lo].name[0] == '.' && prefix[0] != '.') continue;
+        comp_add(m, d->ents[lo].name, d->ents[lo].isdir);
     }
-    if (strcmp(c->argv[0], "find") == 0) {
-        if (!c->argv[1]) { fprintf(stderr,"find: missing filename\n"); return 1; }
-        char cmd[4096];
-        snprintf(cmd,sizeof(cmd),"find . -name \"%s\"", c->argv[1]);
-        system(cmd);
-        return 1;
+}
+
+static void comp_commands(CompMatches *m, const char *prefix, size_t plen) {
+    comp_check_path();
+    for (size_t i=0;i<sizeof(builtins)/sizeof(builtins[0]);++i)
+        if (strncmp(builtins[i].name, prefix, plen) == 0) comp_add(m, (char *)builtins[i].name, 0);
+    for (const char *p = comp_pathvar; ; ) {
+        const char *colon = strchr(p, ':');
+        size_t dlen = colon ? (size_t)(colon - p) : strlen(p);
+        char dir[PATH_MAX];
+        if (dlen < sizeof(dir)) {
+            memcpy(dir, dlen ? p : ".", dlen ? dlen : 1);
+            dir[dlen ? dlen : 1] = '\0';
+            comp_add_dir(m, comp_dir(dir, 1), prefix, plen);
+        }
+        if (!colon) break;
+        p = colon + 1;
     }
+}
 
-    /* fg and bg builtins: need job table */
-    if (strcmp(c->argv[0], "jobs") == 0) {
-        for (int i=0;i<MAX_JOBS;++i) if (jobs[i].jid) print_job_status(&jobs[i]);
-        return 1;
+/* Output buffer: one write() per refresh. */
+static void ed_put(const char *s, size_t n) {
+    if (ed.out_len + n > ed.out_cap) {
+        while (ed.out_len + n > ed.out_cap) ed.out_cap = ed.out_cap ? ed.out_cap * 2 : 1024;
+        ed.out = realloc(ed.out, ed.out_cap);
+        if (!ed.out) { perror("realloc"); exit(1); }
     }
-    if (strcmp(c->argv[0], "bg") == 0) {
-        if (!c->argv[1]) { fprintf(stderr,"bg: missing job spec\n"); return 1; }
-        char *s = c->argv[1];
-        if (s[0] != '%') { fprintf(stderr,"bg: job spec should be %%N\n"); return 1; }
-        int jid = atoi(s+1);
-        Job *j = job_by_jid(jid);
-        if (!j) { fprintf(stderr,"bg: no such job %d\n", jid); return 1; }
-        if (kill(-j->pgid, SIGCONT) < 0) perror("kill (SIGCONT)");
-        j->status = JOB_RUNNING;
-        j->is_background = 1;
-        printf("[%d]+ %s &\n", j->jid, j->cmdline);
-        return 1;
+    memcpy(ed.out + ed.out_len, s, n);
+    ed.out_len += n;
+}
+
+static void ed_puts(const char *s) {
+    ed_put(s, strlen(s));
+}
+
+/* Cursor n columns left ("\b" when that is shorter) or right. */
+static void ed_move(size_t from, size_t to) {
+    char seq[32];
+    if (to == from) return;
+    if (to + 1 == from) { ed_put("\b", 1); return; }
+    snprintf(seq, sizeof(seq), "\x1b[%zu%c", to < from ? from - to : to - from, to < from ? 'D' : 'C');
+    ed_puts(seq);
+}
+
+static void ed_flush(void) {
+    fflush(stdout);
+    find_write(STDOUT_FILENO, ed.out, ed.out_len);
+    ed.out_len = 0;
+}
+
+static void ed_refresh(void) {
+    if (ed.plen + ed.len + 1 >= ed.cols) {
+        /* longer than a row: show a window around the cursor */
+        size_t width = ed.cols > ed.plen + 1 ? ed.cols - ed.plen - 1 : 1;
+        size_t start = ed.pos >= width ? ed.pos - width + 1 : 0;
+        size_t n = ed.len - start < width ? ed.len - start : width;
+        ed_puts("\r");
+        ed_puts(ed.prompt);
+        ed_put(ed.buf + start, n);
+        ed_puts("\x1b[K");
+        ed_move(ed.plen + n, ed.plen + ed.pos - start);
+        ed.shown_ok = 0;
+        ed_flush();
+        return;
+    }
+    if (!ed.shown_ok) {
+        ed_puts("\r");
+        ed_puts(ed.prompt);
+        ed_puts("\x1b[K");
+        ed.shown_len = ed.shown_pos = 0;
     }
-    if (strcmp(c->argv[0], "fg") == 0) {
-        if (!c->argv[1]) { fprintf(stderr,"fg: missing job spec\n"); return 1; }
-        char *s = c->argv[1];
-        if (s[0] != '%') { fprintf(stderr,"fg: job spec should be %%N\n"); return 1; }
-        int jid = atoi(s+1);
-        Job *j = job_by_jid(jid);
-        if (!j) { fprintf(stderr,"fg: no such job %d\n", jid); return 1; }
-
-        /* bring to foreground */
-        /* send SIGCONT */
-        if (kill(-j->pgid, SIGCONT) < 0) perror("kill (SIGCONT)");
-        j->status = JOB_RUNNING;
-        j->is_background = 0;
-
-        /* give terminal control to job pgid */
-        if (tcsetpgrp(STDIN_FILENO, j->pgid) < 0) perror("tcsetpgrp fg");
-
-        /* wait for job to finish or stop */
-        int status;
-        while (1) {
-            pid_t w = waitpid(-j->pgid, &status, WUNTRACED);
-            if (w < 0) {
-                if (errno == ECHILD) break;
-            } else {
-                if (WIFSTOPPED(status)) {
-                    j->status = JOB_STOPPED;
-                    printf("[%d]+ Stopped\t%s\n", j->jid, j->cmdline);
-                    break;
-                } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    j->status = JOB_DONE;
-                    job_remove_jid(j->jid);
-                    break;
-                }
-            }
-        }
 
-        /* restore terminal to shell */
-        if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0) perror("tcsetpgrp restore");
-        return 1;
+    /* rewrite from the first column that differs */
+    size_t same = 0;
+    while (same < ed.len && same < ed.shown_len && ed.buf[same] == ed.shown[same]) same++;
+    if (same < ed.len || same < ed.shown_len) {
+        if (same > ed.shown_pos && same - ed.shown_pos <= 4) ed_put(ed.shown + ed.shown_pos, same - ed.shown_pos);
+        else ed_move(ed.shown_pos, same);
+        ed_put(ed.buf + same, ed.len - same);
+        if (ed.len < ed.shown_len) ed_puts("\x1b[K");
+        ed_move(ed.len, ed.pos);
+    } else {
+        ed_move(ed.shown_pos, ed.pos);
     }
 
-    return 0;
+    if (ed.len + 1 > ed.shown_cap) {
+        ed.shown_cap = ed.len + 1 > 256 ? ed.len + 1 : 256;
+        ed.shown = realloc(ed.shown, ed.shown_cap);
+        if (!ed.shown) { perror("realloc"); exit(1); }
+    }
+    memcpy(ed.shown, ed.buf, ed.len);
+    ed.shown_len = ed.len;
+    ed.shown_pos = ed.pos;
+    ed.shown_ok = 1;
+    if (ed.out_len) ed_flush();
 }
 
-/* Execute single command (no pipeline). foreground flag indicates whether to make it foreground job.
- * background_flag is separate: if background_flag=1, we don't wait, and job added as background.
- */
-static void execute_single(Command *c, int foreground) {
-    if (!c->argv[0]) return;
-    if (handle_builtins(c)) return;
+/* Around output printed while a line is being edited (job notices). */
+static void ed_hide(void) {
+    if (!ed.active) { printf("\n"); return; }
+    fflush(stdout);
+    find_write(STDOUT_FILENO, "\r\x1b[K", 4);
+    ed.shown_ok = 0;
+}
 
-    pid_t pid = fork();
-    if (pid < 0) { perror("fork"); return; }
-    if (pid == 0) {
-        /* child */
+static void ed_show(void) {
+    if (!ed.active) { printf("%s", "tsh> "); fflush(stdout); return; }
+    fflush(stdout);
+    ed_refresh();
+}
 
-        /* set child process group equal to its pid (new pgid) */
-        pid_t childpid = getpid();
-        if (setpgid(0, 0) < 0) {
-            /* ignore */
-        }
+static void ed_reserve(size_t n) {
+    if (ed.len + n + 1 <= ed.cap) return;
+    while (ed.len + n + 1 > ed.cap) ed.cap = ed.cap ? ed.cap * 2 : 256;
+    ed.buf = realloc(ed.buf, ed.cap);
+    if (!ed.buf) { perror("realloc"); exit(1); }
+}
 
-        /* restore default signals in child so it reacts to Ctrl-C/Ctrl-Z */
-        signal(SIGINT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
+static void ed_insert(const char *s, size_t n) {
+    ed_reserve(n);
+    memmove(ed.buf + ed.pos + n, ed.buf + ed.pos, ed.len - ed.pos + 1);
+    memcpy(ed.buf + ed.pos, s, n);
+    ed.len += n;
+    ed.pos += n;
+}
 
-        /* redirections */
-        if (c->infile) {
-            int fd = open(c->infile, O_RDONLY);
-            if (fd < 0) { fprintf(stderr,"failed to open '%s' for input: %s\n", c->infile, strerror(errno)); exit(1); }
-            dup2(fd, STDIN_FILENO); close(fd);
-        }
-        if (c->outfile) {
-            int flags = O_WRONLY | O_CREAT | (c->out_append ? O_APPEND : O_TRUNC);
-            int fd = open(c->outfile, flags, 0644);
-            if (fd < 0) { fprintf(stderr,"failed to open '%s' for output: %s\n", c->outfile, strerror(errno)); exit(1); }
-            dup2(fd, STDOUT_FILENO); close(fd);
-        }
-        if (c->errfile) {
-            int fd = open(c->errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) { fprintf(stderr,"failed to open '%s' for stderr: %s\n", c->errfile, strerror(errno)); exit(1); }
-            dup2(fd, STDERR_FILENO); close(fd);
+static void ed_delete(size_t from, size_t to) {
+    memmove(ed.buf + from, ed.buf + to, ed.len - to + 1);
+    ed.len -= to - from;
+    if (ed.pos > to) ed.pos -= to - from;
+    else if (ed.pos > from) ed.pos = from;
+}
+
+static void ed_set(const char *s, size_t n) {
+    ed.len = ed.pos = 0;
+    ed_reserve(n);
+    memcpy(ed.buf, s, n);
+    ed.buf[n] = '\0';
+    ed.len = ed.pos = n;
+}
+
+static int ed_poll(int wait_ms) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, wait_ms) > 0;
+}
+
+/* Next byte; wait_ms < 0 waits in the event loop, otherwise KEY_EOF when
+ * nothing arrives in time. */
+static int ed_byte(int wait_ms) {
+    unsigned char c;
+    if (!ed.ready) {
+        if (wait_ms < 0) wait_for_input();
+        else if (!ed_poll(wait_ms)) return KEY_EOF;
+    }
+    ed.ready = 0;
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        return n == 1 ? c : KEY_EOF;
+    }
+}
+
+static int ed_key(void) {
+    int c = ed_byte(-1);
+    if (c != 0x1b) return c;
+    /* escape sequence, or a lone ESC when nothing follows promptly */
+    int c1 = ed_byte(50);
+    if (c1 != '[' && c1 != 'O') return 0x1b;
+    int c2 = ed_byte(50);
+    if (c2 >= '0' && c2 <= '9') {
+        int c3 = ed_byte(50);
+        while (c3 >= '0' && c3 <= ';') c3 = ed_byte(50);   /* modifiers: ESC[1;5C */
+        if (c3 != '~') return c3 == 'C' ? KEY_RIGHT : c3 == 'D' ? KEY_LEFT : 0x1b;
+        return c2 == '3' ? KEY_DEL : c2 == '1' || c2 == '7' ? KEY_HOME : c2 == '4' || c2 == '8' ? KEY_END : 0x1b;
+    }
+    switch (c2) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    }
+    return 0x1b;
+}
+
+static void ed_history_step(int dir) {
+    size_t len;
+    if (dir < 0 && ed.hidx == 0) return;
+    if (dir > 0 && ed.hidx >= hist_count) return;
+    if (ed.hidx == hist_count) {
+        free(ed.saved);
+        ed.saved = strndup(ed.buf, ed.len);
+    }
+    ed.hidx = dir < 0 ? ed.hidx - 1 : ed.hidx + 1;
+    if (ed.hidx == hist_count) ed_set(ed.saved ? ed.saved : "", ed.saved ? strlen(ed.saved) : 0);
+    else {
+        const char *s = hist_entry(ed.hidx, &len);
+        ed_set(s, len);
+    }
+}
+
+/* ^R: search backwards as the query is typed. Returns the key that ended
+ * the search, to be handled as usual, with the match in the buffer. */
+static int ed_search(void) {
+    char q[256], prompt[320];
+    size_t qlen = 0, len;
+    ssize_t match = -1;
+    int failed = 0, c;
+    char *orig = strndup(ed.buf, ed.len);
+
+    for (;;) {
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", failed ? "failing " : "", (int)qlen, q);
+        ed.prompt = prompt;
+        ed.plen = strlen(prompt);
+        ed.shown_ok = 0;
+        if (match >= 0) {
+            const char *s = hist_entry((size_t)match, &len);
+            ed_set(s, len);
+            const char *at = qlen ? memmem(s, len, q, qlen) : NULL;
+            ed.pos = at ? (size_t)(at - s) : len;
         }
+        ed_refresh();
 
-        execvp(c->argv[0], c->argv);
-        fprintf(stderr,"execvp '%s' failed: %s\n", c->argv[0], strerror(errno));
-        exit(1);
-    } else {
-        /* parent */
-        /* setpgid for child to ensure pgid set even if child hasn't called setpgid */
-        if (setpgid(pid, pid) < 0) {
-            /* ignore possible races */
-        }
-
-        /* add job to table */
-        char cmdline[CMDLINE_LEN];
-        strncpy(cmdline, c->argv[0], CMDLINE_LEN-1);
-        size_t pos = strlen(cmdline);
-        for (int i=1;c->argv[i];++i) {
-            strncat(cmdline, " ", CMDLINE_LEN-1 - pos);
-            pos = strlen(cmdline);
-            strncat(cmdline, c->argv[i], CMDLINE_LEN-1 - pos);
-            pos = strlen(cmdline);
-        }
-        int jid = job_add(pid, cmdline, !foreground);
-        Job *j = job_by_jid(jid);
-
-        if (!foreground) {
-            printf("[%d] %d\n", j->jid, (int)pid);
-            /* background: do not wait */
+        c = ed_key();
+        if (c == 0x12 || (c >= 0x20 && c < 0x7f && qlen < sizeof(q))) {     /* ^R: older */
+            size_t before = match >= 0 ? (size_t)match + (c != 0x12) : hist_count;
+            if (c != 0x12) q[qlen++] = (char)c;
+            ssize_t m = qlen ? hist_find(q, qlen, 0, before) : -1;
+            failed = qlen && m < 0;
+            if (m >= 0) match = m;
+        } else if (c == 0x7f || c == 0x08) {
+            if (qlen) qlen--;
+            match = qlen ? hist_find(q, qlen, 0, hist_count) : -1;
+            failed = qlen && match < 0;
+            if (!qlen) ed_set(orig, strlen(orig));
         } else {
-            /* foreground: give terminal control to child pgid */
-            if (tcsetpgrp(STDIN_FILENO, pid) < 0) {
-                /* warning but continue */
-            }
-
-            /* wait for process group to finish or stop */
-            int status;
-            while (1) {
-                pid_t w = waitpid(-pid, &status, WUNTRACED);
-                if (w < 0) {
-                    if (errno == ECHILD) break;
-                    continue;
-                }
-                if (WIFSTOPPED(status)) {
-                    j->status = JOB_STOPPED;
-                    j->is_background = 1;
-                    printf("\n[%d]+ Stopped\t%s\n", j->jid, j->cmdline);
-                    break;
-                } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    j->status = JOB_DONE;
-                    job_remove_jid(j->jid);
-                    break;
-                }
-            }
-            /* restore terminal to shell */
-            if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0) {
-                /* ignore */
-            }
+            break;
         }
     }
+    if (c == 0x07 || c == 0x1b) {       /* ^G, ESC: back to the line as it was */
+        ed_set(orig, strlen(orig));
+        c = 0;
+    }
+    free(orig);
+    ed.prompt = "tsh> ";
+    ed.plen = 5;
+    ed.shown_ok = 0;
+    return c;
 }
 
-static void execute_pipeline(Command cmds[], int num_cmds, int foreground, int background_flag, char *orig_line) {
-    int pipes[MAX_CMDS-1][2];
-    pid_t pids[MAX_CMDS];
-    pid_t pgid = 0;
+/* Tab: complete the word before the cursor, or list the choices when a
+ * second Tab makes no progress. */
+static void ed_complete(int listing) {
+    size_t start = ed.pos;
+    while (start > 0) {
+        char ch = ed.buf[start-1];
+        if (strchr(" \t|&;<>", ch) && !(start >= 2 && ed.buf[start-2] == '\\')) break;
+        start--;
+    }
+    size_t k = start;
+    while (k > 0 && (ed.buf[k-1] == ' ' || ed.buf[k-1] == '\t')) k--;
+    int command = k == 0 || strchr("|&;", ed.buf[k-1]);
 
-    /* create pipes */
-    for (int i=0;i<num_cmds-1;++i) {
-        if (pipe(pipes[i]) < 0) { perror("pipe"); return; }
+    /* the word as the lexer will see it (backslashes removed) */
+    char word[PATH_MAX];
+    size_t wlen = 0;
+    for (size_t i = start; i < ed.pos && wlen + 1 < sizeof(word); ++i) {
+        if (ed.buf[i] == '\'' || ed.buf[i] == '"') return;     /* quoted: leave alone */
+        if (ed.buf[i] == '\\' && i + 1 < ed.pos) i++;
+        word[wlen++] = ed.buf[i];
     }
+    word[wlen] = '\0';
 
-    for (int i=0;i<num_cmds;++i) {
-        pid_t pid = fork();
-        if (pid < 0) { perror("fork"); /* cleanup */ for (int k=0;k<i;k++) waitpid(pids[k],NULL,0); return; }
-        if (pid == 0) {
-            /* CHILD */
-            /* set process group: first child becomes leader */
-            if (i == 0) {
-                if (setpgid(0,0) < 0) { /* ignore */ }
-                pgid = getpid();
-            } else {
-                if (setpgid(0, pgid) < 0) { /* ignore */ }
-            }
+    CompMatches m = { NULL, 0, 0 };
+    const char *base = word;
+    comp_epoch = comp_clock + 1;
+    if (command && !strchr(word, '/')) {
+        comp_commands(&m, word, wlen);
+    } else {
+        char *slash = strrchr(word, '/');
+        char dir[PATH_MAX];
+        if (slash) {
+            size_t dlen = slash == word ? 1 : (size_t)(slash - word);
+            memcpy(dir, word, dlen);
+            dir[dlen] = '\0';
+            base = slash + 1;
+        } else {
+            strcpy(dir, ".");
+        }
+        comp_add_dir(&m, comp_dir(dir, 0), base, strlen(base));
+    }
+    size_t blen = strlen(base);
 
-            /* reset signals to default so children react to Ctrl-C/Ctrl-Z */
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGQUIT, SIG_DFL);
+    if (m.n) {
+        qsort(m.v, m.n, sizeof(*m.v), comp_cmp);
+        size_t u = 1;
+        for (size_t i=1;i<m.n;++i) if (strcmp(m.v[i].name, m.v[u-1].name) != 0) m.v[u++] = m.v[i];
+        m.n = u;
+    }
+    size_t common = m.n ? strlen(m.v[0].name) : 0;
+    for (size_t i=1;i<m.n;++i) {
+        size_t c = 0;
+        while (c < common && m.v[i].name[c] == m.v[0].name[c]) c++;
+        common = c;
+    }
 
-            /* Setup stdin from previous pipe if any */
-            if (i > 0) {
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            }
-            /* Setup stdout to next pipe if any */
-            if (i < num_cmds-1) {
-                dup2(pipes[i][1], STDOUT_FILENO);
-            }
+    if (m.n && (common > blen || m.n == 1)) {
+        for (size_t i = blen; i < common; ++i) {
+            char ch = m.v[0].name[i];
+            if (strchr(" \t\n|&;<>'\"\\#$", ch)) ed_insert("\\", 1);
+            ed_insert(&ch, 1);
+        }
+        if (m.n == 1) ed_insert(m.v[0].isdir ? "/" : " ", 1);
+    } else if (m.n > 1 && listing) {
+        size_t width = 0;
+        for (size_t i=0;i<m.n;++i) if (strlen(m.v[i].name) + 1 > width) width = strlen(m.v[i].name) + 1;
+        size_t per = ed.cols > width + 1 ? ed.cols / (width + 1) : 1;
+        ed_puts("\r\n");
+        for (size_t i=0;i<m.n;++i) {
+            size_t n = strlen(m.v[i].name);
+            ed_puts(m.v[i].name);
+            ed_puts(m.v[i].isdir ? "/" : " ");
+            for (; n + 1 < width + 1; ++n) ed_puts(" ");
+            if ((i + 1) % per == 0 || i + 1 == m.n) ed_puts("\r\n");
+        }
+        ed.shown_ok = 0;
+    } else {
+        ed_puts("\a");
+    }
+    free(m.v);
+}
 
-            /* Close all pipe fds in child */
-            for (int j=0;j<num_cmds-1;++j) { close(pipes[j][0]); close(pipes[j][1]); }
+static void ed_raw(int on) {
+    struct termios t = shell_tmodes;
+    if (on) {
+        t.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ISIG | IEXTEN);
+        t.c_iflag &= ~(tcflag_t)(ICRNL | INLCR | IGNCR | IXON);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &t);
+}
 
-            /* Apply per-command redirections (child-level) */
-            if (cmds[i].infile) {
-                int fd = open(cmds[i].infile, O_RDONLY);
-                if (fd < 0) { fprintf(stderr,"open infile '%s' failed: %s\n", cmds[i].infile, strerror(errno)); exit(1); }
-                dup2(fd, STDIN_FILENO); close(fd);
-            }
-            if (cmds[i].outfile) {
-                int flags = O_WRONLY | O_CREAT | (cmds[i].out_append ? O_APPEND : O_TRUNC);
-                int fd = open(cmds[i].outfile, flags, 0644);
-                if (fd < 0) { fprintf(stderr,"open outfile '%s' failed: %s\n", cmds[i].outfile, strerror(errno)); exit(1); }
-                dup2(fd, STDOUT_FILENO); close(fd);
-            }
-            if (cmds[i].errfile) {
-                int fd = open(cmds[i].errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0) { fprintf(stderr,"open errfile '%s' failed: %s\n", cmds[i].errfile, strerror(errno)); exit(1); }
-                dup2(fd, STDERR_FILENO); close(fd);
-            }
+/* Read one line at the terminal; NULL at end of input (^D on an empty
+ * line). The line stays valid until the next call. */
+static char *ed_readline(const char *prompt) {
+    struct winsize ws;
+    ed.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+    ed.prompt = prompt;
+    ed.plen = strlen(prompt);
+    ed.len = ed.pos = 0;
+    ed_reserve(0);
+    ed.buf[0] = '\0';
+    ed.shown_ok = 0;
+    ed.last_key = 0;
+    hist_sync();
+    ed.hidx = hist_count;
+    ed_raw(1);
+    ed.active = 1;
 
-            /* exec */
-            if (cmds[i].argv[0] == NULL) exit(0);
-            execvp(cmds[i].argv[0], cmds[i].argv);
-            fprintf(stderr,"execvp '%s' failed: %s\n", cmds[i].argv[0], strerror(errno));
-            exit(1);
-        } else {
-            /* PARENT */
-            /* setpgid for child (race: child may setpgid itself) */
-            if (i == 0) {
-                pgid = pid;
-                if (setpgid(pid, pgid) < 0) { /* ignore */ }
-            } else {
-                if (setpgid(pid, pgid) < 0) { /* ignore */ }
-            }
-            pids[i] = pid;
+    int eof = 0;
+    for (;;) {
+        ed.ready = ed_poll(0);
+        if (!ed.ready) ed_refresh();    /* batch typed-ahead keys */
+        int c = ed_key();
+        if (c == 0x12) c = ed_search();
 
-            /* parent closes pipe ends it doesn't need */
-            if (i > 0) close(pipes[i-1][0]);
-            if (i < num_cmds-1) close(pipes[i][1]);
+        if (c == '\r' || c == '\n') break;
+        if (c == KEY_EOF || (c == 0x04 && ed.len == 0)) { eof = 1; break; }
+        switch (c) {
+        case 0: case 0x1b: break;
+        case 0x01: case KEY_HOME: ed.pos = 0; break;
+        case 0x05: case KEY_END: ed.pos = ed.len; break;
+        case 0x02: case KEY_LEFT: if (ed.pos) ed.pos--; break;
+        case 0x06: case KEY_RIGHT: if (ed.pos < ed.len) ed.pos++; break;
+        case 0x7f: case 0x08: if (ed.pos) ed_delete(ed.pos - 1, ed.pos); break;
+        case 0x04: case KEY_DEL: if (ed.pos < ed.len) ed_delete(ed.pos, ed.pos + 1); break;
+        case 0x0b: ed_delete(ed.pos, ed.len); break;
+        case 0x15: ed_delete(0, ed.pos); break;
+        case 0x17: {
+            size_t k = ed.pos;
+            while (k && ed.buf[k-1] == ' ') k--;
+            while (k && ed.buf[k-1] != ' ') k--;
+            ed_delete(k, ed.pos);
+            break;
+        }
+        case 0x10: case KEY_UP: ed_history_step(-1); break;
+        case 0x0e: case KEY_DOWN: ed_history_step(1); break;
+        case 0x0c: ed_puts("\x1b[H\x1b[2J"); ed.shown_ok = 0; break;
+        case '\t': ed_complete(ed.last_key == '\t'); break;
+        case 0x03:
+            /* ^C: drop the line */
+            ed_move(ed.shown_pos, ed.shown_len);
+            ed_puts("^C\r\n");
+            ed.len = ed.pos = 0;
+            ed.buf[0] = '\0';
+            ed.shown_ok = 0;
+            ed.hidx = hist_count;
+            last_status = 130;
+            break;
+        default:
+            if (c >= 0x20 && c < 0x100) { char ch = (char)c; ed_insert(&ch, 1); }
+            break;
         }
+        ed.last_key = c;
     }
 
-    /* After forking all children, add job entry */
-    int jid = job_add(pgid, orig_line, background_flag);
-    Job *j = job_by_jid(jid);
+    ed.pos = ed.len;
+    ed_refresh();
+    ed_puts("\r\n");
+    ed_flush();
+    ed.active = 0;
+    ed_raw(0);
+    return eof ? NULL : ed.buf;
+}
 
-    if (background_flag) {
-        printf("[%d] %d\n", j->jid, (int)pgid);
-        /* don't wait; leave processes running in background */
-    } else {
-        /* foreground: give terminal control to pgid */
-        if (tcsetpgrp(STDIN_FILENO, pgid) < 0) perror("tcsetpgrp");
-
-        /* wait for the process group */
-        int status;
-        while (1) {
-            pid_t w = waitpid(-pgid, &status, WUNTRACED);
-            if (w < 0) {
-                if (errno == ECHILD) break;
-            } else {
-                if (WIFSTOPPED(status)) {
-                    job_mark_stopped(pgid);
-                    printf("\n[%d]+ Stopped\t%s\n", j->jid, j->cmdline);
-                    break;
-                } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    job_mark_done(pgid);
-                    job_remove_jid(j->jid);
-                    break;
-                }
-            }
+/* Use the editor when the terminal can take its escape sequences. */
+static int ed_init(void) {
+    const char *term = getenv("TERM");
+    if (term && strcmp(term, "dumb") == 0) return 0;
+    if (ev_watch_input(STDIN_FILENO) < 0) return 0;
+    return 1;
+}
+
+/* Run one line of interactive or piped input. A line seen before runs from
+ * the parse cache; otherwise a copy is parsed, so the line itself stays
+ * intact as the cache key. Here-document bodies are read with more(arg);
+ * a line that has them is not cached, since its bodies differ each time. */
+static void run_input_line(char *line, char *(*more)(void *), void *arg) {
+    ParsedLine pl;
+    size_t len;
+    line = trim(line);
+    uint64_t hash = cache_hash(line, &len);
+    CacheEntry *e = cache_get(line, len, hash);
+    if (!e) {
+        char *copy = line;
+        /* reading a body reuses the buffer the line lives in */
+        if (cache_max || strstr(line, "<<")) {
+            copy = arena_alloc(&line_arena, len + 1);
+            memcpy(copy, line, len + 1);
         }
-        /* restore terminal to shell */
-        if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0) perror("tcsetpgrp restore");
+        int r = parse_line(copy, &pl);
+        if (r < 0) { fprintf(stderr,"parse error\n"); last_status = 2; }
+        if (r > 0 && pl.heredocs) {
+            heredoc_read_lines(&pl, more, arg);
+            run_node(pl.root);
+        } else if (r > 0 && !(e = cache_put(line, len, hash, pl.root))) run_node(pl.root);
     }
+    if (e) {
+        cache_running = e;
+        run_node(e->root);
+        cache_release();
+    }
+    arena_reset(&line_arena);
+}
+
+/* More input for a here-document body: from the line editor when arg is
+ * NULL, else from the LineReader arg, with a continuation prompt. */
+static char *input_more(void *arg) {
+    if (!arg) return ed_readline("> ");
+    if (shell_interactive) { printf("> "); fflush(stdout); }
+    return reader_next_line(arg);
+}
+
+static void usage(void) {
+    fprintf(stderr,"usage: tsh [-c command | script]\n");
+    exit(2);
 }
 
 /* Main */
-int main(void) {
-    char raw[MAX_INPUT];
-    char spaced[MAX_INPUT*2];
-    char *tokens[MAX_TOKENS];
+int main(int argc, char **argv) {
+    const char *cmd_string = NULL, *script = NULL;
+    LineReader in;
+
+    if (argc > 1) {
+        if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) usage();
+            cmd_string = argv[2];
+        } else if (argv[1][0] == '-') {
+            usage();
+        } else {
+            script = argv[1];
+        }
+    }
+    shell_interactive = !cmd_string && !script && isatty(STDIN_FILENO);
+    shell_pid = getpid();
+    shell_argv = argv;
+
+    launch_mode_init();
+    ev_init();
+    state_init();
+    const char *fastpipes = getenv("TSH_FASTPIPES");
+    if (fastpipes && *fastpipes && strcmp(fastpipes, "0") != 0) opt_fastpipes = 1;
+    const char *parlaunch = getenv("TSH_PARLAUNCH");
+    if (parlaunch && *parlaunch && strcmp(parlaunch, "0") != 0) opt_parlaunch = 1;
+    const char *trace = getenv("TSH_TRACE");
+    if (trace && *trace && strcmp(trace, "0") != 0) opt_trace = 1;
 
-    /* Initialize job table */
-    memset(jobs, 0, sizeof(jobs));
+    if (!shell_interactive) {
+        int status = 0;
+        if (cmd_string) {
+            size_t len = strlen(cmd_string);
+            char *buf = malloc(len + 1);
+            if (!buf) { perror("malloc"); exit(1); }
+            memcpy(buf, cmd_string, len);
+            status = run_script(buf, len, "tsh -c");
+            free(buf);
+        } else if (script) {
+            status = run_script_file(script);
+        } else {
+            /* piped stdin: run lines as they arrive */
+            char *line;
+            reader_init(&in, STDIN_FILENO);
+            while ((line = reader_next_line(&in))) run_input_line(line, input_more, &in);
+            status = last_status;
+        }
+        fflush(stdout);
+        state_save_on_exit();
+        return status;
+    }
 
     /* Ensure shell is running in its own process group */
     shell_pgid = getpid();
@@ -561,17 +6313,8 @@ int main(void) {
         /* Might fail if already in pg, ignore */
     }
     /* Take control of terminal */
-    if (isatty(STDIN_FILENO)) {
-        tcsetpgrp(STDIN_FILENO, shell_pgid);
-        tcgetattr(STDIN_FILENO, &shell_tmodes);
-    }
-
-    /* Install signal handlers in shell: ignore SIGINT and SIGTSTP so shell doesn't terminate or stop */
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) < 0) perror("sigaction SIGCHLD");
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
 
     /* ignore SIGINT and SIGTSTP in shell */
     signal(SIGINT, SIG_IGN);
@@ -582,59 +6325,35 @@ int main(void) {
     signal(SIGTTOU, SIG_IGN);
     signal(SIGTTIN, SIG_IGN);
 
+    hist_open();
+    int editor = ed_init();
+    if (!editor) reader_init(&in, STDIN_FILENO);
     while (1) {
-        /* check and reap children from SIGCHLD */
-        check_sigchld_and_reap();
-
-        printf("tsh> ");
-        fflush(stdout);
-
-        if (!fgets(raw, sizeof(raw), stdin)) {
+        char *line;
+        if (editor) {
+            line = ed_readline("tsh> ");
+        } else {
+            printf("tsh> ");
+            fflush(stdout);
+            line = reader_next_line(&in);
+        }
+        if (!line) {
             printf("\nExiting TinyShell...\n");
             break;
         }
-        raw[strcspn(raw,"\n")] = '\0';
-        char *line = trim(raw);
-        if (!line || line[0] == '\0') continue;
+        line = trim(line);
+        if (line[0] == '\0') continue;
+        line = hist_expand(line);
+        if (!line) continue;
+        hist_add(line);
 
         /* quick exit */
         if (strcmp(line, "exit") == 0) break;
 
-        /* prepare spaced string so operators are tokens */
-        space_operators(line, spaced, sizeof(spaced));
-
-        /* tokenize */
-        int ntokens = tokenize(spaced, tokens, MAX_TOKENS);
-        if (ntokens == 0) continue;
-
-        /* detect background operator & : if last token is "&", mark background and remove it */
-        int background_flag = 0;
-        if (ntokens > 0 && strcmp(tokens[ntokens-1], "&") == 0) {
-            background_flag = 1;
-            tokens[ntokens-1] = NULL;
-            ntokens--;
-            if (ntokens == 0) continue;
-        }
-
-        /* parse into commands */
-        Command cmds[MAX_CMDS];
-        int ncmds = parse_pipeline(tokens, ntokens, cmds, MAX_CMDS);
-        if (ncmds < 0) { fprintf(stderr,"parse error\n"); continue; }
-        if (ncmds == 0) continue;
-
-        /* If single command, handle builtins (including fg/bg/jobs) */
-        if (ncmds == 1) {
-            /* check fg/bg builtins also via handle_builtins */
-            if (handle_builtins(&cmds[0])) {
-                /* builtin handled */
-            } else {
-                execute_single(&cmds[0], !background_flag);
-            }
-        } else {
-            /* pipeline: execute with background/foreground flag */
-            execute_pipeline(cmds, ncmds, !background_flag, background_flag, line);
-        }
+        run_input_line(line, input_more, editor ? NULL : &in);
+        if (restart_path) shell_restart();
     }
 
+    state_save_on_exit();
     return 0;
-}
\ No newline at end of file
+}